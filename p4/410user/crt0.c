@@ -14,6 +14,7 @@
 
 #define READLINE_MAGIC 0x15410f00
 #define CONSOLE_MAGIC 0x15410bad
+#define NO_NOTE_MAGIC 0x15410dea
 
 typedef union {
     message_t raw; 
@@ -38,13 +39,8 @@ void _main(int argc, char *argv[], void *stack_high, void *stack_low)
     exit(main(argc, argv));
 }
 
-// Leave ourselves a note about what our readline/print servers should be.
-int pre_exec() {
-    int mailbox;
-    if ((mailbox = udriv_register(UDR_ASSIGN_REQUEST, 0, 8)) < 0) {
-        goto fail;
-    }
-    
+// Leave a note in a mailbox about what our readline/print servers are.
+int leave_note(driv_id_t mailbox) {
     exec_msg_t msg;
     msg.magic = READLINE_MAGIC;
     msg.value = readline_get_server();
@@ -63,6 +59,24 @@ fail:
     return -1;
 }
 
+// Tell a child waiting in a mailbox that its note is not coming, so it keeps
+// whatever servers it has already been told about and the defaults.
+int leave_no_note(driv_id_t mailbox) {
+    exec_msg_t msg;
+    msg.magic = NO_NOTE_MAGIC;
+    msg.value = 0;
+    return udriv_send(mailbox, msg.raw, sizeof(exec_msg_t));
+}
+
+// Leave ourselves a note about what our readline/print servers should be.
+int pre_exec() {
+    int mailbox;
+    if ((mailbox = udriv_register(UDR_ASSIGN_REQUEST, 0, 8)) < 0) {
+        return -1;
+    }
+    return leave_note(mailbox);
+}
+
 // Retrieve the note about what our readline/print servers are.
 void post_exec() {
     exec_msg_t msg;
@@ -81,6 +95,8 @@ void post_exec() {
             case CONSOLE_MAGIC: 
                 console_set_server(msg.value); 
                 break;
+            case NO_NOTE_MAGIC:
+                return;
             default: continue;
         }
         recvd++;
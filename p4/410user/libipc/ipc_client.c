@@ -13,25 +13,14 @@ static int send_msg(driv_id_t src, driv_id_t dst, char* msg, size_t len) {
     request_msg_t req;
     response_msg_t resp;
     req.sender = src;
-    req.cmd = COMMAND_BYTE;
+    req.cmd = COMMAND_MSG;
     req.len = len;
-    if (len == 0) {
-        len++;
-    }
-
-    size_t i;
-    for (i = 0; i < len; i++) {
-        if (req.len) {
-            req.byte = msg[i];
-        }
-        if (udriv_send(dst, req.raw, sizeof(request_msg_t)) < 0) {
-            goto fail;
-        }
-    }
 
-    // Wait for a response saying the server will receive the message.
+    // Send the whole message and wait for a response saying the server will
+    // receive it. If the server is waiting it runs straight away.
     driv_id_t server;
-    if (udriv_wait(&server, &resp.raw, NULL) < 0) {
+    if (udriv_call(dst, req.raw, msg, len, &server, &resp.raw, NULL,
+                   NULL, 0) < 0) {
         goto fail;
     }
     if (server != src) {
@@ -56,31 +45,19 @@ static int recv_msg(driv_id_t dst, driv_id_t src, char* buf, size_t max, size_t*
     request_msg_t req;
     response_msg_t resp;
     resp.sender = dst;
-    size_t i = 0, len = max;
-    int acked = 0;
-    while (i < len) {
+    while (1) {
         // Receive a message, hopefully only for the server we expect!
         driv_id_t driver;
-        if (udriv_wait(&driver, &req.raw, NULL) < 0) {
+        unsigned int size;
+        int res = udriv_wait_buf(&driver, &req.raw, &size, buf, max);
+        if (res < 0) {
             return -1;
         }
         if (driver != dst) {
-            // Received a byte for the wrong sender.
+            // Received a message for the wrong sender.
             panic("client_recv: tid %d received message for wrong server %d", gettid(), driver);
         }
 
-        // Acknowledge the sender saying whether we can accept the message or not.
-        if (req.len > max) {
-            resp.status = STATUS_TOOBIG;
-            udriv_send(src, resp.raw, sizeof(response_msg_t));
-            return -1;
-        } else if (!acked) { 
-            acked = 1;
-            len = req.len;
-            resp.status = STATUS_OK;
-            udriv_send(src, resp.raw, sizeof(response_msg_t));
-        }
-
         // Handle various commands.
         if (req.cmd == COMMAND_PING) {
             continue;
@@ -89,17 +66,23 @@ static int recv_msg(driv_id_t dst, driv_id_t src, char* buf, size_t max, size_t*
             // Can't wake up a client.
             panic("client_recv: can't wakeup a client");
         }
-        if (req.cmd == COMMAND_CANCEL) {
+        if (req.cmd == COMMAND_CANCEL || res == 0) {
+            // Anything but a buffer message means the server gave up on us.
             return -1;
         }
-        
-        // Receive the byte.
-        ASSERT(req.cmd == COMMAND_BYTE);
-        buf[i++] = req.byte;
-    }
-    *_len = len;
 
-    return 0;
+        // Acknowledge the sender saying whether we can accept the message or not.
+        ASSERT(req.cmd == COMMAND_MSG);
+        if (req.len > max) {
+            resp.status = STATUS_TOOBIG;
+            udriv_send(src, resp.raw, sizeof(response_msg_t));
+            return -1;
+        }
+        resp.status = STATUS_OK;
+        udriv_send(src, resp.raw, sizeof(response_msg_t));
+        *_len = req.len;
+        return 0;
+    }
 }
     
 int ipc_client_send_msg(driv_id_t dst, void* msg, size_t len, void* resp, size_t max_resp_len) {
@@ -114,7 +97,7 @@ int ipc_client_send_msg(driv_id_t dst, void* msg, size_t len, void* resp, size_t
         return -1;
     }
 
-    size_t resp_len;
+    size_t resp_len = 0;
     if (max_resp_len > 0 && recv_msg(server, dst, resp, max_resp_len, &resp_len) < 0) {
         udriv_deregister(server);
         return -1;
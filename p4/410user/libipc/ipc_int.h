@@ -8,7 +8,8 @@
 #define ASSERT(x) assert(x)
 #define FITS(x, t) (x == (typeof(x))(t)x)
 
-#define COMMAND_BYTE 0
+// A whole message, sent as a udriv buffer message
+#define COMMAND_MSG 0
 #define COMMAND_CANCEL 1
 #define COMMAND_PING 2
 #define COMMAND_WAKEUP 3
@@ -18,7 +19,7 @@ typedef union {
         unsigned int sender;
         unsigned short len;
         unsigned char cmd;
-        unsigned char byte;
+        unsigned char unused;
     };
 } request_msg_t;
 
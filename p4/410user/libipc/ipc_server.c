@@ -26,9 +26,11 @@ typedef struct ipc_state {
     int clients_ready;  // how many clients have completed their message outside of receive
     int pending_wakeup; // whether we've been woken up outside of receive
     size_t buf_len;     // The minimum buffer size receive may be called with
+    char* scratch;      // buf_len bytes for messages received outside of receive
 } ipc_server_t;
 
-static void handle_client_message(ipc_state_t* state, request_msg_t* req, bool accept);
+static void handle_client_message(ipc_state_t* state, request_msg_t* req,
+                                  int has_buf, char* msg, bool accept);
 
 int ipc_server_init(ipc_state_t** pstate, driv_id_t req_server) {
     ipc_state_t* state = malloc(sizeof(ipc_state_t));
@@ -46,6 +48,7 @@ int ipc_server_init(ipc_state_t** pstate, driv_id_t req_server) {
     state->clients_ready = 0;
     state->pending_wakeup = 0;
     state->buf_len = 0;
+    state->scratch = NULL;
     *pstate = state;
     return 0;
 }
@@ -54,6 +57,7 @@ void ipc_server_deregister(ipc_state_t* state) {
     ASSERT(state != NULL);
     udriv_deregister(state->server);
     ipc_server_cancel(state);
+    free(state->scratch);
     free(state);
 }
 
@@ -74,30 +78,20 @@ int ipc_server_send_msg(ipc_state_t* state, driv_id_t dest, void* _msg, size_t l
     request_msg_t req;
     response_msg_t resp;
     req.sender = state->server;
-    req.cmd = COMMAND_BYTE;
+    req.cmd = COMMAND_MSG;
     req.len = len;
-    if (len == 0) {
-        len = 1;
-    } 
-    
-    // Send message byte by byte.
-    size_t i;
-    for (i = 0; i < len; i++) {
-        if (req.len) {
-            req.byte = msg[i];
-        }
-        if (udriv_send(dest, req.raw, sizeof(request_msg_t)) < 0) {
-            return -1;
-        }   
-    }
 
-    // Wait for a message from the client saying they received the message.
+    // Send the whole message and wait for a message from the client saying
+    // they received it. If the client is waiting it runs straight away.
+    driv_id_t server;
+    unsigned int size;
+    int res = udriv_reply_wait(dest, req.raw, msg, len, &server, &resp.raw,
+                               &size, state->scratch, state->buf_len);
     while (true) {
-        driv_id_t server;
-        if (udriv_wait(&server, &resp.raw, NULL) < 0) {
+        if (res < 0) {
             return -1;
         }
-        if (resp.sender == dest) {
+        if (res == 0 && resp.sender == dest) {
             if (resp.status == STATUS_OK) {
                 return 0;
             } else {
@@ -105,18 +99,14 @@ int ipc_server_send_msg(ipc_state_t* state, driv_id_t dest, void* _msg, size_t l
             }
         } else {
             // Got a message from a different client, don't drop it!
-            handle_client_message(state, (request_msg_t*)&resp, true);
+            handle_client_message(state, (request_msg_t*)&resp, res,
+                                  state->scratch, true);
         }
+        res = udriv_wait_buf(&server, &resp.raw, &size, state->scratch,
+                             state->buf_len);
     }
 }
 
-static senders_node_t* sender_find(senders_node_t* head, driv_id_t sender) {
-    if (head == NULL || head->sender == sender) {
-        return head;
-    } else {
-        return sender_find(head->next, sender);
-    }
-}
 static senders_node_t* sender_find_full(senders_node_t* head) {
     if (head == NULL || head->len == head->idx) {
         return head;
@@ -138,7 +128,26 @@ static void sender_remove(senders_node_t** phead, driv_id_t sender) {
     }
 }
 
-static void handle_client_message(ipc_state_t* state, request_msg_t* req, bool accept) {
+// Tell a client whether their message was accepted. Returns the status sent.
+static int accept_client_message(ipc_state_t* state, request_msg_t* req,
+                                 bool accept) {
+    response_msg_t resp;
+    resp.sender = state->server;
+    if (req->len > state->buf_len) {
+        // This message is too long for the buffers we receive into.
+        resp.status = STATUS_TOOBIG;
+    } else if (!accept) {
+        // Tell the sender if we're not accepting new messages.
+        resp.status = STATUS_NOACCEPT;
+    } else {
+        resp.status = STATUS_OK;
+    }
+    udriv_send(req->sender, resp.raw, sizeof(response_msg_t));
+    return resp.status;
+}
+
+static void handle_client_message(ipc_state_t* state, request_msg_t* req,
+                                  int has_buf, char* msg, bool accept) {
     response_msg_t resp;
     resp.sender = state->server;
 
@@ -150,48 +159,35 @@ static void handle_client_message(ipc_state_t* state, request_msg_t* req, bool a
         state->pending_wakeup = 1;
         return;
     }
-    ASSERT(req->cmd == COMMAND_BYTE);
-
-    // First check if this message is too long and return an error if so.
-    if (req->len > state->buf_len) {
-        resp.status = STATUS_TOOBIG;
-        udriv_send(req->sender, resp.raw, sizeof(response_msg_t));
+    ASSERT(req->cmd == COMMAND_MSG);
+    if (!has_buf) {
+        // Messages always arrive in buffers, so this is a stray response.
         return;
     }
 
-    // Add this byte to the sender's node, possibly allocating a new node if
-    // we've never seen this sender before.
-    senders_node_t* node = sender_find(state->senders, req->sender);
-    if (node == NULL) {
-        if (!accept) {
-            // Tell the sender if we're not accepting new messages.
-            resp.status = STATUS_NOACCEPT;
+    // Keep the whole message until receive is called.
+    senders_node_t* node = NULL;
+    if (req->len <= state->buf_len && accept) {
+        node = malloc(sizeof(senders_node_t) + req->len);
+        if (node == NULL) {
+            // Couldn't allocate a node, tell the sender we can't
+            // service their request right now.
+            resp.status = STATUS_NOMEM;
             udriv_send(req->sender, resp.raw, sizeof(response_msg_t));
             return;
-        } else {
-            node = malloc(sizeof(senders_node_t) + req->len);
-            if (node == NULL) {
-                // Couldn't allocate a node, tell the sender we can't 
-                // service their request right now.
-                resp.status = STATUS_NOMEM;
-                udriv_send(req->sender, resp.raw, sizeof(response_msg_t));
-                return;
-            } else {
-                node->sender = req->sender;
-                node->len = req->len;
-                node->idx = 0;
-                node->next = state->senders;
-                state->senders = node;
-                resp.status = STATUS_OK;
-                udriv_send(req->sender, resp.raw, sizeof(response_msg_t));
-            }
         }
     }
-    node->message[node->idx] = req->byte;
-    node->idx++;
-    if (node->idx == node->len) {
-        state->clients_ready++;
+    if (accept_client_message(state, req, accept) != STATUS_OK) {
+        free(node);
+        return;
     }
+    node->sender = req->sender;
+    node->len = req->len;
+    node->idx = req->len;
+    memcpy(node->message, msg, req->len);
+    node->next = state->senders;
+    state->senders = node;
+    state->clients_ready++;
 }
 
 int ipc_server_recv(ipc_state_t* state, driv_id_t* src, void* buffer, size_t max, bool accept) {
@@ -201,6 +197,11 @@ int ipc_server_recv(ipc_state_t* state, driv_id_t* src, void* buffer, size_t max
 
     if (state->buf_len < max) {
         // Grow our minimum buffer length if the caller increased it.
+        char* scratch = realloc(state->scratch, max);
+        if (scratch == NULL) {
+            return -1;
+        }
+        state->scratch = scratch;
         state->buf_len = max;
     } else if (state->buf_len == max) {
         // Buffer length stayed the same. Ok.
@@ -226,13 +227,21 @@ int ipc_server_recv(ipc_state_t* state, driv_id_t* src, void* buffer, size_t max
             break;
         }
 
-        // Wait for a new message and handle it appropriately.
+        // Wait for a new message, which arrives straight in the caller's
+        // buffer, and handle it appropriately.
         driv_id_t driver;
         request_msg_t req;
-        if (udriv_wait(&driver, &req.raw, NULL) < 0) {
+        unsigned int size;
+        int res = udriv_wait_buf(&driver, &req.raw, &size, buffer, max);
+        if (res < 0) {
             return -2;
         }
-        handle_client_message(state, &req, accept);
+        if (req.cmd != COMMAND_MSG || !res) {
+            handle_client_message(state, &req, res, buffer, accept);
+        } else if (accept_client_message(state, &req, accept) == STATUS_OK) {
+            if (src) *src = req.sender;
+            return req.len;
+        }
 
     // Loop if we're accepting clients or until the list of current clients is
     // empty.
@@ -260,11 +269,11 @@ void ipc_server_cancel(ipc_state_t* state) {
     response_msg_t resp;
     resp.status = STATUS_CANCELLED;
     senders_node_t* next, *node = state->senders;
-    do {
+    while (node != NULL) {
         udriv_send(node->sender, resp.raw, sizeof(response_msg_t));
         next = node->next;
         free(node);
-    } while ((node = next));
+        node = next;
+    }
     state->senders = NULL;
 }
-
@@ -0,0 +1,28 @@
+#include <syscall.h>
+
+extern int leave_note(driv_id_t mailbox);
+extern int leave_no_note(driv_id_t mailbox);
+extern int sys_spawn(char *execname, char *argvec[], int mailbox);
+int spawn(char *execname, char *argvec[])
+{
+    // The child is given a mailbox, and once it owns it we leave our note
+    // there, so it finds its servers just like a program which was exec'd.
+    // If we cannot get a mailbox the child falls back to the defaults.
+    int mailbox = udriv_register(UDR_ASSIGN_REQUEST, 0, 8);
+    int tid = sys_spawn(execname, argvec, mailbox);
+    if (mailbox < 0) {
+        return tid;
+    }
+    if (tid < 0) {
+        udriv_deregister(mailbox);
+        return tid;
+    }
+    // The child already owns the mailbox and waits for both halves of the
+    // note, so if we cannot finish it we tell the child to stop waiting. The
+    // mailbox holds more than the three messages this can send, so if that
+    // fails too the child has given up the mailbox and is not waiting.
+    if (leave_note(mailbox) < 0) {
+        leave_no_note(mailbox);
+    }
+    return tid;
+}
@@ -3,7 +3,7 @@
  *  @brief Initial program.
  *  @public yes
  *  @for p2 p3
- *  @covers fork exec wait print
+ *  @covers spawn wait print
  *  @status done
  */
 
@@ -17,10 +17,12 @@ int main()
   char * args[] = {shell, 0};
 
   while(1) {
-    pid = fork();
-    if (!pid)
-      exec(shell, args);
-    
+    pid = spawn(shell, args);
+    if (pid < 0) {
+      printf("Cannot start the shell; trying again...");
+      continue;
+    }
+
     while (pid != wait(&exitstatus));
   
     printf("Shell exited with status %d; starting it back up...", exitstatus);
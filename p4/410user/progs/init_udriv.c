@@ -31,22 +31,14 @@ extern void console_set_server(driv_id_t serv);
 // Synchronously begins a server
 int daemon_create(char *server_prog, char* arg, driv_id_t server_id)
 {
-    int server_tid = fork();
+    char* args1[] = {server_prog, 0};
+    char* args2[] = {server_prog, arg, 0};
+    char** args = arg == NULL ? args1 : args2; // yuck.
+    int server_tid = spawn(server_prog, args);
     if (server_tid < 0) {
         return -1;
     }
 
-    // if child server, begin program execution
-    if (!server_tid) {
-        char* args1[] = {server_prog, 0};
-        char* args2[] = {server_prog, arg, 0};
-        char** args = arg == NULL ? args1 : args2; // yuck.
-        if (exec(server_prog, args) < 0) {
-            // couldn't exec :(
-            return -2;
-        }
-    }
-
     while (ipc_ping(server_id) < 0) {
         yield(server_tid);
     }
@@ -3,7 +3,7 @@
  *  @brief The shell.
  *  @public yes
  *  @for p2 p3
- *  @covers fork exec wait set_status vanish print ls
+ *  @covers spawn wait set_status vanish print ls
  *  @status done
  */
 
@@ -31,7 +31,7 @@
 char prompt[]     = "[410-shell]$ ";
 char startmsg[]   = "Starting shell...\n";
 char exitmsg[]    = "Exiting shell...\n";
-char forkerrmsg[] = "Shell: Cannot fork process.\n";
+char spawnerrmsg[] = "Shell: Cannot start process.\n";
 char waitfailed[] = "wait() failed\n";
 char finished[]   = "Process finished\n";
 char too_long[]   = "That string is too long.\n";
@@ -109,15 +109,11 @@ main(int argc, char *argv[])
 
     while((cmd_argv[j++] = strtok(NULL, separators)));
 
-    pid = fork();
+    pid = spawn(cmd_argv[0], cmd_argv);
     if(pid < 0) {
-      print(sizeof(forkerrmsg), forkerrmsg);
+      print(sizeof(spawnerrmsg), spawnerrmsg);
       continue;
     }
-    if(pid == 0) {
-      exec(cmd_argv[0], cmd_argv);
-      exit(-1);
-    }
     else {
       if((ret = wait(&res)) < 0) {
         printf("\nshell: wait on process %d failed!\n", pid);
@@ -53,7 +53,9 @@ UPDATE_METHOD = afs
 # A list of the test programs you want compiled in from the user/progs
 # directory.
 #
-STUDENTTESTS = readline_server serial_server
+STUDENTTESTS = readline_server serial_server sched_bench fault_around_test \
+               udriv_share_test udriv_bench spawn_bench \
+               vfork_test
 
 ###########################################################################
 # Data files provided by course staff to build into the RAM disk
@@ -96,7 +98,11 @@ SYSCALL_OBJS = set_status.o vanish.o fork.o exec.o wait.o \
 			   get_ticks.o sleep.o swexn.o getchar.o readline.o  print.o \
 			   set_term_color.o set_cursor_pos.o get_cursor_pos.o \
                udriv_register.o udriv_deregister.o udriv_send.o udriv_wait.o \
-               udriv_inb.o udriv_outb.o udriv_mmap.o
+               udriv_inb.o udriv_outb.o udriv_mmap.o \
+               fault_around.o page_faults.o udriv_send_buf.o udriv_wait_buf.o \
+               udriv_call.o udriv_reply_wait.o udriv_share.o \
+               udriv_wait_many.o udriv_config.o udriv_dropped.o \
+               spawn.o vfork.o
 
 
 
@@ -117,18 +123,21 @@ AUTOSTACK_OBJS = autostack.o
 #
 KERN_SYSCALL = syscall/fork.o syscall/syscall.o syscall/exec.o syscall/swexn.o \
                syscall/halt.o syscall/console_syscalls.o syscall/wait_vanish.o \
-               syscall/readline.o
+               syscall/readline.o syscall/exec_index.o
 KERN_COMMON = common/int_hash.o common/malloc_wrappers.o common/console.o \
-              common/control_block.o common/get_esp.o common/atomic.o
-KERN_LOCK = lock/mutex.o lock/cond.o
+              common/control_block.o common/get_esp.o common/atomic.o \
+              common/obj_cache.o
+KERN_LOCK = lock/mutex.o lock/cond.o lock/spinlock.o lock/rmlock.o
 KERN_INTERRUPT = interrupt/fault_print.o interrupt/fault.o \
 				 interrupt/mode_switch.o interrupt/mode_switch_asm.o \
 				 interrupt/setup_idt.o
 KERN_SCHEDULER = scheduler/scheduler.o scheduler/switch_asm.o \
 				 scheduler/switch.o scheduler/sleep.o scheduler/timer.o
 KERN_VM = vm/vm_asm.o vm/frame_alloc.o vm/vm.o vm/vm_user.o vm/ppd.o \
-		  vm/page_fault.o
-KERN_UDRIV = udriv/device_drive.o udriv/send_wait.o udriv/registration.o
+		  vm/page_fault.o vm/tlb.o vm/program_cache.o
+KERN_UDRIV = udriv/device_drive.o udriv/send_wait.o udriv/registration.o \
+             udriv/mmap.o
+KERN_SMP = smp/cpu.o
 
 KERNEL_OBJS = kernel.o
 KERNEL_OBJS +=${KERN_SYSCALL}
@@ -138,6 +147,7 @@ KERNEL_OBJS +=${KERN_INTERRUPT}
 KERNEL_OBJS +=${KERN_SCHEDULER}
 KERNEL_OBJS +=${KERN_VM}
 KERNEL_OBJS +=${KERN_UDRIV}
+KERNEL_OBJS +=${KERN_SMP}
 
 ###########################################################################
 # WARNING: Do not put **test** programs into the REQPROGS variables.  Your
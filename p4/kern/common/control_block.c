@@ -17,12 +17,69 @@
 #include <cr.h>
 #include <contracts.h>
 #include <malloc_internal.h>
-#include <malloc_wrappers.h>
 #include <control_block.h>
+#include <cpu.h>
+#include <obj_cache.h>
 
 /** @brief Global kernel state with process and thread info **/
 kernel_state_t kernel_state;
 
+/** @brief Cache of tcbs, each with its kernel stack */
+static obj_cache_t tcb_cache;
+/** @brief Cache of pcbs, each with its locks initialized, which are never
+ *         given back to the heap */
+static obj_cache_t pcb_cache;
+
+/** @brief Give a new tcb its kernel stack
+ *
+ *  The stack stays with the tcb while it is in the cache, so only the
+ *  first thread to use a tcb allocates one.
+ *
+ *  @param object The tcb
+ *  @return Zero on success, less than zero on failure
+ **/
+static int construct_tcb(void* object)
+{
+    tcb_t* tcb = (tcb_t*)object;
+    uint32_t mem = (uint32_t)smemalign(K_STACK_SIZE, K_STACK_SIZE);
+    if (mem == 0) {
+        return -1;
+    }
+    tcb->kernel_stack = (void*)K_STACK_TOP(mem);
+    // Store pointer to tcb at the top of the kernel stack
+    *((tcb_t**)tcb->kernel_stack) = tcb;
+    return 0;
+}
+
+/** @brief Free the kernel stack of a tcb leaving the cache
+ *
+ *  Called with the heap lock held
+ *
+ *  @param object The tcb
+ *  @return void
+ **/
+static void destroy_tcb(void* object)
+{
+    tcb_t* tcb = (tcb_t*)object;
+    _sfree((void*)K_STACK_BASE(tcb->kernel_stack), K_STACK_SIZE);
+}
+
+/** @brief Initialize the locks of a new pcb
+ *
+ *  @param object The pcb
+ *  @return Zero
+ **/
+static int construct_pcb(void* object)
+{
+    pcb_t* pcb = (pcb_t*)object;
+    mutex_init(&pcb->children_mutex);
+    cond_init(&pcb->wait);
+    mutex_init(&pcb->threads_mutex);
+    mutex_init(&pcb->borrow_mutex);
+    cond_init(&pcb->returned);
+    return 0;
+}
+
 /** @brief Initializes the global lists of processes and threads
  *  @return void
  **/
@@ -34,6 +91,11 @@ void init_kernel_state()
     kernel_state.next_id = 1;
     mutex_init(&kernel_state.next_id_mutex);
     mutex_init(&kernel_state.threads_mutex);
+    cache_init(&tcb_cache, "tcb", sizeof(tcb_t), sizeof(void*),
+               construct_tcb, destroy_tcb, 0);
+    // exiting children may still look at a parent which has been freed
+    cache_init(&pcb_cache, "pcb", sizeof(pcb_t), sizeof(void*),
+               construct_pcb, NULL, CACHE_TYPESAFE);
 }
 
 /** @brief Gives the next available process/thread id number
@@ -131,6 +193,7 @@ void pcb_add_child(pcb_t* parent, pcb_t* child)
 {
     mutex_lock(&parent->children_mutex);
     child->parent = parent;
+    child->parent_id = parent->id;
     Q_INSERT_TAIL(&parent->children, child, siblings);
     parent->num_children++;
     mutex_unlock(&parent->children_mutex);
@@ -143,25 +206,30 @@ void pcb_add_child(pcb_t* parent, pcb_t* child)
  **/
 tcb_t* create_pcb_entry()
 {
-    pcb_t* entry = (pcb_t*)smalloc(sizeof(pcb_t));
+    // the locks are left initialized by the last process to use the pcb
+    pcb_t* entry = (pcb_t*)cache_alloc(&pcb_cache);
     if (entry == NULL) {
         return NULL;
     }
     Q_INIT_ELEM(entry, siblings);
-    mutex_init(&entry->parent_mutex);
     entry->parent = NULL;
-    mutex_init(&entry->children_mutex);
+    entry->parent_id = 0;
     Q_INIT_HEAD(&entry->children);
     entry->num_children = 0;
-    cond_init(&entry->wait);
+    Q_INIT_HEAD(&entry->zombies);
+    entry->num_zombies = 0;
     entry->waiting = 0;
-    mutex_init(&entry->threads_mutex);
     Q_INIT_HEAD(&entry->threads);
     entry->num_threads = 0;
+    entry->lent = 0;
     entry->id = get_next_id();
+    // a single write, so a child with a stale parent sees the old id or this
+    entry->family = entry->id;
     entry->exit_status = 0;
     entry->directory = NULL;
     entry->state = P_ACTIVE;
+    entry->lender = NULL;
+    entry->reserved = NULL;
 
     // create first process
     tcb_t* tcb = create_tcb_entry(entry->id);
@@ -197,71 +265,52 @@ tcb_t* create_tcb_entry(int id)
         DPRINTF("Thread id has wrapped, cannot create more threads");
         return NULL;
     }
-    tcb_t* entry = (tcb_t*)smalloc(sizeof(tcb_t));
+    // the kernel stack comes with the tcb
+    tcb_t* entry = (tcb_t*)cache_alloc(&tcb_cache);
     if (entry == NULL) {
         return NULL;
     }
-    uint32_t mem = (uint32_t)smemalign(K_STACK_SIZE, K_STACK_SIZE);
-    if (mem == 0) {
-        sfree(entry, sizeof(tcb_t));
-        return NULL;
-    }
-    entry->kernel_stack = (void*)K_STACK_TOP(mem);
-    // Store pointer to tcb at the top of the kernel stack
-    *((tcb_t**)entry->kernel_stack) = entry;
 
     Q_INIT_ELEM(entry, all_threads);
     Q_INIT_ELEM(entry, pcb_threads);
     Q_INIT_ELEM(entry, runnable_threads);
     Q_INIT_ELEM(entry, suspended_threads);
-    Q_INIT_ELEM(entry, sleeping_threads);
     entry->id = id;
     entry->state = T_NOT_YET;
+    // new threads start on the queue of the processor which created them
+    entry->cpu = get_cpu()->id;
+    entry->on_cpu = 0;
     memset(&entry->swexn, 0, sizeof(swexn_t));
     entry->swexn.handler = NULL;
     entry->process = NULL;
+    entry->next_exited = NULL;
     entry->wake_tick = 0;
+    entry->sleep_index = -1;
     Q_INIT_HEAD(&entry->devserv);
+    spinlock_init(&entry->interrupt_lock);
     entry->waiting = 0;
+    entry->buffer = NULL;
+    entry->buffer_size = 0;
     entry->producer = 0;
     entry->consumer = 0;
+    entry->pushers = 0;
+    entry->dropped = 0;
+    Q_INIT_HEAD(&entry->senders);
+    entry->senders_waiting = 0;
     return entry;
 }
 
-/** @brief Free memory associated with a tcb_t structure without locks
- *
- *  @param tcb The tcb to free
- *  @return void
- **/
-void _free_tcb(tcb_t* tcb)
-{
-    _sfree((void*)K_STACK_BASE(tcb->kernel_stack), K_STACK_SIZE);
-    _sfree(tcb, sizeof(tcb_t));
-}
-
 /** @brief Free memory associated with a tcb_t structure
+ *
+ *  Never blocks, so that idle threads can reap exited threads
  *
  *  @param tcb The tcb to free
  *  @return void
  **/
 void free_tcb(tcb_t* tcb)
 {
-    acquire_malloc();
-    _free_tcb(tcb);
-    release_malloc();
-}
-
-/** @brief Free memory associated with a pcb_t structure
- *
- *  @param pcb The pcb to free
- *  @return void
- **/
-void _free_pcb(pcb_t* pcb)
-{
-    mutex_destroy(&pcb->parent_mutex);
-    mutex_destroy(&pcb->children_mutex);
-    mutex_destroy(&pcb->threads_mutex);
-    _sfree(pcb, sizeof(pcb_t));
+    free_interrupts(tcb);
+    cache_free(&tcb_cache, tcb);
 }
 
 /** @brief Free memory associated with a pcb_t structure
@@ -271,9 +320,7 @@ void _free_pcb(pcb_t* pcb)
  **/
 void free_pcb(pcb_t* pcb)
 {
-    acquire_malloc();
-    _free_pcb(pcb);
-    release_malloc();
+    cache_free(&pcb_cache, pcb);
 }
 
 /** @brief Gets the tcb from the top of the kernel stack
@@ -1,5 +1,20 @@
 /** @file malloc_wrappers.c
- *  @brief Implementation of wrapper functions for the malloc family
+ *  @brief Implementation of the kernel heap
+ *
+ *  Blocks of up to a page are allocated from one of a set of size classes,
+ *  each an object cache of naturally aligned blocks of a power of two
+ *  bytes, so most allocations and frees only touch the current processor's
+ *  magazine for the class. Larger blocks, and batches of blocks for the
+ *  caches, come from the underlying malloc, which is protected by a
+ *  spinlock held with interrupts disabled. The heap never blocks, so it
+ *  can be used from idle threads and with interrupts disabled.
+ *
+ *  malloc and the functions which do not take a size keep a header before
+ *  the block they return, which records the block it was carved from.
+ *
+ *  If memory runs out, threads waiting to be reaped are freed and every
+ *  object cache gives its free objects back before the allocation is
+ *  retried.
  *
  *  @author Jonathan Ong (jonathao)
  *  @author Evan Palmer (esp)
@@ -7,76 +22,167 @@
  **/
 
 #include <stddef.h>
+#include <string.h>
 #include <malloc.h>
 #include <malloc_internal.h>
-#include <mutex.h>
+#include <malloc_wrappers.h>
+#include <spinlock.h>
+#include <obj_cache.h>
 #include <control_block.h>
-#include <assert.h>
+#include <asm.h>
+#include <eflags.h>
+#include <page.h>
+
+/** @brief The size of the smallest size class is 2^HEAP_MIN_SHIFT */
+#define HEAP_MIN_SHIFT 4
+/** @brief The size of the largest size class is 2^HEAP_MAX_SHIFT */
+#define HEAP_MAX_SHIFT PAGE_SHIFT
+/** @brief The number of size classes */
+#define HEAP_CLASSES (HEAP_MAX_SHIFT - HEAP_MIN_SHIFT + 1)
+/** @brief The size of a size class */
+#define CLASS_SIZE(c) ((size_t)1 << ((c) + HEAP_MIN_SHIFT))
 
-/** @brief The mutex for all malloc related calls */
-static mutex_t mutex;
-/** @brief A boolean integer describing whether malloc has been initialized */
-static int initialized = 0;
-/** @brief A pointer to a tcb which will be freed before the next malloc call */
-static tcb_t *free_later_tcb = NULL;
+/** @brief The header before a block returned by malloc */
+typedef struct heap_header {
+    size_t size;
+    void* block;
+} heap_header_t;
 
-/** @brief Initializes state required for the thread safe malloc wrappers
- *         Before this is called the malloc functions can be called, but
- *         they will not use mutexes
+/** @brief Structure for the kernel heap */
+static struct {
+    spinlock_t lock;
+    uint32_t eflags;
+    obj_cache_t classes[HEAP_CLASSES];
+} heap;
+
+/** @brief Names of the size classes, for debugging */
+static const char* class_names[HEAP_CLASSES] = {
+    "heap-16", "heap-32", "heap-64", "heap-128", "heap-256", "heap-512",
+    "heap-1024", "heap-2048", "heap-4096"
+};
+
+/** @brief Initializes the size classes of the kernel heap
+ *
+ *  Must be called before anything else is allocated
+ *
+ *  @return void
  **/
 void init_malloc()
 {
-    mutex_init(&mutex);
-    initialized = 1;
+    int i;
+    spinlock_init(&heap.lock);
+    for (i = 0; i < HEAP_CLASSES; i++) {
+        cache_init(&heap.classes[i], class_names[i], CLASS_SIZE(i),
+                   CLASS_SIZE(i), NULL, NULL, 0);
+    }
 }
 
-/** @brief Acquires the lock to use malloc functions. Also, if needed frees
- *         memory which an exiting thread was unable to free by itsself
+/** @brief Take the lock on the underlying malloc
+ *
+ *  The interrupt flag is restored when the lock is released, since the
+ *  heap is used during boot, before interrupts may be enabled.
+ *
+ *  @return void
  **/
-void acquire_malloc()
+static void lock_heap()
 {
-    mutex_lock(&mutex);
-    if(free_later_tcb != NULL){
-        finalize_exit(free_later_tcb);
-        free_later_tcb = NULL;
-    }
+    uint32_t eflags = get_eflags();
+    disable_interrupts();
+    spin_lock(&heap.lock);
+    heap.eflags = eflags;
 }
 
-/** @brief Instructs malloc to free the tcb and if present, the associated ppd
- *         at a later time in another thread
+/** @brief Release the lock on the underlying malloc
  *
- *  This function is used in thread exit, and allows threads to free their
- *  tcbs and the ppd of their parent process if it is exiting without
- *  crashing, but before any other memory allocations are made
+ *  @return void
+ **/
+static void unlock_heap()
+{
+    uint32_t eflags = heap.eflags;
+    spin_unlock(&heap.lock);
+    set_eflags(eflags);
+}
+
+/** @brief Gets the size class a block belongs to
  *
- *  Must be called while the malloc mutex is held
+ *  @param size The size of the block
+ *  @return The size class, or less than zero if the block is too large
+ **/
+static int size_class(size_t size)
+{
+    int class = 0;
+    while (CLASS_SIZE(class) < size) {
+        if (++class == HEAP_CLASSES) {
+            return -1;
+        }
+    }
+    return class;
+}
+
+/** @brief Allocate a block from the underlying malloc
  *
- *  @param tcb The tcb to free
- *  @return void
+ *  @param alignment Address will be a multiple of this value
+ *  @param size Size of the block in bytes
+ *  @return The block, or NULL if there is no memory left
  **/
-void free_later(tcb_t *tcb)
+static void* alloc_block(size_t alignment, size_t size)
 {
-    assert(free_later_tcb == NULL);
-    free_later_tcb = tcb;
+    lock_heap();
+    void* block = _smemalign(alignment, size);
+    if (block == NULL && _cache_reclaim() > 0) {
+        block = _smemalign(alignment, size);
+    }
+    unlock_heap();
+    if (block == NULL && reap_exited() > 0) {
+        return alloc_block(alignment, size);
+    }
+    return block;
 }
 
-/** @brief Release the malloc mutex
- *  @return void
+/** @brief Allocates several aligned blocks from the underlying malloc
+ *         under one acquisition of its lock
+ *
+ *  The blocks must be freed with heap_free_block
+ *
+ *  @param alignment Addresses will be a multiple of this value
+ *  @param size Size of each block in bytes
+ *  @param blocks Where to store the allocated blocks
+ *  @param count The number of blocks wanted
+ *  @return The number of blocks allocated, which is less than count only if
+ *          memory ran out
  **/
-void release_malloc()
+int heap_alloc_blocks(size_t alignment, size_t size, void** blocks,
+                      int count)
 {
-    mutex_unlock(&mutex);
+    int allocated = 0;
+    lock_heap();
+    while (allocated < count &&
+            (blocks[allocated] = _smemalign(alignment, size)) != NULL) {
+        allocated++;
+    }
+    unlock_heap();
+    if (allocated == 0) {
+        // fall back to the slow path, which makes room if it can
+        if ((blocks[0] = alloc_block(alignment, size)) != NULL) {
+            allocated++;
+        }
+    }
+    return allocated;
 }
 
-/** @brief Relese the malloc mutex with interrupts disabled
+/** @brief Free a block allocated with heap_alloc_blocks
+ *
+ *  @param block The block
+ *  @param size Size of the block in bytes
  *  @return void
  **/
-void scheduler_release_malloc()
+void heap_free_block(void* block, size_t size)
 {
-    scheduler_mutex_unlock(&mutex);
+    lock_heap();
+    _sfree(block, size);
+    unlock_heap();
 }
 
-
 /** @brief Allocates memory of size bytes
  *
  *  @param size Size of memory in bytes to be allocated
@@ -84,15 +190,7 @@ void scheduler_release_malloc()
  **/
 void* malloc(size_t size)
 {
-    void* stuff;
-    if (initialized) {
-        acquire_malloc();
-        stuff = _malloc(size);
-        release_malloc();
-    } else {
-        stuff = _malloc(size);
-    }
-    return stuff;
+    return memalign(sizeof(heap_header_t), size);
 }
 
 /** @brief Allocates aligned memory of size bytes
@@ -103,15 +201,24 @@ void* malloc(size_t size)
  **/
 void* memalign(size_t alignment, size_t size)
 {
-    void* stuff;
-    if (initialized) {
-        acquire_malloc();
-        stuff = _memalign(alignment, size);
-        release_malloc();
-    } else {
-        stuff = _memalign(alignment, size);
+    if (alignment < sizeof(heap_header_t)) {
+        alignment = sizeof(heap_header_t);
     }
-    return stuff;
+    // room for the header and for moving the start up to the alignment
+    size_t total = size + alignment;
+    if (total < size) {
+        return NULL;
+    }
+    void* block = smalloc(total);
+    if (block == NULL) {
+        return NULL;
+    }
+    uint32_t start = ((uint32_t)block + sizeof(heap_header_t) +
+                      alignment - 1) & ~(alignment - 1);
+    heap_header_t* header = (heap_header_t*)start - 1;
+    header->size = total;
+    header->block = block;
+    return (void*)start;
 }
 
 /** @brief Allocates memory for an array of elements
@@ -122,13 +229,12 @@ void* memalign(size_t alignment, size_t size)
  **/
 void* calloc(size_t nelt, size_t eltsize)
 {
-    void* stuff;
-    if (initialized) {
-        acquire_malloc();
-        stuff = _calloc(nelt, eltsize);
-        release_malloc();
-    } else {
-        stuff = _calloc(nelt, eltsize);
+    if (eltsize != 0 && nelt > (size_t)-1 / eltsize) {
+        return NULL;
+    }
+    void* stuff = malloc(nelt * eltsize);
+    if (stuff != NULL) {
+        memset(stuff, 0, nelt * eltsize);
     }
     return stuff;
 }
@@ -141,14 +247,17 @@ void* calloc(size_t nelt, size_t eltsize)
  **/
 void* realloc(void* buf, size_t new_size)
 {
-    void* stuff;
-    if (initialized) {
-        acquire_malloc();
-        stuff = _realloc(buf, new_size);
-        release_malloc();
-    } else {
-        stuff = _realloc(buf, new_size);
+    if (buf == NULL) {
+        return malloc(new_size);
+    }
+    heap_header_t* header = (heap_header_t*)buf - 1;
+    size_t old_size = header->size - ((uint32_t)buf - (uint32_t)header->block);
+    void* stuff = malloc(new_size);
+    if (stuff == NULL) {
+        return NULL;
     }
+    memcpy(stuff, buf, old_size < new_size ? old_size : new_size);
+    free(buf);
     return stuff;
 }
 
@@ -159,13 +268,11 @@ void* realloc(void* buf, size_t new_size)
  **/
 void free(void* buf)
 {
-    if (initialized) {
-        acquire_malloc();
-        _free(buf);
-        release_malloc();
-    } else {
-        _free(buf);
+    if (buf == NULL) {
+        return;
     }
+    heap_header_t* header = (heap_header_t*)buf - 1;
+    sfree(header->block, header->size);
 }
 
 /** @brief Safe version of malloc
@@ -175,18 +282,17 @@ void free(void* buf)
  **/
 void* smalloc(size_t size)
 {
-    void* stuff;
-    if (initialized) {
-        acquire_malloc();
-        stuff = _smalloc(size);
-        release_malloc();
-    } else {
-        stuff = _smalloc(size);
+    int class = size_class(size);
+    if (class >= 0) {
+        return cache_alloc(&heap.classes[class]);
     }
-    return stuff;
+    return alloc_block(sizeof(heap_header_t), size);
 }
 
 /** @brief Safe version of memalign
+ *
+ *  Blocks are freed by size, so a block small enough for a size class must
+ *  not need a larger alignment than the class gives.
  *
  *  @param alignment Address will be a multiple of this value
  *  @param size Size of memory in bytes to be allocated
@@ -194,15 +300,14 @@ void* smalloc(size_t size)
  **/
 void* smemalign(size_t alignment, size_t size)
 {
-    void* stuff;
-    if (initialized) {
-        acquire_malloc();
-        stuff = _smemalign(alignment, size);
-        release_malloc();
-    } else {
-        stuff = _smemalign(alignment, size);
+    int class = size_class(size);
+    if (class >= 0) {
+        if (alignment > CLASS_SIZE(class)) {
+            return NULL;
+        }
+        return cache_alloc(&heap.classes[class]);
     }
-    return stuff;
+    return alloc_block(alignment, size);
 }
 
 /** @brief Safe version of free
@@ -213,11 +318,10 @@ void* smemalign(size_t alignment, size_t size)
  **/
 void sfree(void* buf, size_t size)
 {
-    if (initialized) {
-        acquire_malloc();
-        _sfree(buf, size);
-        release_malloc();
+    int class = size_class(size);
+    if (class >= 0) {
+        cache_free(&heap.classes[class], buf);
     } else {
-        _sfree(buf, size);
+        heap_free_block(buf, size);
     }
 }
@@ -0,0 +1,244 @@
+/** @file obj_cache.c
+ *
+ *  @brief Caches of constructed kernel objects
+ *
+ *  Kernel objects which are created and destroyed with every thread,
+ *  process or allocation are kept in a cache for their type, in the spirit
+ *  of a slab allocator. A free object keeps its constructed state, so
+ *  expensive setup like a thread's kernel stack is done once per object
+ *  rather than once per use.
+ *
+ *  Objects are allocated from and freed to a small magazine belonging to
+ *  the current processor, which is refilled from and spilled to the depot
+ *  of the cache in batches, so most allocations take neither the heap lock
+ *  nor a shared lock. When the depot is empty a batch of objects is
+ *  allocated under a single acquisition of the heap lock. Each object is
+ *  allocated on its own, so when the heap runs out of memory every free
+ *  object can be destroyed and given back.
+ *
+ *  Magazines and depots are protected by spinlocks held with interrupts
+ *  disabled, so objects can be freed while the heap lock is held. The
+ *  interrupt flag is restored rather than set afterwards, since objects are
+ *  created during boot, before interrupts may be enabled.
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs.
+ **/
+
+#include <obj_cache.h>
+#include <malloc_internal.h>
+#include <malloc_wrappers.h>
+#include <asm.h>
+#include <eflags.h>
+#include <cpu.h>
+
+/** @brief Structure for a list of caches */
+Q_NEW_HEAD(cache_list_t, obj_cache);
+
+/** @brief Every cache, so that free objects can be given back to the heap */
+static cache_list_t caches;
+
+/** @brief Initialize an empty cache
+ *
+ *  Must be called during boot, before the cache is used
+ *
+ *  @param cache The cache to initialize
+ *  @param name The name of the type of object cached, for debugging
+ *  @param size The size of each object
+ *  @param align The alignment of each object
+ *  @param ctor The constructor of each object, or NULL
+ *  @param dtor The destructor of each object, or NULL
+ *  @param flags CACHE_TYPESAFE or zero
+ *  @return void
+ **/
+void cache_init(obj_cache_t* cache, const char* name, size_t size,
+                size_t align, cache_ctor_t ctor, cache_dtor_t dtor,
+                int flags)
+{
+    int i;
+    cache->name = name;
+    // free objects are linked through their first word
+    cache->size = size < sizeof(void*) ? sizeof(void*) : size;
+    cache->align = align;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->flags = flags;
+    spinlock_init(&cache->lock);
+    cache->depot = NULL;
+    for (i = 0; i < MAX_CPUS; i++) {
+        spinlock_init(&cache->magazines[i].lock);
+        cache->magazines[i].count = 0;
+    }
+    Q_INIT_ELEM(cache, link);
+    Q_INSERT_TAIL(&caches, cache, link);
+}
+
+/** @brief Take the magazine of the current processor
+ *
+ *  Interrupts are disabled until the magazine is released, so the thread
+ *  cannot move to another processor while it uses the magazine.
+ *
+ *  @param cache The cache
+ *  @param eflags Where to save the interrupt flag
+ *  @return The magazine
+ **/
+static cache_magazine_t* lock_magazine(obj_cache_t* cache, uint32_t* eflags)
+{
+    *eflags = get_eflags();
+    disable_interrupts();
+    cache_magazine_t* magazine = &cache->magazines[get_cpu()->id];
+    spin_lock(&magazine->lock);
+    return magazine;
+}
+
+/** @brief Release a magazine taken with lock_magazine
+ *
+ *  @param magazine The magazine
+ *  @param eflags The interrupt flag saved by lock_magazine
+ *  @return void
+ **/
+static void unlock_magazine(cache_magazine_t* magazine, uint32_t eflags)
+{
+    spin_unlock(&magazine->lock);
+    set_eflags(eflags);
+}
+
+/** @brief Allocate and construct a batch of new objects
+ *
+ *  The first object is returned and the rest are freed to the cache.
+ *
+ *  @param cache The cache
+ *  @return A constructed object or NULL if none could be created
+ **/
+static void* grow_cache(obj_cache_t* cache)
+{
+    int i;
+    void* objects[CACHE_BATCH];
+    void* first = NULL;
+    int count = heap_alloc_blocks(cache->align, cache->size, objects,
+                                  CACHE_BATCH);
+    for (i = 0; i < count; i++) {
+        if (cache->ctor != NULL && cache->ctor(objects[i]) < 0) {
+            heap_free_block(objects[i], cache->size);
+        } else if (first == NULL) {
+            first = objects[i];
+        } else {
+            cache_free(cache, objects[i]);
+        }
+    }
+    return first;
+}
+
+/** @brief Allocate a constructed object from a cache
+ *
+ *  @param cache The cache
+ *  @return The object or NULL if there is no memory left
+ **/
+void* cache_alloc(obj_cache_t* cache)
+{
+    uint32_t eflags;
+    void* object = NULL;
+    cache_magazine_t* magazine = lock_magazine(cache, &eflags);
+    if (magazine->count == 0) {
+        spin_lock(&cache->lock);
+        while (magazine->count < CACHE_BATCH && cache->depot != NULL) {
+            void* taken = cache->depot;
+            cache->depot = *(void**)taken;
+            magazine->objects[magazine->count++] = taken;
+        }
+        spin_unlock(&cache->lock);
+    }
+    if (magazine->count > 0) {
+        object = magazine->objects[--magazine->count];
+    }
+    unlock_magazine(magazine, eflags);
+    if (object == NULL) {
+        return grow_cache(cache);
+    }
+    return object;
+}
+
+/** @brief Free an object to a cache
+ *
+ *  The object must be in its constructed state. May be called with the
+ *  heap lock held.
+ *
+ *  @param cache The cache the object was allocated from
+ *  @param object The object
+ *  @return void
+ **/
+void cache_free(obj_cache_t* cache, void* object)
+{
+    uint32_t eflags;
+    cache_magazine_t* magazine = lock_magazine(cache, &eflags);
+    if (magazine->count == CACHE_MAGAZINE_SIZE) {
+        spin_lock(&cache->lock);
+        while (magazine->count > CACHE_BATCH) {
+            void* spilled = magazine->objects[--magazine->count];
+            *(void**)spilled = cache->depot;
+            cache->depot = spilled;
+        }
+        spin_unlock(&cache->lock);
+    }
+    magazine->objects[magazine->count++] = object;
+    unlock_magazine(magazine, eflags);
+}
+
+/** @brief Take every free object out of a cache
+ *
+ *  @param cache The cache
+ *  @return The free objects, linked through their first word
+ **/
+static void* drain_cache(obj_cache_t* cache)
+{
+    int i;
+    uint32_t eflags = get_eflags();
+    disable_interrupts();
+    spin_lock(&cache->lock);
+    void* objects = cache->depot;
+    cache->depot = NULL;
+    spin_unlock(&cache->lock);
+    for (i = 0; i < MAX_CPUS; i++) {
+        cache_magazine_t* magazine = &cache->magazines[i];
+        spin_lock(&magazine->lock);
+        while (magazine->count > 0) {
+            void* object = magazine->objects[--magazine->count];
+            *(void**)object = objects;
+            objects = object;
+        }
+        spin_unlock(&magazine->lock);
+    }
+    set_eflags(eflags);
+    return objects;
+}
+
+/** @brief Destroy every free object in every cache which is not type safe
+ *         and give it back to the heap
+ *
+ *  Must be called with the heap lock held
+ *
+ *  @return The number of objects given back
+ **/
+int _cache_reclaim()
+{
+    int freed = 0;
+    obj_cache_t* cache;
+    Q_FOREACH(cache, &caches, link)
+    {
+        if (cache->flags & CACHE_TYPESAFE) {
+            continue;
+        }
+        void* objects = drain_cache(cache);
+        while (objects != NULL) {
+            void* object = objects;
+            objects = *(void**)object;
+            if (cache->dtor != NULL) {
+                cache->dtor(object);
+            }
+            _sfree(object, cache->size);
+            freed++;
+        }
+    }
+    return freed;
+}
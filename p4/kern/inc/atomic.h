@@ -17,4 +17,21 @@
  **/
 int atomic_xadd(volatile int* ptr, int val);
 
+/** @brief Atomically exchange a value with the contents of a pointer
+ *
+ *  @param ptr The integer to exchange
+ *  @param val The value to store in ptr
+ *  @return The previous value in ptr
+ **/
+int atomic_xchg(volatile int* ptr, int val);
+
+/** @brief Atomically store a value if the contents of a pointer are expected
+ *
+ *  @param ptr The integer to compare and exchange
+ *  @param expected The value ptr must contain for the exchange to happen
+ *  @param val The value to store in ptr
+ *  @return The previous value in ptr
+ **/
+int atomic_cmpxchg(volatile int* ptr, int expected, int val);
+
 #endif /* KERN_INC_ATOMIC_H */
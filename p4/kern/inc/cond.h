@@ -9,6 +9,7 @@
 #define KERN_INC_COND_H
 
 #include <mutex.h>
+#include <spinlock.h>
 #include <variable_queue.h>
 
 /** @brief Structure for a list of threads */
@@ -22,6 +23,7 @@ typedef enum {
 
 /** @brief The structure for condition variables */
 typedef struct cond {
+    spinlock_t lock;
     tcb_list_cond_t waiting;
     cond_state_t state;
 } cond_t;
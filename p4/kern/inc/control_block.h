@@ -18,6 +18,8 @@ void free_pcb(pcb_t* pcb);
 tcb_t *create_tcb_entry(int id);
 void free_tcb(tcb_t* tcb);
 void copy_kernel_stack(tcb_t *tcb_parent, tcb_t *tcb_child);
+void end_borrow(pcb_t *pcb);
+void replace_pcb_dir(pcb_t *pcb, ppd_t *dir);
 tcb_t *get_tcb();
 tcb_t* get_tcb_by_id(int tid);
 int get_thread_count(pcb_t *pcb);
@@ -29,7 +31,9 @@ void pcb_add_thread(pcb_t* pcb, tcb_t* tcb);
 void kernel_remove_thread(tcb_t* tcb);
 void kernel_add_thread(tcb_t* tcb);
 int get_next_id();
-void finalize_exit(tcb_t *tcb);
+void defer_exit(tcb_t *tcb);
+int reap_exited();
+void init_reaper();
 
 /** @brief Get the current value of esp
  *  @return The value of esp
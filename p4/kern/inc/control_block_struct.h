@@ -12,6 +12,7 @@
 #include <ureg.h>
 #include <vm.h>
 #include <mutex.h>
+#include <spinlock.h>
 #include <variable_queue.h>
 #include <variable_htable.h>
 #include <user_drivers.h>
@@ -25,6 +26,7 @@ typedef enum {
 /** @brief Thread states */
 typedef enum {
     T_NOT_YET,
+    T_RUNNING,
     T_RUNNABLE_P0,
     T_RUNNABLE_P1,
     T_SUSPENDED,
@@ -67,24 +69,37 @@ H_NEW_TABLE(thread_hash_t, tcb_queue_t);
 /** @brief Structure for a process control block */
 typedef struct pcb {
     Q_NEW_LINK(pcb) siblings;
-    // Stuff protected by parent mutex
-    mutex_t parent_mutex;
+    // Set once the process is added to its parent. The parent may since
+    // have given its children to init, and it is only the parent while its
+    // family is still parent_id.
     struct pcb *parent;
+    int parent_id;
     // Stuff protected by children_mutex
     mutex_t children_mutex;
     pcb_queue_t children;
     int num_children;
+    pcb_queue_t zombies;
+    int num_zombies;
+    // our id until our children are given to init
+    int family;
     cond_t wait;
     int waiting;
     // Stuff protected by threads_mutex
     mutex_t threads_mutex;
     tcb_queue_t threads;
     int num_threads;
+    // Stuff protected by borrow_mutex
+    mutex_t borrow_mutex;
+    cond_t returned;
+    int lent;
     // Things not protected by a mutex
     int id;
     int exit_status;
     ppd_t *directory;
     process_state_t state;
+    // the process whose directory a vfork child uses until it execs
+    struct pcb *lender;
+    ppd_t *reserved;
 } pcb_t;
 
 /** @brief Structure for a thread control block */
@@ -93,20 +108,32 @@ typedef struct tcb {
     Q_NEW_LINK(tcb) pcb_threads;
     Q_NEW_LINK(tcb) runnable_threads;
     Q_NEW_LINK(tcb) suspended_threads;
-    Q_NEW_LINK(tcb) sleeping_threads;
     int id;
     pcb_t *process;
     void *kernel_stack;
     void *saved_esp;
     ppd_t *free_pointer;
+    // the next thread waiting to be reaped
+    struct tcb *next_exited;
     thread_state_t state;
+    int cpu;
+    volatile int on_cpu;
     swexn_t swexn;
     unsigned int wake_tick;
+    int sleep_index;
     devserv_list_t devserv;
-    int waiting;
-    interrupt_t buffer[INTERRUPT_BUFFER_SIZE];
-    int producer;
-    int consumer;
+    spinlock_t interrupt_lock;
+    volatile int waiting;
+    // lock-free ring of queued interrupts, buffer_size is a power of two
+    interrupt_slot_t *buffer;
+    int buffer_size;
+    volatile unsigned int producer;
+    unsigned int consumer;
+    volatile int pushers;
+    volatile int dropped;
+    // senders waiting for room in the ring
+    tcb_queue_t senders;
+    volatile int senders_waiting;
 } tcb_t;
 
 /** @brief Structure for the overall kernel state */
@@ -0,0 +1,49 @@
+/** @file cpu.h
+ *  @brief Interface for per processor state
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs
+ **/
+
+#ifndef KERN_INC_CPU_H
+#define KERN_INC_CPU_H
+
+#include <stdint.h>
+#include <seg.h>
+#include <multiboot.h>
+#include <vm.h>
+
+/** @brief The idt entry of the local APIC timer interrupt */
+#define LAPIC_TIMER_IDT_ENTRY 0xF0
+/** @brief The idt entry of the TLB shootdown interprocessor interrupt */
+#define TLB_SHOOTDOWN_IDT_ENTRY 0xF1
+/** @brief The idt entry of the reschedule interprocessor interrupt */
+#define RESCHEDULE_IDT_ENTRY 0xF2
+/** @brief The idt entry of the local APIC spurious interrupt */
+#define SPURIOUS_IDT_ENTRY 0xFF
+
+/** @brief The size of a task state segment */
+#define CPU_TSS_SIZE 0x68
+
+/** @brief Forward declaration of the thread control block */
+struct tcb;
+
+/** @brief State which belongs to a single processor */
+typedef struct cpu {
+    int id;
+    struct tcb* idle;
+    struct tcb* current;
+    struct tcb* prev;
+    page_directory_t* volatile dir;
+    uint64_t gdt[GDT_SEGS];
+    char tss[CPU_TSS_SIZE];
+} cpu_t;
+
+void init_smp(mbinfo_t* mbinfo);
+void boot_aps();
+int num_cpus();
+cpu_t* get_cpu();
+cpu_t* get_cpu_by_id(int id);
+
+#endif // KERN_INC_CPU_H
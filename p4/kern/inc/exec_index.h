@@ -0,0 +1,30 @@
+/** @file exec_index.h
+ *  @brief Interface for the index of programs built into the kernel
+ *
+ *  @author Jonathan Ong (jonathao) and Evan Palmer (esp)
+ *  @bug No known bugs
+ **/
+
+#ifndef KERN_INC_EXEC_INDEX_H
+#define KERN_INC_EXEC_INDEX_H
+
+#include <exec2obj.h>
+#include <elf_410.h>
+
+/** @brief The number of slots in the index, a power of two */
+#define EXEC_INDEX_SLOTS (2 * MAX_NUM_APP_ENTRIES)
+
+/** @brief Struct for a program built into the kernel */
+typedef struct exec_entry {
+    const char* name;
+    const char* bytes;
+    int len;
+    int index;
+    int is_elf;
+    simple_elf_t elf;
+} exec_entry_t;
+
+void init_exec_index();
+const exec_entry_t* find_exec(const char* name);
+
+#endif // KERN_INC_EXEC_INDEX_H
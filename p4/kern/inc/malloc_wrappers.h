@@ -1,5 +1,5 @@
 /** @file malloc_wrappers.h
- *  @brief Interface for malloc wrapper functions
+ *  @brief Interface for the kernel heap
  *
  *  @author Jonathan Ong (jonathao) and Evan Palmer (esp)
  *  @bug No known bugs
@@ -8,14 +8,11 @@
 #ifndef KERN_INC_MALLOC_WRAPPERS_H
 #define KERN_INC_MALLOC_WRAPPERS_H
 
-#include <control_block.h>
+#include <stddef.h>
 
-void scheduler_release_malloc();
 void init_malloc();
-void acquire_malloc();
-void release_malloc();
-void free_later(tcb_t *tcb);
-void _free_tcb(tcb_t* tcb);
-void _free_pcb(pcb_t* pcb);
+int heap_alloc_blocks(size_t alignment, size_t size, void** blocks,
+                      int count);
+void heap_free_block(void* block, size_t size);
 
 #endif // KERN_INC_MALLOC_WRAPPERS_H
\ No newline at end of file
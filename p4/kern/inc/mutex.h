@@ -9,19 +9,19 @@
 #define KERN_INC_MUTEX_H
 
 #include <variable_queue.h>
+#include <spinlock.h>
 
 /** @brief Structure for a list of threads */
 Q_NEW_HEAD(tcb_list_t, tcb);
 
 /** @brief Struct for mutexes */
 typedef struct mutex {
+    spinlock_t lock;
     volatile int owner;
     volatile int count;
     tcb_list_t waiting;
 } mutex_t;
 
-void lock();
-void unlock();
 void enable_mutexes();
 void mutex_init(mutex_t* mp);
 void mutex_destroy(mutex_t* mp);
@@ -0,0 +1,75 @@
+/** @file obj_cache.h
+ *  @brief Interface for caches of constructed kernel objects
+ *
+ *  @author Jonathan Ong (jonathao) and Evan Palmer (esp)
+ *  @bug No known bugs
+ **/
+
+#ifndef KERN_INC_OBJ_CACHE_H
+#define KERN_INC_OBJ_CACHE_H
+
+#include <stddef.h>
+#include <spinlock.h>
+#include <variable_queue.h>
+#include <smp/smp.h>
+
+/** @brief The most objects a processor keeps in its magazine */
+#define CACHE_MAGAZINE_SIZE 16
+/** @brief The number of objects moved between a magazine and the depot at
+ *         once
+ **/
+#define CACHE_BATCH (CACHE_MAGAZINE_SIZE / 2)
+
+/** @brief Free objects are never given back to the heap, so a stale pointer
+ *         to a freed object still points to a constructed object of the
+ *         same type
+ **/
+#define CACHE_TYPESAFE 0x1
+
+/** @brief Puts a new object into its constructed state
+ *
+ *  Called without the heap lock held, so it may allocate memory.
+ *  Returns less than zero if the object could not be constructed.
+ **/
+typedef int (*cache_ctor_t)(void* object);
+/** @brief Tears down the constructed state of an object
+ *
+ *  Called with the heap lock held, so it must use the unlocked malloc
+ *  functions.
+ **/
+typedef void (*cache_dtor_t)(void* object);
+
+/** @brief Structure for the free objects cached by one processor */
+typedef struct cache_magazine {
+    spinlock_t lock;
+    void* objects[CACHE_MAGAZINE_SIZE];
+    int count;
+} cache_magazine_t;
+
+/** @brief Structure for a cache of objects of a single type
+ *
+ *  Free objects are kept constructed, in the magazine of a processor or on
+ *  the depot list, which is linked through the first word of each object.
+ *  The constructed state must not live in that word.
+ **/
+typedef struct obj_cache {
+    Q_NEW_LINK(obj_cache) link;
+    const char* name;
+    size_t size;
+    size_t align;
+    cache_ctor_t ctor;
+    cache_dtor_t dtor;
+    int flags;
+    spinlock_t lock;
+    void* depot;
+    cache_magazine_t magazines[MAX_CPUS];
+} obj_cache_t;
+
+void cache_init(obj_cache_t* cache, const char* name, size_t size,
+                size_t align, cache_ctor_t ctor, cache_dtor_t dtor,
+                int flags);
+void* cache_alloc(obj_cache_t* cache);
+void cache_free(obj_cache_t* cache, void* object);
+int _cache_reclaim();
+
+#endif // KERN_INC_OBJ_CACHE_H
@@ -0,0 +1,36 @@
+/** @file rmlock.h
+ *  @brief Interface for read-mostly locks
+ *
+ *  @author Jonathan Ong (jonathao) and Evan Palmer (esp)
+ *  @bug No known bugs
+ **/
+
+#ifndef KERN_INC_RMLOCK_H
+#define KERN_INC_RMLOCK_H
+
+#include <mutex.h>
+#include <smp/smp.h>
+
+/** @brief The size of a cache line */
+#define CACHE_LINE 64
+
+/** @brief The reader flag of one processor, alone in its cache line */
+typedef struct rm_reader {
+    volatile int active;
+    char pad[CACHE_LINE - sizeof(int)];
+} rm_reader_t;
+
+/** @brief Struct for read-mostly locks */
+typedef struct rmlock {
+    rm_reader_t readers[MAX_CPUS];
+    mutex_t writers;
+    volatile int writing;
+} rmlock_t;
+
+void rmlock_init(rmlock_t* rm);
+void rm_read_lock(rmlock_t* rm);
+void rm_read_unlock(rmlock_t* rm);
+void rm_write_lock(rmlock_t* rm);
+void rm_write_unlock(rmlock_t* rm);
+
+#endif // KERN_INC_RMLOCK_H
@@ -12,20 +12,32 @@
 #include <control_block.h>
 
 uint32_t get_ticks();
+uint32_t get_user_ticks();
+int user_ticks_to_ticks(int user_ticks);
 int yield(int yield_tid);
-void init_scheduler(tcb_t *idle, tcb_t *first);
+void lock();
+void unlock();
+void init_scheduler(tcb_t *first);
+void init_idle(int cpu, tcb_t *idle);
 void run_scheduler(uint32_t ticks);
+void preempt();
+int is_idle(tcb_t* tcb);
 
 void schedule(tcb_t* tcb, thread_state_t expected);
-void schedule_interrupts_disabled(tcb_t* tcb, thread_state_t expected);
+void schedule_locked(tcb_t* tcb, thread_state_t expected);
+void handoff_locked(tcb_t* current, tcb_t* next, thread_state_t expected);
 int user_schedule(tcb_t *tcb, mutex_t *mp);
 
 void kill_thread(tcb_t* tcb);
 void deschedule(tcb_t* tcb, thread_state_t new_state);
-void deschedule_and_drop(tcb_t* tcb, mutex_t* mp, thread_state_t new_state);
+void remove_runnable(tcb_t* tcb, thread_state_t new_state);
+void deschedule_locked(tcb_t* tcb);
 int user_deschedule(tcb_t* tcb, uint32_t esi);
 
-int add_sleeper(tcb_t* tcb, uint32_t ticks);
-void release_sleeper(tcb_t *tcb);
+int add_sleeper(tcb_t* tcb, int ticks);
+int lock_sleepers();
+void unlock_sleepers();
+void add_timeout(tcb_t* tcb, int ticks);
+void cancel_timeout(tcb_t* tcb);
 
 #endif // KERN_INC_SCHEDULER_H
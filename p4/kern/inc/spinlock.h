@@ -0,0 +1,21 @@
+/** @file spinlock.h
+ *  @brief Interface for spinlocks
+ *
+ *  @author Jonathan Ong (jonathao) and Evan Palmer (esp)
+ *  @bug No known bugs
+ **/
+
+#ifndef KERN_INC_SPINLOCK_H
+#define KERN_INC_SPINLOCK_H
+
+/** @brief Struct for spinlocks */
+typedef struct spinlock {
+    volatile int held;
+} spinlock_t;
+
+void spinlock_init(spinlock_t* sp);
+void spin_lock(spinlock_t* sp);
+int spin_trylock(spinlock_t* sp);
+void spin_unlock(spinlock_t* sp);
+
+#endif // KERN_INC_SPINLOCK_H
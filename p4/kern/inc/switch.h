@@ -24,5 +24,6 @@ void switch_stack_and_regs(void *stack, tcb_t *tcb);
 void store_esp(void *saved_esp, tcb_t *tcb);
 void context_switch(tcb_t *from, tcb_t *to);
 void setup_for_switch(tcb_t* tcb);
+void setup_kernel_thread(tcb_t* tcb, void (*func)());
 
 #endif // KERN_INC_SWITCH_H
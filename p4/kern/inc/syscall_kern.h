@@ -25,6 +25,8 @@ void deregister_swexn(tcb_t *tcb);
 void swexn_handler(ureg_t* state, tcb_t* tcb);
 
 void init_timer();
+void init_lapic_timer();
+void start_lapic_timer();
 int readline(int len, char *buf, tcb_t *tcb);
 
 int getbytes( const char *filename, int offset, int size, char *buf );
@@ -15,25 +15,61 @@
 #include <udriv_kern.h>
 #include <mutex.h>
 
+/** @brief The number of interrupts a registered thread can queue */
 #define INTERRUPT_BUFFER_SIZE 512
+/** @brief The most interrupts udriv_config lets a thread queue */
+#define INTERRUPT_BUFFER_MAX 8192
+/** @brief Added to the pushers count of a thread while its ring grows */
+#define RING_RESIZING 0x10000
 #define CONTROL_NO_DEVICE 0
+/** @brief The largest buffer message, the same as UDRIV_BUF_MAX */
+#define BUF_MESSAGE_MAX 0xFFFF
+
+/** @brief Senders wait for room in the queue, the same as UDRIV_SEND_BLOCK
+ *         of the user */
+#define UDRIV_SEND_BLOCK 0x1
 
 /** @brief Type for an IPC message */
 typedef unsigned long long message_t;
 
+/** @brief An interrupt as returned by udriv_wait_many, the same layout as
+ *         the udriv_msg_t of the user */
+typedef struct udriv_msg {
+    driv_id_t driver_id;
+    message_t msg;
+    unsigned int size;
+    int has_buffer;
+} udriv_msg_t;
+
 /** @brief The struct for list of devices/servers */
 Q_NEW_HEAD(devserv_list_t, devserv);
 
 /** @brief Structure for hash table of devices/servers */
 H_NEW_TABLE(device_hash_t, devserv_list_t);
 
-/** @brief The struct for contents of a single interrupt */
+/** @brief The struct for contents of a single interrupt
+ *
+ *  Buffer messages carry size bytes in a kernel copy of the sender's
+ *  buffer, which the receiver frees.
+ **/
 typedef struct interrupt {
     driv_id_t driver_id;
     message_t msg;
     unsigned int size;
+    int has_buffer;
+    void *buffer;
 } interrupt_t;
 
+/** @brief A slot in the interrupt ring of a thread
+ *
+ *  The sequence number says whose turn it is. A slot at position pos is
+ *  free while seq is pos, and holds an interrupt once seq is pos + 1.
+ **/
+typedef struct interrupt_slot {
+    volatile unsigned int seq;
+    interrupt_t interrupt;
+} interrupt_slot_t;
+
 /** @brief The struct for a device/server */
 typedef struct devserv {
     Q_NEW_LINK(devserv) global;
@@ -42,8 +78,13 @@ typedef struct devserv {
     driv_id_t driver_id;
     unsigned int port;
     unsigned int bytes;
+    // UDRIV_SEND_BLOCK if senders should wait when the owner's queue is full
+    int flags;
     struct tcb *owner;
     const dev_spec_t *device_table_entry;
+    // frames the server shares with its clients, from vm_alloc_shared
+    void *shared;
+    unsigned int shared_size;
     mutex_t mutex;
 } devserv_t;
 
@@ -58,14 +99,26 @@ typedef struct int_control {
 extern int_control_t interrupt_table[]; 
 
 int assign_driver_id();
-int next_index_int(int index);
 devserv_t *get_devserv(driv_id_t entry);
+devserv_t *lock_server(driv_id_t driver_id);
 void add_devserv(devserv_t *device);
 int check_add_devserv(devserv_t *device);
 void remove_devserv(devserv_t *entry);
 devserv_t *create_devserv_entry(driv_id_t id);
 void free_devserv_entry(devserv_t *entry);
 void init_user_drivers();
-void queue_interrupt(struct tcb *tcb, interrupt_t interrupt);
+int reserve_interrupts(struct tcb *tcb, int count);
+interrupt_t *peek_interrupt(struct tcb *tcb);
+void pop_interrupt(struct tcb *tcb);
+void wake_senders(struct tcb *tcb);
+int queue_interrupt(struct tcb *tcb, interrupt_t interrupt);
+int queue_interrupt_wait(struct tcb *tcb, interrupt_t interrupt,
+                         mutex_t *pin);
+int queue_interrupt_locked(struct tcb *tcb, interrupt_t interrupt,
+                           int *waiting);
+void free_interrupt_buffer(interrupt_t *interrupt);
+void free_interrupts(struct tcb *tcb);
+int hand_off_server(driv_id_t driver_id, struct tcb *from, struct tcb *to);
+void deregister_thread(struct tcb *tcb);
 
 #endif // KERN_USER_DRIVERS_H
@@ -1,6 +1,13 @@
 /** @file variable_htable.h
  * @brief Generalized hash table based on variable queue
  *
+ * Tables are resized incrementally. When a table grows or shrinks, the new
+ * bucket array is allocated and the old one is kept, and every insert and
+ * remove moves a few of the old buckets into the new array. A key lives in
+ * its old bucket until that bucket is moved, so lookups check the old
+ * bucket first while a resize is in progress. Lookups never move buckets,
+ * so they may run alongside each other.
+ *
  * @author Evan Palmer (esp)
  **/
 
@@ -20,8 +27,11 @@ uint32_t hash_int(uint32_t x);
 #define MAX_LOAD_FACTOR 6
 /** @brief The maximum ratio of capcity to size before a shrink */
 #define MIN_LOAD_FACTOR 4
-/** @brief The initial size of the hash table */
+/** @brief The initial size of the hash table, a power of two */
 #define INITIAL_CAPACITY 8
+/** @brief The number of old buckets moved by each insert or remove while the
+ *         table is being resized */
+#define H_MIGRATE_BUCKETS 8
 
 /** @def H_NEW_TABLE(H_TABLE_TYPE, Q_HEAD_TYPE)
  *
@@ -36,6 +46,9 @@ uint32_t hash_int(uint32_t x);
         int current_capacity;                  \
         int current_size;                      \
         Q_HEAD_TYPE* htable;                   \
+        int old_capacity;                      \
+        int migrated;                          \
+        Q_HEAD_TYPE* old_htable;               \
     } H_TABLE_TYPE
 
 /** @def H_INIT_TABLE(table)
@@ -49,6 +62,9 @@ uint32_t hash_int(uint32_t x);
         _H_SIZE(table) = 0;                                             \
         _H_CAP(table) = INITIAL_CAPACITY;                               \
         _H_TABLE(table) = _H_ALLOC_TABLE(table, INITIAL_CAPACITY);      \
+        _H_OLD_CAP(table) = 0;                                          \
+        _H_MIGRATED(table) = 0;                                         \
+        _H_OLD_TABLE(table) = NULL;                                     \
         ((-1)*(_H_TABLE(table) == NULL));                               \
     })
 
@@ -58,8 +74,11 @@ uint32_t hash_int(uint32_t x);
  *  @param table the table to free
  *  @return void
  **/
-#define H_FREE_TABLE(table) \
-        free(_H_TABLE(table))
+#define H_FREE_TABLE(table)            \
+    do {                               \
+        free(_H_TABLE(table));         \
+        free(_H_OLD_TABLE(table));     \
+    } while (0)
 
 /** @def H_EMPTY(table)
  *
@@ -84,7 +103,8 @@ uint32_t hash_int(uint32_t x);
  * @brief Get the current number of buckets in the hash table.
  *
  * This is not a limit on how many things may be inserted. Only useful to
- * determine the current number of buckets
+ * determine the current number of buckets. While the table is being
+ * resized this is the number of buckets it is being resized to.
  *
  * @param table The table to inspect
  * @return The number of buckets
@@ -108,7 +128,8 @@ uint32_t hash_int(uint32_t x);
         typeof(*_H_TABLE(table))* _bucket;                                   \
         typeof(*Q_GET_FRONT(_bucket))* _temp;                                \
         _H_GROW(table, key_field, link_name);                                \
-        _bucket = _H_BUCKET(table, _H_HASH(table, _H_KEY(elem, key_field))); \
+        _H_MIGRATE(table, key_field, link_name, H_MIGRATE_BUCKETS);          \
+        _bucket = _H_FIND_BUCKET(table, _H_KEY(elem, key_field));            \
         _temp = _H_BUCKET_REMOVE(_bucket, _H_KEY(elem, key_field),           \
                                 key_field, link_name);                       \
         _H_BUCKET_INSERT(_bucket, elem, link_name);                          \
@@ -132,12 +153,13 @@ uint32_t hash_int(uint32_t x);
     ({                                                                    \
         typeof(*_H_TABLE(table))* _bucket;                                \
         typeof(*Q_GET_FRONT(_bucket))* _temp;                             \
-        _bucket = _H_BUCKET(table, _H_HASH(table, key));                  \
+        _bucket = _H_FIND_BUCKET(table, key);                             \
         _temp = _H_BUCKET_REMOVE(_bucket, key, key_field, link_name);     \
         if(_temp != NULL) {                                               \
             _H_SIZE(table)--;                                             \
         }                                                                 \
         _H_SHRINK(table, key_field, link_name);                           \
+        _H_MIGRATE(table, key_field, link_name, H_MIGRATE_BUCKETS);       \
         _temp;                                                            \
     })
 
@@ -154,7 +176,7 @@ uint32_t hash_int(uint32_t x);
 #define H_CONTAINS(table, key, key_field, link_name)                \
     ({                                                              \
         typeof(*_H_TABLE(table))* _bucket;                          \
-        _bucket = _H_BUCKET(table, _H_HASH(table, key));            \
+        _bucket = _H_FIND_BUCKET(table, key);                       \
         _H_BUCKET_GET(_bucket, key, key_field, link_name) != NULL;  \
     })
 
@@ -171,7 +193,7 @@ uint32_t hash_int(uint32_t x);
 #define H_GET(table, key, key_field, link_name)                   \
     ({                                                            \
         typeof(*_H_TABLE(table))* _bucket;                        \
-        _bucket = _H_BUCKET(table, _H_HASH(table, key));          \
+        _bucket = _H_FIND_BUCKET(table, key);                     \
         _H_BUCKET_GET(_bucket, key, key_field, link_name);        \
     })
 
@@ -184,7 +206,8 @@ uint32_t hash_int(uint32_t x);
  *  @param key_field The field where the key is stored in the element
  *  @param link The name of the link used to organize the bucket lists
  *  @param info A funciton accepting two integers which will be called with the
- *         index and size of every bucket
+ *         index and size of every bucket, old buckets first while the table
+ *         is being resized
  *  @return void
  **/
 #define H_DEBUG_BUCKETS(table, key_field, link, info)   \
@@ -193,8 +216,8 @@ uint32_t hash_int(uint32_t x);
         int _count;                                     \
         typeof(*_H_TABLE(table))* _bucket;              \
         typeof(*Q_GET_FRONT(_bucket)) *_search;         \
-        for (_i = 0; _i < _H_CAP(table); _i++) {        \
-            _bucket = _H_BUCKET(table, _i);             \
+        for (_i = 0; _i < _H_BUCKETS(table); _i++) {    \
+            _bucket = _H_NTH_BUCKET(table, _i);         \
             _count = 0;                                 \
             Q_FOREACH(_search, _bucket, link) {         \
                 _count++;                               \
@@ -217,8 +240,8 @@ uint32_t hash_int(uint32_t x);
  *  @return void
  **/
 #define H_FOREACH_SAFE(i, current, swap, table, link)               \
-    for (i = 0; i < _H_CAP(table); i++)                             \
-        Q_FOREACH_SAFE(current, swap, _H_BUCKET(table, i), link)
+    for (i = 0; i < _H_BUCKETS(table); i++)                         \
+        Q_FOREACH_SAFE(current, swap, _H_NTH_BUCKET(table, i), link)
 
 
 /** @def H_FOREACH(i, current, table, link)
@@ -234,8 +257,8 @@ uint32_t hash_int(uint32_t x);
  **/
 
 #define H_FOREACH(i, current, table, link)                          \
-    for (i = 0; i < _H_CAP(table); i++)                             \
-        Q_FOREACH(current, _H_BUCKET(table, i), link)
+    for (i = 0; i < _H_BUCKETS(table); i++)                         \
+        Q_FOREACH(current, _H_NTH_BUCKET(table, i), link)
 
 
 /****************************************************************
@@ -254,13 +277,64 @@ uint32_t hash_int(uint32_t x);
 #define _H_CAP(table) \
     ((table)->current_capacity)
 
+/** @brief Access the table being resized from safely */
+#define _H_OLD_TABLE(table) \
+    ((table)->old_htable)
+
+/** @brief Access the capacity of the table being resized from safely */
+#define _H_OLD_CAP(table) \
+    ((table)->old_capacity)
+
+/** @brief Access the number of old buckets already moved safely */
+#define _H_MIGRATED(table) \
+    ((table)->migrated)
+
+/** @brief The number of buckets in both tables */
+#define _H_BUCKETS(table) \
+    (_H_OLD_CAP(table) + _H_CAP(table))
+
+/** @brief Get a bucket by its index in the old table followed by the new */
+#define _H_NTH_BUCKET(table, i)                                     \
+    ((i) < _H_OLD_CAP(table) ? _H_OLD_TABLE(table) + (i)            \
+                             : _H_TABLE(table) + ((i) - _H_OLD_CAP(table)))
+
 /** @brief Accesst key field safely */
 #define _H_KEY(elem, key_field) \
     ((elem)->key_field)
 
+/** @brief Get the bucket index of a key for a power of two capacity */
+#define _H_INDEX(key, cap) \
+    (hash_int(key) & ((cap) - 1))
+
 /** @brief Get the hash of a key for the current table capacity */
 #define _H_HASH(table, key) \
-    (hash_int(key) % (table)->current_capacity)
+    _H_INDEX(key, _H_CAP(table))
+
+/** @def _H_FIND_BUCKET(table, key)
+ *
+ *  @brief Get the bucket a key lives in
+ *
+ *  While the table is being resized, a key lives in its old bucket until
+ *  that bucket has been moved.
+ *
+ *  @param table The table
+ *  @param key The key
+ *  @return The bucket
+ **/
+#define _H_FIND_BUCKET(table, key)                                        \
+    ({                                                                    \
+        uint32_t _find_key = (key);                                       \
+        uint32_t _old_index;                                              \
+        typeof(*_H_TABLE(table))* _home;                                  \
+        _home = _H_BUCKET(table, _H_HASH(table, _find_key));              \
+        if (_H_OLD_TABLE(table) != NULL) {                                \
+            _old_index = _H_INDEX(_find_key, _H_OLD_CAP(table));          \
+            if (_old_index >= (uint32_t)_H_MIGRATED(table)) {             \
+                _home = _H_OLD_TABLE(table) + _old_index;                 \
+            }                                                             \
+        }                                                                 \
+        _home;                                                            \
+    })
 
 /** @brief Get the bucket assocated with a bucket index */
 #define _H_BUCKET(table, hash_val) \
@@ -332,26 +406,57 @@ uint32_t hash_int(uint32_t x);
  *
  *  @brief Allocate space for a hash table
  *
+ *  An empty bucket is all zeroes, so the table is allocated with calloc
+ *  rather than initializing every bucket in turn.
+ *
  *  @param table The table to allocate space for
  *  @param cap The amount of space to allocate
  *  @return The allocated space
  **/
-#define _H_ALLOC_TABLE(table, cap)                           \
-    ({                                                       \
-        int _i;                                              \
-        typeof(*_H_TABLE(table))* _tmp;                      \
-        _tmp = malloc((cap) * sizeof(*_H_TABLE(table)));     \
-        if (_tmp != NULL) {                                  \
-            for (_i = 0; _i < (cap); _i++) {                 \
-                Q_INIT_HEAD(_tmp + _i);                      \
-            }                                                \
-        }                                                    \
-        _tmp;                                                \
-    })
+#define _H_ALLOC_TABLE(table, cap) \
+    ((typeof(*_H_TABLE(table))*)calloc((cap), sizeof(*_H_TABLE(table))))
+
+/** @def _H_MIGRATE(table, key_field, link, count)
+ *
+ *  @brief Move up to count old buckets into the new table
+ *
+ *  The old table is freed once its last bucket has been moved.
+ *
+ *  @param table The table being resized
+ *  @param key_field The field where the key is stored in the element
+ *  @param link The name of the link used to organize the bucket lists
+ *  @param count The number of old buckets to move
+ *  @return void
+ **/
+#define _H_MIGRATE(table, key_field, link, count)                            \
+    do {                                                                     \
+        int _left = count;                                                   \
+        typeof(*_H_TABLE(table))* _from;                                     \
+        typeof(*_H_TABLE(table))* _to;                                       \
+        typeof(*Q_GET_FRONT(_from)) *_moving;                                \
+        while (_H_OLD_TABLE(table) != NULL && _left-- > 0) {                 \
+            _from = _H_OLD_TABLE(table) + _H_MIGRATED(table);                \
+            while ((_moving = Q_GET_FRONT(_from)) != NULL) {                 \
+                Q_REMOVE(_from, _moving, link);                              \
+                _to = _H_BUCKET(table,                                       \
+                                _H_HASH(table, _H_KEY(_moving, key_field))); \
+                _H_BUCKET_INSERT(_to, _moving, link);                        \
+            }                                                                \
+            if (++_H_MIGRATED(table) == _H_OLD_CAP(table)) {                 \
+                free(_H_OLD_TABLE(table));                                   \
+                _H_OLD_TABLE(table) = NULL;                                  \
+                _H_OLD_CAP(table) = 0;                                       \
+                _H_MIGRATED(table) = 0;                                      \
+            }                                                                \
+        }                                                                    \
+    } while (0)
 
 /** @def _H_RESIZE_TABLE(table, key_field, link, new_size)
  *
- *  @brief Attempt to change the tables size to new size
+ *  @brief Attempt to start changing the tables size to new size
+ *
+ *  The buckets are moved a few at a time by later inserts and removes. A
+ *  resize still in progress is finished first.
  *
  *  On failure to allocate memory, this function simply keeps the table the
  *  same size instead of failing.
@@ -359,26 +464,18 @@ uint32_t hash_int(uint32_t x);
  *  @param table The table to resize
  *  @param key_field The field where the key is stored in the element
  *  @param link The name of the link used to organize the bucket lists
- *  @param new_size The new size for the table
+ *  @param new_size The new size for the table, a power of two
  *  @return void
  **/
 #define _H_RESIZE_TABLE(table, key_field, link, new_size)                     \
     do {                                                                      \
         int _new_cap = new_size;                                              \
-        int _hash, _i;                                                        \
-        typeof(*_H_TABLE(table))* _bucket;                                    \
-        typeof(*Q_GET_FRONT(_bucket)) *_search;                               \
+        _H_MIGRATE(table, key_field, link, _H_OLD_CAP(table));                \
         typeof(*_H_TABLE(table)) *_tmp = _H_ALLOC_TABLE(table, _new_cap);     \
         if (_tmp != NULL) {                                                   \
-            for (_i = 0; _i < _H_CAP(table); _i++) {                          \
-                _bucket = _H_BUCKET(table, _i);                               \
-                while((_search = Q_GET_FRONT(_bucket)) != NULL){              \
-                    Q_REMOVE(_bucket, _search, link);                         \
-                    _hash = hash_int(_H_KEY(_search, key_field)) % _new_cap;  \
-                    _H_BUCKET_INSERT((_tmp + _hash), _search, link);          \
-                }                                                             \
-            }                                                                 \
-            H_FREE_TABLE(table);                                              \
+            _H_OLD_TABLE(table) = _H_TABLE(table);                            \
+            _H_OLD_CAP(table) = _H_CAP(table);                                \
+            _H_MIGRATED(table) = 0;                                           \
             _H_TABLE(table) = _tmp;                                           \
             _H_CAP(table) = _new_cap;                                         \
         }                                                                     \
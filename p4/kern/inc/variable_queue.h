@@ -273,6 +273,30 @@
     } \
 } while(0)
 
+/** @def Q_CONCAT(Q_HEAD, Q_OTHER, LINK_NAME)
+ *
+ *  @brief Moves every element of the queue headed by Q_OTHER to the end of
+ *         the queue headed by Q_HEAD in constant time, leaving Q_OTHER empty.
+ *
+ *  @param Q_HEAD Pointer to the head of the queue to add to
+ *  @param Q_OTHER Pointer to the head of the queue to empty
+ *  @param LINK_NAME The name of the link used to organize both queues
+ *
+ *  @return Void
+ **/
+#define Q_CONCAT(Q_HEAD, Q_OTHER, LINK_NAME) do { \
+    if (Q_GET_FRONT(Q_OTHER) != NULL) { \
+        if (Q_GET_TAIL(Q_HEAD) == NULL) { \
+            Q_GET_FRONT(Q_HEAD) = Q_GET_FRONT(Q_OTHER); \
+        } else { \
+            Q_GET_NEXT(Q_GET_TAIL(Q_HEAD), LINK_NAME) = Q_GET_FRONT(Q_OTHER); \
+            Q_GET_PREV(Q_GET_FRONT(Q_OTHER), LINK_NAME) = Q_GET_TAIL(Q_HEAD); \
+        } \
+        Q_GET_TAIL(Q_HEAD) = Q_GET_TAIL(Q_OTHER); \
+        Q_INIT_HEAD(Q_OTHER); \
+    } \
+} while(0)
+
 /** @def Q_FOREACH(CURRENT_ELEM, Q_HEAD, LINK_NAME)
  *
  *  @brief Constructs an iterator block (like a for block) that operates
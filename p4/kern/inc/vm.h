@@ -19,6 +19,9 @@
 /** @brief A transparent struct declaration for the ppd */
 typedef struct page_directory page_directory_t;
 
+/** @brief The elf information of a program, from elf_410.h */
+struct simple_elf;
+
 /** @brief A struct for a list of allocations */
 Q_NEW_HEAD(alloc_list_t, alloc);
 H_NEW_TABLE(alloc_table_t, alloc_list_t);
@@ -30,15 +33,34 @@ typedef struct alloc {
     uint32_t size;
 } alloc_t;
 
+/** @brief The default largest number of pages populated after a fault */
+#define DEFAULT_FAULT_AROUND 16
+/** @brief The largest number of pages a process can populate after a fault */
+#define MAX_FAULT_AROUND 256
+
+/** @brief Page fault history used to populate pages ahead of faults */
+typedef struct fault_state {
+    uint32_t last_page;
+    int window;
+    int max_window;
+    int count;
+} fault_state_t;
+
 /** @brief Struct for page directories */
 typedef struct ppd {
     page_directory_t* dir;
     int frames;
     alloc_table_t alloc_table;
+    fault_state_t faults;
     mutex_t lock;
 } ppd_t;
 
 void init_virtual_memory();
+void enable_paging();
+void map_lapic(void* physical);
+void tlb_shootdown(ppd_t* ppd);
+void refill_zero_pool();
+void frame_alloc_stats();
 uint32_t page_align(uint32_t address);
 
 ppd_t *init_ppd();
@@ -46,12 +68,17 @@ ppd_t *init_ppd_from(ppd_t *from);
 void free_ppd(ppd_t* to_free, ppd_t* current);
 void free_ppd_user_mem(ppd_t *to_free);
 void free_ppd_kernel_mem(ppd_t* to_free);
-void _free_ppd_kernel_mem(ppd_t* to_free);
 void switch_ppd(ppd_t* ppd);
 
 int vm_alloc_readwrite(ppd_t *ppd, void *start, uint32_t size);
 int vm_back(ppd_t *ppd, uint32_t start, uint32_t size);
 int vm_free(ppd_t *ppd, void *start);
+int vm_map_physical(ppd_t *ppd, void *start, uint32_t physical,
+                    uint32_t size);
+void *vm_alloc_shared(uint32_t size);
+int vm_map_program(ppd_t *ppd, struct simple_elf *elf, void *start,
+                   uint32_t size);
+void vm_free_shared(void *physical, uint32_t size);
 
 int vm_user_strlen(ppd_t *ppd, char* start, int max_len);
 int vm_user_arrlen(ppd_t* ppd, char** start, int max_len);
@@ -64,10 +91,13 @@ int vm_user_can_write(ppd_t *ppd, void* start, uint32_t size);
 int vm_user_can_alloc(ppd_t *ppd, void* start, uint32_t size);
 
 int vm_write(ppd_t *ppd, void* buffer, void* start, uint32_t size);
+int vm_write_unloaded(ppd_t *ppd, void* buffer, uint32_t start,
+                      uint32_t size);
 int vm_read(ppd_t *ppd, void* buffer, void* start, uint32_t size);
 int vm_read_locked(ppd_t* ppd, void* buffer, uint32_t start, uint32_t size);
 int vm_write_locked(ppd_t* ppd, void* buffer, uint32_t start, uint32_t size);
 
 int vm_resolve_pagefault(ppd_t *ppd, uint32_t cr2, int error_code);
+int vm_set_fault_around(ppd_t *ppd, int pages);
 
 #endif // KERN_INC_VM_H
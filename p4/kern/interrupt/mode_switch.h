@@ -168,6 +168,26 @@ INT_ASM_H(IDT_XF);
  */
 NAME_ASM_H(timer_interrupt);
 
+/** @brief Wrapper for the local APIC timer interrupt handler
+ *  @return void
+ */
+NAME_ASM_H(lapic_timer_interrupt);
+
+/** @brief Wrapper for the TLB shootdown interrupt handler
+ *  @return void
+ */
+NAME_ASM_H(tlb_shootdown_interrupt);
+
+/** @brief Wrapper for the reschedule interrupt handler
+ *  @return void
+ */
+NAME_ASM_H(reschedule_interrupt);
+
+/** @brief Wrapper for the spurious local APIC interrupt handler
+ *  @return void
+ */
+NAME_ASM_H(spurious_interrupt);
+
 /*****************************************************************************
  ********* SYSCALL INTERRUPT HANDLERS*****************************************
  *****************************************************************************/
@@ -332,6 +352,66 @@ NAME_ASM_H(udriv_outb_syscall);
  */
 NAME_ASM_H(udriv_mmap_syscall);
 
+/** @brief Wrapper for fault_around syscall handler
+ *  @return void
+ */
+NAME_ASM_H(fault_around_syscall);
+
+/** @brief Wrapper for page_faults syscall handler
+ *  @return void
+ */
+NAME_ASM_H(page_faults_syscall);
+
+/** @brief Wrapper for udriv_send_buf syscall handler
+ *  @return void
+ */
+NAME_ASM_H(udriv_send_buf_syscall);
+
+/** @brief Wrapper for udriv_wait_buf syscall handler
+ *  @return void
+ */
+NAME_ASM_H(udriv_wait_buf_syscall);
+
+/** @brief Wrapper for udriv_call syscall handler
+ *  @return void
+ */
+NAME_ASM_H(udriv_call_syscall);
+
+/** @brief Wrapper for udriv_reply_wait syscall handler
+ *  @return void
+ */
+NAME_ASM_H(udriv_reply_wait_syscall);
+
+/** @brief Wrapper for udriv_share syscall handler
+ *  @return void
+ */
+NAME_ASM_H(udriv_share_syscall);
+
+/** @brief Wrapper for udriv_wait_many syscall handler
+ *  @return void
+ */
+NAME_ASM_H(udriv_wait_many_syscall);
+
+/** @brief Wrapper for udriv_config syscall handler
+ *  @return void
+ */
+NAME_ASM_H(udriv_config_syscall);
+
+/** @brief Wrapper for udriv_dropped syscall handler
+ *  @return void
+ */
+NAME_ASM_H(udriv_dropped_syscall);
+
+/** @brief Wrapper for spawn syscall handler
+ *  @return void
+ */
+NAME_ASM_H(spawn_syscall);
+
+/** @brief Wrapper for vfork syscall handler
+ *  @return void
+ */
+NAME_ASM_H(vfork_syscall);
+
 /*****************************************************************************
  ********* USER DEVICE INTERRUPT HANDLERS ************************************
  *****************************************************************************/
@@ -19,6 +19,7 @@
 #include <interrupt.h>
 #include <udriv_kern.h>
 #include <string.h>
+#include <cpu.h>
 
 /** @brief Struct for Interrupt Descriptor Table (IDT) entries
  */
@@ -60,6 +61,15 @@ void install_idt()
     memset(get_idt(33), 0, (256 - 33) * sizeof(IDT_entry));
     // install timer
     set_idt_device(NAME_ASM(timer_interrupt), TIMER_IDT_ENTRY);
+    // install local APIC interrupts, which must run with interrupts disabled
+    set_idt_exception(NAME_ASM(lapic_timer_interrupt), INTERRUPT,
+                      LAPIC_TIMER_IDT_ENTRY);
+    set_idt_exception(NAME_ASM(tlb_shootdown_interrupt), INTERRUPT,
+                      TLB_SHOOTDOWN_IDT_ENTRY);
+    set_idt_exception(NAME_ASM(reschedule_interrupt), INTERRUPT,
+                      RESCHEDULE_IDT_ENTRY);
+    set_idt_exception(NAME_ASM(spurious_interrupt), INTERRUPT,
+                      SPURIOUS_IDT_ENTRY);
     install_syscalls();
 }
 
@@ -134,6 +144,19 @@ void install_syscalls()
     set_idt_syscall(NAME_ASM(udriv_inb_syscall), UDRIV_INB_INT);
     set_idt_syscall(NAME_ASM(udriv_outb_syscall), UDRIV_OUTB_INT);
     set_idt_syscall(NAME_ASM(udriv_mmap_syscall), UDRIV_MMAP_INT);
+
+    set_idt_syscall(NAME_ASM(fault_around_syscall), FAULT_AROUND_INT);
+    set_idt_syscall(NAME_ASM(page_faults_syscall), PAGE_FAULTS_INT);
+    set_idt_syscall(NAME_ASM(udriv_send_buf_syscall), UDRIV_SEND_BUF_INT);
+    set_idt_syscall(NAME_ASM(udriv_wait_buf_syscall), UDRIV_WAIT_BUF_INT);
+    set_idt_syscall(NAME_ASM(udriv_call_syscall), UDRIV_CALL_INT);
+    set_idt_syscall(NAME_ASM(udriv_reply_wait_syscall), UDRIV_REPLY_WAIT_INT);
+    set_idt_syscall(NAME_ASM(udriv_share_syscall), UDRIV_SHARE_INT);
+    set_idt_syscall(NAME_ASM(udriv_wait_many_syscall), UDRIV_WAIT_MANY_INT);
+    set_idt_syscall(NAME_ASM(udriv_config_syscall), UDRIV_CONFIG_INT);
+    set_idt_syscall(NAME_ASM(udriv_dropped_syscall), UDRIV_DROPPED_INT);
+    set_idt_syscall(NAME_ASM(spawn_syscall), SPAWN_INT);
+    set_idt_syscall(NAME_ASM(vfork_syscall), VFORK_INT);
 }
 
 /** @brief Installs a handler into the IDT
@@ -31,6 +31,8 @@
 #include <console.h>
 #include <malloc_wrappers.h>
 #include <user_drivers.h>
+#include <cpu.h>
+#include <exec_index.h>
 
 /** @brief Kernel entrypoint.
  *
@@ -40,26 +42,36 @@
  */
 int kernel_main(mbinfo_t* mbinfo, int argc, char** argv, char** envp)
 {
+    // the heap needs no locks set up, so it can be used from the start
+    init_malloc();
     clear_console();
     install_idt();
     init_user_drivers();
     init_timer();
     init_print();
+    init_exec_index();
     init_virtual_memory();
+    init_smp(mbinfo);
     init_kernel_state();
-    // Create idle process
-    tcb_t *idle = new_program("idle", 0, NULL);
-    // Allow for correct context switching to idle
-    setup_for_switch(idle);
+    // Create an idle process for each processor
+    int i;
+    for (i = 0; i < num_cpus(); i++) {
+        tcb_t *idle = new_program("idle", 0, NULL);
+        init_idle(i, idle);
+    }
+    // Allow for correct context switching to the boot processor's idle
+    // the other processors enter their idle threads directly
+    setup_for_switch(get_cpu_by_id(0)->idle);
     // Create main program kernel will run
     tcb_t *tcb = new_program("init_udriv", 0, NULL);
     kernel_state.init = tcb;
-    init_scheduler(idle, tcb);
-    // Switch to thread safe malloc
+    init_scheduler(tcb);
+    init_reaper();
     // this **MUST** be done after all other initialization has been performed
     // otherwise semaphores can randomly enable interrupts
-    init_malloc();
     enable_mutexes();
+    // Start the other processors, which will run their idle threads
+    boot_aps();
     // Switch to 1st idle thread
     // Interrupts cannot yet be enabled, as they will trigger a fault since
     // there is no pcb entry for this kernel stack
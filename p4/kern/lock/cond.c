@@ -22,6 +22,7 @@
  */
 void cond_init(cond_t* cv)
 {
+    spinlock_init(&cv->lock);
     Q_INIT_HEAD(&cv->waiting);
     cv->state = INITIALIZED;
 }
@@ -42,6 +43,9 @@ void cond_destroy(cond_t* cv)
 }
 
 /** @brief Wait on a condition variable until signaled by cond_signal
+ *
+ *  The waiting list is protected by the condition variable's spinlock, which
+ *  is taken after the scheduler lock
  *
  *  @param cv The condition variable to wait on
  *  @param mp The mutex to wait with
@@ -54,10 +58,12 @@ void cond_wait(cond_t* cv, mutex_t* mp)
     }
     tcb_t *tcb = get_tcb();
     lock();
+    spin_lock(&cv->lock);
+    remove_runnable(tcb, T_KERN_SUSPENDED);
     Q_INSERT_TAIL(&cv->waiting, tcb, suspended_threads);
+    spin_unlock(&cv->lock);
     scheduler_mutex_unlock(mp);
-    deschedule(tcb, T_KERN_SUSPENDED);
-    unlock();
+    deschedule_locked(tcb);
     mutex_lock(mp);
 }
 
@@ -72,10 +78,14 @@ void cond_signal(cond_t* cv)
         panic("cannot signal an uninitialized condition variable");
     }
     lock();
-    if (!Q_IS_EMPTY(&cv->waiting)) {
-        tcb_t *tcb_to_schedule = Q_GET_FRONT(&cv->waiting);
+    spin_lock(&cv->lock);
+    tcb_t *tcb_to_schedule = Q_GET_FRONT(&cv->waiting);
+    if (tcb_to_schedule != NULL) {
         Q_REMOVE(&cv->waiting, tcb_to_schedule, suspended_threads);
-        schedule(tcb_to_schedule, T_KERN_SUSPENDED);
+    }
+    spin_unlock(&cv->lock);
+    if (tcb_to_schedule != NULL) {
+        schedule_locked(tcb_to_schedule, T_KERN_SUSPENDED);
     }
     unlock();
 }
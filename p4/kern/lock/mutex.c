@@ -1,12 +1,18 @@
 /** @file mutex.c
  *  @brief Implementation of functions for locking
  *
+ *  Every mutex is protected by its own spinlock, and the scheduler is
+ *  protected by the run queue lock of each processor, taken with lock().
+ *  When both are needed the scheduler lock must be taken first. A mutex
+ *  spinlock is never held while waiting for the scheduler lock.
+ *
  *  @author Jonathan Ong (jonathao)
  *  @author Evan Palmer (esp)
  *  @bug No known bugs
  **/
 
 #include <mutex.h>
+#include <spinlock.h>
 #include <stdlib.h>
 #include <control_block.h>
 #include <scheduler.h>
@@ -24,28 +30,6 @@
  **/
 static int enabled = 0;
 
-/** @brief Simple lock to prevent threads from interleaving
- *  In the current single processor kernel implementation, this only involves
- *  disabling interrupts.
- *
- *  @return void
- **/
-void lock()
-{
-    disable_interrupts();
-}
-
-/** @brief Simple unlock to allow threads to resume execution
- *  In the current single processor kernel implementation, this only involves
- *  re-enabling interrupts.
- *
- *  @return void
- **/
-void unlock()
-{
-    enable_interrupts();
-}
-
 /** @brief Initializes all mutexes for multithreaded usage
  *  This function enables mutexes once the kernel has been fully initialized.
  *
@@ -65,6 +49,7 @@ void enable_mutexes()
  **/
 void mutex_init(mutex_t* mp)
 {
+    spinlock_init(&mp->lock);
     mp->owner = UNSPECIFIED;
     mp->count = 1;
     Q_INIT_HEAD(&mp->waiting);
@@ -87,7 +72,8 @@ void mutex_destroy(mutex_t* mp)
 }
 
 /** @brief Lock a mutex
- *  Blocks until the lock for this mutex is acquired.
+ *  Blocks until the lock for this mutex is acquired. Uncontended mutexes are
+ *  acquired without taking the scheduler lock.
  *
  *  @param mp The mutex to lock
  *  @return void
@@ -99,20 +85,38 @@ void mutex_lock(mutex_t* mp)
             panic("cannot lock kernel mutex which is destroyed");
         }
         tcb_t *tcb = get_tcb();
+        disable_interrupts();
+        spin_lock(&mp->lock);
+        if (mp->count > 0) {
+            mp->count--;
+            spin_unlock(&mp->lock);
+            enable_interrupts();
+            mp->owner = tcb->id;
+            return;
+        }
+        // the scheduler lock must be taken before the mutex spinlock
+        spin_unlock(&mp->lock);
         lock();
-        mp->count--;
-        if (mp->count < 0) {
+        spin_lock(&mp->lock);
+        if (mp->count > 0) {
+            mp->count--;
+            spin_unlock(&mp->lock);
+            unlock();
+        } else {
+            // the unlocking thread will hand the mutex to us
+            remove_runnable(tcb, T_KERN_SUSPENDED);
             Q_INSERT_TAIL(&mp->waiting, tcb, suspended_threads);
-            deschedule(tcb, T_KERN_SUSPENDED);
+            spin_unlock(&mp->lock);
+            deschedule_locked(tcb);
         }
-        unlock();
         mp->owner = tcb->id;
     }
 }
 
 /** @brief Unlock a mutex
- *  Unlocks the given mutex without re-enabling interrupts. It is illegal for
- *  a thread other than the thread which called lock to unlock a mutex.
+ *  Unlocks the given mutex while holding the scheduler lock, which will still
+ *  be held on return. It is illegal for a thread other than the thread which
+ *  called lock to unlock a mutex.
  *
  *  @param mp The mutex to unlock
  *  @return void
@@ -126,14 +130,17 @@ void scheduler_mutex_unlock(mutex_t* mp)
     if (mp->count >= DESTROYED || mp->owner != tcb->id) {
         panic("cannot lock kernel mutex which is destroyed or not owned");
     }
+    spin_lock(&mp->lock);
     mp->owner = UNSPECIFIED;
-    mp->count++;
-    // wake the next thread up
     if (!Q_IS_EMPTY(&mp->waiting)) {
+        // hand the mutex directly to the next thread
         tcb_t *tcb_to_schedule = Q_GET_FRONT(&mp->waiting);
         Q_REMOVE(&mp->waiting, tcb_to_schedule, suspended_threads);
-        schedule_interrupts_disabled(tcb_to_schedule, T_KERN_SUSPENDED);
+        schedule_locked(tcb_to_schedule, T_KERN_SUSPENDED);
+    } else {
+        mp->count++;
     }
+    spin_unlock(&mp->lock);
 }
 
 
@@ -149,9 +156,22 @@ void mutex_unlock(mutex_t* mp)
     if(!enabled){
         return;
     }
+    tcb_t *tcb = get_tcb();
+    if (mp->count >= DESTROYED || mp->owner != tcb->id) {
+        panic("cannot lock kernel mutex which is destroyed or not owned");
+    }
+    disable_interrupts();
+    spin_lock(&mp->lock);
+    if (Q_IS_EMPTY(&mp->waiting)) {
+        mp->owner = UNSPECIFIED;
+        mp->count++;
+        spin_unlock(&mp->lock);
+        enable_interrupts();
+        return;
+    }
+    // waking a thread needs the scheduler lock, which must be taken first
+    spin_unlock(&mp->lock);
     lock();
     scheduler_mutex_unlock(mp);
     unlock();
 }
-
-
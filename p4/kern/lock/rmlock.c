@@ -0,0 +1,99 @@
+/** @file rmlock.c
+ *  @brief An implementation of read-mostly locks
+ *
+ *  Readers only write a flag belonging to their own processor, so readers
+ *  on different processors never contend for a cache line. A reader holds
+ *  the lock with interrupts disabled, so it must not block and must not be
+ *  taken with interrupts already disabled. Writers are serialized by a
+ *  mutex, raise the writing flag, and wait for every processor's reader to
+ *  leave, so they may block while they hold the lock.
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs
+ **/
+
+#include <rmlock.h>
+#include <atomic.h>
+#include <asm.h>
+#include <cpu.h>
+
+/** @brief Initialize a read-mostly lock to the unlocked state
+ *
+ *  @param rm The lock to initialize
+ *  @return void
+ **/
+void rmlock_init(rmlock_t* rm)
+{
+    int i;
+    for (i = 0; i < MAX_CPUS; i++) {
+        rm->readers[i].active = 0;
+    }
+    mutex_init(&rm->writers);
+    rm->writing = 0;
+}
+
+/** @brief Acquire a read-mostly lock for reading
+ *
+ *  @param rm The lock to acquire
+ *  @return void
+ **/
+void rm_read_lock(rmlock_t* rm)
+{
+    while (1) {
+        disable_interrupts();
+        volatile int* active = &rm->readers[get_cpu()->id].active;
+        // set before looking for a writer, so the writer either sees us or
+        // we see it
+        atomic_xchg(active, 1);
+        if (!rm->writing) {
+            return;
+        }
+        atomic_xchg(active, 0);
+        enable_interrupts();
+        // the writer may need this processor to finish
+        while (rm->writing) {
+            continue;
+        }
+    }
+}
+
+/** @brief Release a read-mostly lock held for reading
+ *
+ *  @param rm The lock to release
+ *  @return void
+ **/
+void rm_read_unlock(rmlock_t* rm)
+{
+    atomic_xchg(&rm->readers[get_cpu()->id].active, 0);
+    enable_interrupts();
+}
+
+/** @brief Acquire a read-mostly lock for writing
+ *
+ *  @param rm The lock to acquire
+ *  @return void
+ **/
+void rm_write_lock(rmlock_t* rm)
+{
+    int i;
+    mutex_lock(&rm->writers);
+    atomic_xchg(&rm->writing, 1);
+    // readers hold the lock with interrupts off, so they leave quickly
+    for (i = 0; i < MAX_CPUS; i++) {
+        while (rm->readers[i].active) {
+            continue;
+        }
+    }
+}
+
+/** @brief Release a read-mostly lock held for writing
+ *
+ *  @param rm The lock to release
+ *  @return void
+ **/
+void rm_write_unlock(rmlock_t* rm)
+{
+    atomic_xchg(&rm->writing, 0);
+    mutex_unlock(&rm->writers);
+}
@@ -0,0 +1,59 @@
+/** @file spinlock.c
+ *  @brief Implementation of spinlocks
+ *
+ *  Spinlocks do not touch the interrupt flag. A spinlock which may be taken
+ *  by code running on the same processor, including interrupt handlers, must
+ *  only be held with interrupts disabled.
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs
+ **/
+
+#include <spinlock.h>
+#include <atomic.h>
+
+/** @brief Initialize a spinlock to the unlocked state
+ *
+ *  @param sp The spinlock to initialize
+ *  @return void
+ **/
+void spinlock_init(spinlock_t* sp)
+{
+    sp->held = 0;
+}
+
+/** @brief Spin until the spinlock is acquired
+ *
+ *  @param sp The spinlock to acquire
+ *  @return void
+ **/
+void spin_lock(spinlock_t* sp)
+{
+    while (atomic_xchg(&sp->held, 1)) {
+        // wait for the lock to look free before trying the bus lock again
+        while (sp->held) {
+            continue;
+        }
+    }
+}
+
+/** @brief Try to acquire a spinlock without spinning
+ *
+ *  @param sp The spinlock to acquire
+ *  @return A boolean integer, true if the lock was acquired
+ **/
+int spin_trylock(spinlock_t* sp)
+{
+    return !atomic_xchg(&sp->held, 1);
+}
+
+/** @brief Release a spinlock
+ *
+ *  @param sp The spinlock to release
+ *  @return void
+ **/
+void spin_unlock(spinlock_t* sp)
+{
+    atomic_xchg(&sp->held, 0);
+}
@@ -2,6 +2,15 @@
  *
  *  @brief Functions to schedule threads
  *
+ *  Every processor has its own run queue protected by its own spinlock,
+ *  which lock() takes for the current processor. A thread which switches
+ *  away still holds the lock of its processor, and the thread it switches
+ *  to releases it. Woken threads go back to the queue of the processor they
+ *  last ran on when that queue is not busy, and processors with nothing to
+ *  run steal from the longest queue. A woken thread may be queued before it
+ *  is off of its old processor's stack, so threads which are still on a
+ *  processor are passed over until they are not.
+ *
  *  @author Jonathan Ong (jonathao)
  *  @author Evan Palmer (esp)
  *  @bug No known bugs.
@@ -14,7 +23,11 @@
 #include <simics.h>
 #include <asm.h>
 #include <contracts.h>
-#include <malloc_wrappers.h>
+#include <cpu.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <smp/smp.h>
+#include <smp/apic.h>
 #include "scheduler_internal.h"
 
 /** @brief Structure for a list of threads */
@@ -23,37 +36,149 @@ Q_NEW_HEAD(runnable_queue_t, tcb);
 /** @brief The ratio of p0 threads to p1 threads run */
 #define P0_PRIORITY 2
 
-/** @brief State of the scheduler including queues and number of ticks */
-static struct {
-    tcb_t* idle;
+/** @brief The runnable threads of one processor
+ *
+ *  Threads which are running on some processor are not in either queue
+ **/
+typedef struct run_queue {
+    spinlock_t lock;
     runnable_queue_t runnable_p0;
     runnable_queue_t runnable_p1;
     int p0_run_count;
-    uint32_t ticks;
-} scheduler = { 0 };
+    volatile int length;
+} run_queue_t;
+
+/** @brief State of the scheduler including the queues of every processor */
+static struct {
+    run_queue_t queues[MAX_CPUS];
+} scheduler;
+
+/** @brief Gets the run queue of the current processor
+ *
+ *  @return The run queue
+ **/
+static run_queue_t* this_queue()
+{
+    return &scheduler.queues[get_cpu()->id];
+}
 
-/** @brief Gets the number of ticks since system start
+/** @brief Take the scheduler lock of the current processor
  *
- *  @return The number of ticks
+ *  Interrupts are disabled on this processor while the lock is held. The
+ *  lock is not recursive.
+ *
+ *  @return void
  **/
-uint32_t get_ticks()
+void lock()
 {
-    return scheduler.ticks;
+    disable_interrupts();
+    spin_lock(&this_queue()->lock);
 }
 
-/** @brief Add a thread to the runnable list
+/** @brief Release the scheduler lock of the current processor and re-enable
+ *         interrupts
+ *
+ *  @return void
+ **/
+void unlock()
+{
+    spin_unlock(&this_queue()->lock);
+    enable_interrupts();
+}
+
+/** @brief Add a thread to the end of a run queue
+ *
+ *  @param queue The locked run queue to add to
+ *  @param tcb The thread to add
+ *  @param state Which of the runnable states the thread should be in
+ *  @return void
+ **/
+static void enqueue(run_queue_t* queue, tcb_t* tcb, thread_state_t state)
+{
+    tcb->state = state;
+    tcb->cpu = queue - scheduler.queues;
+    if (state == T_RUNNABLE_P0) {
+        Q_INSERT_TAIL(&queue->runnable_p0, tcb, runnable_threads);
+    } else {
+        Q_INSERT_TAIL(&queue->runnable_p1, tcb, runnable_threads);
+    }
+    queue->length++;
+}
+
+/** @brief Remove a thread from a run queue
+ *
+ *  @param queue The locked run queue the thread is in
+ *  @param tcb The thread to remove
+ *  @return void
+ **/
+static void dequeue(run_queue_t* queue, tcb_t* tcb)
+{
+    if (tcb->state == T_RUNNABLE_P0) {
+        Q_REMOVE(&queue->runnable_p0, tcb, runnable_threads);
+    } else if (tcb->state == T_RUNNABLE_P1) {
+        Q_REMOVE(&queue->runnable_p1, tcb, runnable_threads);
+    } else {
+        panic("Dequeue called on thread which is not runnable");
+    }
+    queue->length--;
+}
+
+/** @brief Make an idle processor look at its run queue
+ *
+ *  Must be called with interrupts disabled. An idle processor would not
+ *  otherwise notice the thread until its next timer interrupt. The boot
+ *  processor has its timer brought forward, and the others are sent an
+ *  interprocessor interrupt.
+ *
+ *  @param id The processor whose run queue the thread is in
+ *  @return void
+ **/
+void kick_idle(int id)
+{
+    cpu_t* cpu = get_cpu_by_id(id);
+    if (cpu->current != cpu->idle) {
+        return;
+    }
+    if (id == TIMER_CPU) {
+        set_timer_deadline(get_ticks());
+    } else {
+        apic_ipi_cpu(id, RESCHEDULE_IDT_ENTRY);
+    }
+}
+
+/** @brief Add a woken thread to a run queue
+ *
+ *  Must be called with the scheduler lock held. The thread goes back to the
+ *  processor it last ran on if that processor's queue can be locked without
+ *  waiting, since waiting here could deadlock with that processor.
  *
  *  @param tcb The thread to add
  *  @return void
  **/
 void add_runnable(tcb_t* tcb)
 {
-    tcb->state = T_RUNNABLE_P0;
-    // add threads to the end of the high priority queue
-    Q_INSERT_TAIL(&scheduler.runnable_p0, tcb, runnable_threads);
+    run_queue_t* queue = this_queue();
+    run_queue_t* last = &scheduler.queues[tcb->cpu];
+    if (last != queue && spin_trylock(&last->lock)) {
+        enqueue(last, tcb, T_RUNNABLE_P0);
+        spin_unlock(&last->lock);
+    } else {
+        enqueue(queue, tcb, T_RUNNABLE_P0);
+    }
+    kick_idle(tcb->cpu);
+}
+
+/** @brief Is this thread the idle thread of its processor
+ *
+ *  @param tcb The thread to check
+ *  @return A boolean integer
+ **/
+int is_idle(tcb_t* tcb)
+{
+    return tcb == get_cpu_by_id(tcb->cpu)->idle;
 }
 
-/** @brief Is this thread runnable
+/** @brief Is this thread waiting in a runnable queue
  *
  *  @param tcb The thread to check
  *  @return A boolean integer
@@ -63,114 +188,191 @@ int is_runnable(tcb_t* tcb)
     return tcb->state == T_RUNNABLE_P0 || tcb->state == T_RUNNABLE_P1;
 }
 
-/** @brief Remove a thread from the runnable list, and update it's state
+/** @brief Mark the running thread as no longer runnable
+ *
+ *  Must be called with the scheduler lock held, before the thread can be
+ *  found by the threads which will wake it.
  *
  *  @param tcb The thread to remove
  *  @param state The new state of the removed thread
+ *  @return void
  **/
 void remove_runnable(tcb_t* tcb, thread_state_t state)
 {
-    if (tcb->state == T_RUNNABLE_P0) {
-        Q_REMOVE(&scheduler.runnable_p0, tcb, runnable_threads);
-    } else if (tcb->state == T_RUNNABLE_P1) {
-        Q_REMOVE(&scheduler.runnable_p1, tcb, runnable_threads);
-    } else {
-        panic("Removing runnable called on thread which is not runnable");
+    if (tcb->state != T_RUNNING) {
+        panic("Removing runnable called on thread which is not running");
     }
     tcb->state = state;
 }
 
-/** @brief Get the next runnable thread
+/** @brief Find the first thread in a list which is off of every processor
+ *
+ *  A thread which is still switching away on another processor cannot be
+ *  run until it is off of that processor's stack.
  *
+ *  @param list The list of a locked run queue
+ *  @return The thread or NULL if there is none
+ **/
+static tcb_t* first_ready(runnable_queue_t* list)
+{
+    tcb_t* tcb;
+    Q_FOREACH(tcb, list, runnable_threads) {
+        if (!tcb->on_cpu) {
+            return tcb;
+        }
+    }
+    return NULL;
+}
+
+/** @brief Take the next runnable thread off of a run queue
+ *
+ *  @param queue The locked run queue
  *  @return The next runnable thread or NULL if there is no runnable thread
  **/
-tcb_t* get_next_runnable()
+static tcb_t* get_next_runnable(run_queue_t* queue)
 {
+    tcb_t* next = NULL;
+    tcb_t* p0 = first_ready(&queue->runnable_p0);
+    tcb_t* p1 = first_ready(&queue->runnable_p1);
     // if there is a low priority thread to run and we have run too many
     // high priority threads recently
-    if (scheduler.p0_run_count >= P0_PRIORITY &&
-            !Q_IS_EMPTY(&scheduler.runnable_p1)) {
-        scheduler.p0_run_count = 0;
-        return Q_GET_FRONT(&scheduler.runnable_p1);
-    }
-    // if there is a high priority thread to run
-    if (!Q_IS_EMPTY(&scheduler.runnable_p0)) {
-        if(scheduler.p0_run_count < P0_PRIORITY){
-            scheduler.p0_run_count++;
+    if (queue->p0_run_count >= P0_PRIORITY && p1 != NULL) {
+        queue->p0_run_count = 0;
+        next = p1;
+    } else if (p0 != NULL) {
+        // if there is a high priority thread to run
+        if(queue->p0_run_count < P0_PRIORITY){
+            queue->p0_run_count++;
         }
-        return Q_GET_FRONT(&scheduler.runnable_p0);
+        next = p0;
+    } else if (p1 != NULL) {
+        // if there is a low priority thread to run
+        queue->p0_run_count = 0;
+        next = p1;
     }
-    // if there is a low priority thread to run
-    if (!Q_IS_EMPTY(&scheduler.runnable_p1)) {
-        scheduler.p0_run_count = 0;
-        return Q_GET_FRONT(&scheduler.runnable_p1);
+    if (next != NULL) {
+        dequeue(queue, next);
     }
-    // if there is no thread to run
-    return NULL;
+    return next;
 }
 
-/** @brief Rotate the runnable queue
+/** @brief Steal a thread from the longest run queue of another processor
  *
- *  Moves the thread at the front to the end of the p1 runnable queue
+ *  The thread which has waited longest is taken, since it is the least
+ *  likely to still be in the other processor's cache.
  *
- *  @return void
+ *  @param self The number of the current processor
+ *  @return The stolen thread or NULL if there was nothing to steal
  **/
-void rotate_runnable()
+static tcb_t* steal_runnable(int self)
 {
-    tcb_t* next = get_next_runnable();
-    // add the thread to the low priority queue
-    remove_runnable(next, T_RUNNABLE_P1);
-    Q_INSERT_TAIL(&scheduler.runnable_p1, next, runnable_threads);
+    int i, longest = 0;
+    run_queue_t* victim = NULL;
+    // the lengths are read without locks, so this is only a hint
+    for (i = 0; i < num_cpus(); i++) {
+        run_queue_t* queue = &scheduler.queues[i];
+        if (i != self && queue->length > longest) {
+            longest = queue->length;
+            victim = queue;
+        }
+    }
+    // we hold our own lock, so waiting for the victim's could deadlock
+    if (victim == NULL || !spin_trylock(&victim->lock)) {
+        return NULL;
+    }
+    tcb_t* next = first_ready(&victim->runnable_p1);
+    if (next == NULL) {
+        next = first_ready(&victim->runnable_p0);
+    }
+    if (next != NULL) {
+        dequeue(victim, next);
+    }
+    spin_unlock(&victim->lock);
+    return next;
 }
 
 /** @brief Initializes the scheduler
  *
- *  @param idle The idle thread
- *  @param first The first thread which should be run
+ *  @param first The first thread which should be run on this processor
  *
  *  @return void
  */
-void init_scheduler(tcb_t* idle, tcb_t* first)
+void init_scheduler(tcb_t* first)
 {
-    Q_INIT_HEAD(&scheduler.runnable_p0);
-    Q_INIT_HEAD(&scheduler.runnable_p1);
-    scheduler.idle = idle;
-    add_runnable(first);
+    int i;
+    for (i = 0; i < MAX_CPUS; i++) {
+        run_queue_t* queue = &scheduler.queues[i];
+        spinlock_init(&queue->lock);
+        Q_INIT_HEAD(&queue->runnable_p0);
+        Q_INIT_HEAD(&queue->runnable_p1);
+    }
+    cpu_t* cpu = get_cpu();
+    first->state = T_RUNNING;
+    first->cpu = cpu->id;
+    first->on_cpu = 1;
+    cpu->current = first;
     init_sleep();
 }
 
+/** @brief Sets the thread a processor runs when nothing else is runnable
+ *
+ *  Idle threads are always running and are never in the runnable queues
+ *
+ *  @param cpu The processor number
+ *  @param idle The idle thread
+ *  @return void
+ */
+void init_idle(int cpu, tcb_t* idle)
+{
+    idle->state = T_RUNNING;
+    idle->cpu = cpu;
+    idle->on_cpu = 0;
+    get_cpu_by_id(cpu)->idle = idle;
+}
+
 /** @brief Switches to the next thread to be run
+ *
+ *  Must be called with the scheduler lock held, which is released once the
+ *  switch has completed. If the current thread is still running it goes to
+ *  the back of this processor's runnable queues.
  *
  *  @param current The tcb of the current thread
- *  @param schedule Should this switch update the scheduling queue
  *  @return void
  **/
-void switch_to_next(tcb_t* current, schedule_mode_t schedule)
+void switch_to_next(tcb_t* current)
 {
-
-    tcb_t* next = get_next_runnable();
-    if (next != NULL) {
-        if (schedule) {
-            rotate_runnable();
-        }
-
-        if (current->id != next->id) {
-            context_switch(current, next);
-        }
-    } else {
-        // no runnable threads, should run idle
-        if (current->id != scheduler.idle->id) {
-            context_switch(current, scheduler.idle);
+    cpu_t* cpu = get_cpu();
+    run_queue_t* queue = &scheduler.queues[cpu->id];
+    int running = (current->state == T_RUNNING);
+    tcb_t* next = get_next_runnable(queue);
+    if (next == NULL && (!running || current == cpu->idle)) {
+        next = steal_runnable(cpu->id);
+    }
+    if (next == NULL) {
+        if (running) {
+            // nothing else to run so keep running the current thread
+            unlock();
+            return;
         }
+        next = cpu->idle;
+    } else if (running && current != cpu->idle) {
+        enqueue(queue, current, T_RUNNABLE_P1);
     }
-    // must re-enable interrupts if not context switching
-    enable_interrupts();
+    next->state = T_RUNNING;
+    next->cpu = cpu->id;
+    if (next == current) {
+        // we were woken and then stolen back before switching away
+        unlock();
+        return;
+    }
+    context_switch(current, next);
 }
 
 /** @brief Runs the next thread in the runnable queue
  *
- *  Interrupts need to be disabled since run_next() can be called in yield()
- *  and not just from within the scheduler.
+ *  Called from the timer interrupt with the scheduler lock held. The timer
+ *  only needs to fire again at the end of a quantum if there is more than
+ *  the idle thread to run, otherwise it waits for the next sleeper.
  *
  *  @param ticks The number of ticks since system boot
  *
@@ -178,9 +380,42 @@ void switch_to_next(tcb_t* current, schedule_mode_t schedule)
  */
 void run_scheduler(uint32_t ticks)
 {
-    scheduler.ticks = ticks;
+    cpu_t* cpu = get_cpu();
+    tcb_t* current = get_tcb();
     schedule_sleepers(ticks);
-    switch_to_next(get_tcb(), SCHEDULE_MODE);
+    int busy = current != cpu->idle || this_queue()->length > 0;
+    rearm_timer(ticks, busy);
+    switch_to_next(current);
+}
+
+/** @brief Preempts the current thread on this processor
+ *
+ *  Called from the local APIC timer interrupt with the scheduler lock held
+ *
+ *  @return void
+ */
+void preempt()
+{
+    switch_to_next(get_tcb());
+}
+
+/** @brief Handle a reschedule request from another processor
+ *
+ *  Sent by kick_idle when a thread is queued for this processor while it is
+ *  idle. The boot processor is sent one when its timer must fire before the
+ *  deadline it is sleeping until.
+ *
+ *  @return void
+ */
+void reschedule_interrupt()
+{
+    lock();
+    apic_eoi();
+    if (get_cpu()->id == TIMER_CPU) {
+        run_scheduler(get_ticks());
+    } else {
+        preempt();
+    }
 }
 
 /** @brief Schedules the thread to be run
@@ -191,25 +426,56 @@ void run_scheduler(uint32_t ticks)
  */
 void schedule(tcb_t* tcb, thread_state_t expected)
 {
-    disable_interrupts();
-    schedule_interrupts_disabled(tcb, expected);
-    enable_interrupts();
+    lock();
+    schedule_locked(tcb, expected);
+    unlock();
 }
 
-/** @brief Schedules the thread to be run
+/** @brief Schedules the thread to be run while holding the scheduler lock
  *
  *  @param tcb Pointer to tcb of thread to schedule
  *  @param expected The state the scheduling thread expects to find the tcb in
  *  @return void
  */
-void schedule_interrupts_disabled(tcb_t* tcb, thread_state_t expected)
+void schedule_locked(tcb_t* tcb, thread_state_t expected)
 {
-    if (tcb->state != expected) {
+    volatile int* state = (volatile int*)&tcb->state;
+    if (atomic_cmpxchg(state, expected, T_RUNNABLE_P0) != expected) {
         panic("Thread schedule attempted, thread not in expected state");
     }
     add_runnable(tcb);
 }
 
+/** @brief Switch straight to a thread the current thread has just woken
+ *
+ *  Must be called with the scheduler lock held, after the current thread
+ *  has been taken off the processor with remove_runnable. The woken thread
+ *  never enters a run queue, and runs on this processor for the rest of the
+ *  current quantum. If the woken thread is still switching away on another
+ *  processor it is queued instead. The lock is released once the switch has
+ *  completed.
+ *
+ *  @param current The tcb of the current thread
+ *  @param next Pointer to tcb of thread to switch to
+ *  @param expected The state the current thread expects to find next in
+ *  @return void
+ **/
+void handoff_locked(tcb_t* current, tcb_t* next, thread_state_t expected)
+{
+    volatile int* state = (volatile int*)&next->state;
+    assert(current->state != T_RUNNING && next != current);
+    if (next->on_cpu) {
+        schedule_locked(next, expected);
+        switch_to_next(current);
+        return;
+    }
+    if (atomic_cmpxchg(state, expected, T_RUNNING) != expected) {
+        panic("Thread handoff attempted, thread not in expected state");
+    }
+    next->cpu = get_cpu()->id;
+    context_switch(current, next);
+}
+
 /** @brief Schedule a thread using the make_runnable thread
  *
  *  The thread must have been suspended by the user
@@ -220,63 +486,67 @@ void schedule_interrupts_disabled(tcb_t* tcb, thread_state_t expected)
  **/
 int user_schedule(tcb_t* tcb, mutex_t* mp)
 {
-    disable_interrupts();
-    scheduler_mutex_unlock(mp);
-    if (tcb->state != T_SUSPENDED) {
-        enable_interrupts();
+    volatile int* state = (volatile int*)&tcb->state;
+    lock();
+    // only one of any racing calls may make the thread runnable
+    if (atomic_cmpxchg(state, T_SUSPENDED, T_RUNNABLE_P0) != T_SUSPENDED) {
+        scheduler_mutex_unlock(mp);
+        unlock();
         return -1;
     }
     add_runnable(tcb);
-    enable_interrupts();
+    scheduler_mutex_unlock(mp);
+    unlock();
     return 0;
 }
 
-/** @brief Deschedules the current thread, and drops a mutex
+/** @brief Deschedules the current thread
  *
  *  @param tcb The thread to deschedule
- *  @param mp The mutex to drop
  *  @param new_state The threads new state upon being descheduled
  *  @return void
  **/
-void deschedule_and_drop(tcb_t* tcb, mutex_t* mp, thread_state_t new_state)
+void deschedule(tcb_t* tcb, thread_state_t new_state)
 {
-    disable_interrupts();
-    scheduler_mutex_unlock(mp);
+    lock();
     remove_runnable(tcb, new_state);
-    switch_to_next(tcb, YIELD_MODE);
+    deschedule_locked(tcb);
 }
 
-/** @brief Deschedules the current thread
+/** @brief Switch away from the current thread while holding the scheduler
+ *         lock, after it has been removed with remove_runnable
+ *
+ *  The scheduler lock is released when the thread is next run
  *
  *  @param tcb The thread to deschedule
- *  @param new_state The threads new state upon being descheduled
  *  @return void
  **/
-void deschedule(tcb_t* tcb, thread_state_t new_state)
+void deschedule_locked(tcb_t* tcb)
 {
-    disable_interrupts();
-    remove_runnable(tcb, new_state);
-    switch_to_next(tcb, YIELD_MODE);
+    switch_to_next(tcb);
 }
 
 /** @brief Kills the current thread, setting it's exit status to T_EXITED
  *
- *  kill_thread must be called with the malloc_mutex held, so that the threads
- *  memory cannot be freed before it is deschedule, kill_thread will drop
- *  this mutex
+ *  The thread is queued to be reaped with interrupts disabled, so that its
+ *  memory cannot be freed before it is descheduled
  *
  *  @param tcb The thread to kill
  *  @return void
  **/
 void kill_thread(tcb_t* tcb)
 {
-    disable_interrupts();
-    scheduler_release_malloc();
+    lock();
     remove_runnable(tcb, T_EXITED);
-    switch_to_next(tcb, YIELD_MODE);
+    defer_exit(tcb);
+    deschedule_locked(tcb);
 }
 
 /** @brief Deschedule a runnable thread using the deschedule call
+ *
+ *  The thread is marked suspended before the reject pointer is read, so a
+ *  racing make_runnable either sees the suspended thread or happens before
+ *  the read and is reflected in the reject value.
  *
  *  @param tcb The thread to deschedule
  *  @param esi The reject pointer passed by the user
@@ -285,23 +555,59 @@ void kill_thread(tcb_t* tcb)
 int user_deschedule(tcb_t* tcb, uint32_t esi)
 {
     ppd_t* ppd = tcb->process->directory;
+    volatile int* state = (volatile int*)&tcb->state;
+    int reject, status = 0;
     mutex_lock(&ppd->lock);
-    disable_interrupts();
-    int reject;
+    lock();
+    atomic_xchg(state, T_SUSPENDED);
     if (vm_read(ppd, &reject, (void*)esi, sizeof(esi)) < 0) {
-        enable_interrupts();
-        mutex_unlock(&ppd->lock);
+        status = -1;
+    }
+    if (status < 0 || reject != 0) {
+        // if make_runnable got to us first, we are already in a queue
+        if (atomic_cmpxchg(state, T_SUSPENDED, T_RUNNING) == T_SUSPENDED) {
+            unlock();
+            mutex_unlock(&ppd->lock);
+            return status;
+        }
+    }
+    scheduler_mutex_unlock(&ppd->lock);
+    deschedule_locked(tcb);
+    return status;
+}
+
+/** @brief Take a runnable thread out of whichever run queue it is in
+ *
+ *  Must be called with the scheduler lock held.
+ *
+ *  @param tcb The thread to take
+ *  @return One if the thread was taken, zero if it is running or could not
+ *          be taken without waiting, less than zero if it is not runnable
+ **/
+static int take_runnable(tcb_t* tcb)
+{
+    run_queue_t* own = this_queue();
+    int cpu = tcb->cpu;
+    run_queue_t* queue = &scheduler.queues[cpu];
+    if (tcb->state == T_RUNNING || tcb->on_cpu) {
+        return 0;
+    }
+    if (!is_runnable(tcb)) {
         return -1;
     }
-    if (reject != 0) {
-        enable_interrupts();
-        mutex_unlock(&ppd->lock);
+    if (queue != own && !spin_trylock(&queue->lock)) {
         return 0;
     }
-    scheduler_mutex_unlock(&ppd->lock);
-    remove_runnable(tcb, T_SUSPENDED);
-    switch_to_next(tcb, YIELD_MODE);
-    return 0;
+    // the thread may have been stolen or run since we looked
+    int taken = 0;
+    if (tcb->cpu == cpu && is_runnable(tcb) && !tcb->on_cpu) {
+        dequeue(queue, tcb);
+        taken = 1;
+    }
+    if (queue != own) {
+        spin_unlock(&queue->lock);
+    }
+    return taken;
 }
 
 /** @brief Yields execution to another thread
@@ -318,21 +624,37 @@ int yield(int yield_tid)
     }
     // Get scheduler to choose next thread to run if tid is -1
     if (yield_tid == -1) {
-        disable_interrupts();
-        switch_to_next(tcb, YIELD_MODE);
+        lock();
+        switch_to_next(tcb);
         return 0;
     }
-    // Yield to a specific thread
+    // Yield to a specific thread, holding the thread list mutex keeps the
+    // thread from exiting until we have taken it off of its run queue
     mutex_lock(&kernel_state.threads_mutex);
     tcb_t* yield_tcb = get_tcb_by_id(yield_tid);
     // Thou shalt not yield to threads which don't exist, or are not runnable
-    disable_interrupts();
-    if (yield_tcb == NULL || !is_runnable(yield_tcb)) {
-        enable_interrupts();
+    if (yield_tcb == NULL) {
         mutex_unlock(&kernel_state.threads_mutex);
         return -1;
     }
+    lock();
+    int taken = take_runnable(yield_tcb);
     scheduler_mutex_unlock(&kernel_state.threads_mutex);
+    if (taken < 0) {
+        unlock();
+        return -1;
+    }
+    if (taken == 0) {
+        // running elsewhere or busy, just give up this processor
+        switch_to_next(tcb);
+        return 0;
+    }
+    cpu_t* cpu = get_cpu();
+    if (tcb != cpu->idle) {
+        enqueue(&scheduler.queues[cpu->id], tcb, T_RUNNABLE_P1);
+    }
+    yield_tcb->state = T_RUNNING;
+    yield_tcb->cpu = cpu->id;
     context_switch(tcb, yield_tcb);
     return 0;
 }
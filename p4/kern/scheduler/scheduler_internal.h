@@ -10,16 +10,17 @@
 #ifndef SCHEDULER_INTERNAL_H
 #define SCHEDULER_INTERNAL_H
 
-/** @brief Scheduling modes */
-typedef enum {
-    YIELD_MODE,
-    SCHEDULE_MODE
-} schedule_mode_t;
+/** @brief The processor which the PIT interrupts */
+#define TIMER_CPU 0
 
 void init_sleep();
 void schedule_sleepers(uint32_t current);
-void switch_to_next(tcb_t* current, schedule_mode_t schedule);
+int next_wake_tick(uint32_t *tick);
+void set_timer_deadline(uint32_t tick);
+void rearm_timer(uint32_t ticks, int busy);
+void switch_to_next(tcb_t* current);
 void add_runnable(tcb_t *tcb);
-void remove_runnable(tcb_t *tcb, thread_state_t state);
+void kick_idle(int id);
+int is_runnable(tcb_t *tcb);
 
 #endif //SCHEDULER_INTERNAL_H
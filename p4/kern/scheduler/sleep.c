@@ -2,37 +2,191 @@
  *
  *  @brief Functions to sleep threads
  *
+ *  Sleeping threads are kept in a binary min heap ordered by the tick they
+ *  should wake at, so adding a sleeper takes O(log n) time and the timer
+ *  interrupt wakes every expired sleeper at once. The heap array only grows
+ *  while sleep_mutex is held, so the timer interrupt never allocates.
+ *
+ *  Threads waiting for an interrupt with a timeout are kept in the same
+ *  heap. Whichever of the interrupt and the timer clears the thread's
+ *  waiting flag first wakes it, and an interrupt takes the thread out of
+ *  the heap.
+ *
  *  @author Jonathan Ong (jonathao)
  *  @author Evan Palmer (esp)
  *  @bug No known bugs.
  **/
 
-#include <variable_queue.h>
 #include <control_block.h>
 #include <scheduler.h>
+#include <malloc.h>
+#include <string.h>
 #include <asm.h>
 #include <simics.h>
+#include <spinlock.h>
+#include <atomic.h>
 #include "scheduler_internal.h"
 
-Q_NEW_HEAD(sleeper_list_t, tcb);
-static sleeper_list_t sleep_list;
-static mutex_t sleep_mutex;
+/** @brief The number of sleepers the heap initially has room for */
+#define INITIAL_SLEEPERS 32
 
+/** @brief The parent of a heap index */
+#define PARENT(i) (((i) - 1) / 2)
+/** @brief The left child of a heap index */
+#define LEFT(i) (2 * (i) + 1)
+/** @brief The right child of a heap index */
+#define RIGHT(i) (2 * (i) + 2)
+
+/** @brief The sleeping threads ordered by wake tick */
+static struct {
+    tcb_t** heap;
+    int size;
+    int capacity;
+} sleepers;
+
+/** @brief Serializes threads adding themselves to the heap */
+static mutex_t sleep_mutex;
+/** @brief Protects the heap from the timer interrupt */
+static spinlock_t sleep_lock;
 
 /** @brief Initialize state needed for the sleep system call
  *  @return void
  **/
 void init_sleep()
 {
-    Q_INIT_HEAD(&sleep_list);
+    sleepers.heap = NULL;
+    sleepers.size = 0;
+    sleepers.capacity = 0;
     mutex_init(&sleep_mutex);
+    spinlock_init(&sleep_lock);
+}
+
+/** @brief Swap two entries of the heap
+ *
+ *  @param i The first index
+ *  @param j The second index
+ *  @return void
+ **/
+static void heap_swap(int i, int j)
+{
+    tcb_t* tmp = sleepers.heap[i];
+    sleepers.heap[i] = sleepers.heap[j];
+    sleepers.heap[j] = tmp;
+    sleepers.heap[i]->sleep_index = i;
+    sleepers.heap[j]->sleep_index = j;
 }
 
-/** @brief Add a the current thread to the list of sleeping threads
- *  @param tcb The tcb of the current thread;w
+/** @brief Does one thread wake before another
+ *
+ *  Ticks wrap, so wake ticks are compared by their signed difference
+ *
+ *  @param a The first thread
+ *  @param b The second thread
+ *  @return A boolean integer
+ **/
+static int wakes_before(tcb_t* a, tcb_t* b)
+{
+    return (int32_t)(a->wake_tick - b->wake_tick) < 0;
+}
+
+/** @brief Add a thread to the heap
+ *
+ *  Must be called with sleep_lock held and room in the heap
+ *
+ *  @param tcb The thread to add
+ *  @return void
+ **/
+static void heap_push(tcb_t* tcb)
+{
+    int i = sleepers.size++;
+    sleepers.heap[i] = tcb;
+    tcb->sleep_index = i;
+    while (i > 0 && wakes_before(sleepers.heap[i],
+                                 sleepers.heap[PARENT(i)])) {
+        heap_swap(i, PARENT(i));
+        i = PARENT(i);
+    }
+}
+
+/** @brief Remove a thread from the heap
+ *
+ *  Must be called with sleep_lock held
+ *
+ *  @param i The index of the thread in the heap
+ *  @return The removed thread
+ **/
+static tcb_t* heap_remove(int i)
+{
+    tcb_t* removed = sleepers.heap[i];
+    removed->sleep_index = -1;
+    if (--sleepers.size == i) {
+        return removed;
+    }
+    sleepers.heap[i] = sleepers.heap[sleepers.size];
+    sleepers.heap[i]->sleep_index = i;
+    // the moved thread may belong above or below its new place
+    while (i > 0 && wakes_before(sleepers.heap[i],
+                                 sleepers.heap[PARENT(i)])) {
+        heap_swap(i, PARENT(i));
+        i = PARENT(i);
+    }
+    while (1) {
+        int min = i;
+        if (LEFT(i) < sleepers.size &&
+                wakes_before(sleepers.heap[LEFT(i)], sleepers.heap[min])) {
+            min = LEFT(i);
+        }
+        if (RIGHT(i) < sleepers.size &&
+                wakes_before(sleepers.heap[RIGHT(i)], sleepers.heap[min])) {
+            min = RIGHT(i);
+        }
+        if (min == i) {
+            break;
+        }
+        heap_swap(i, min);
+        i = min;
+    }
+    return removed;
+}
+
+/** @brief Make sure there is room in the heap for one more sleeper
+ *
+ *  Must be called with sleep_mutex held, since only threads holding it can
+ *  add to the heap. The timer interrupt only ever shrinks the heap.
+ *
+ *  @return Zero on success, less than zero on failure
+ **/
+static int reserve_sleeper()
+{
+    if (sleepers.size < sleepers.capacity) {
+        return 0;
+    }
+    int capacity = sleepers.capacity == 0 ? INITIAL_SLEEPERS
+                                          : 2 * sleepers.capacity;
+    tcb_t** heap = malloc(capacity * sizeof(tcb_t*));
+    if (heap == NULL) {
+        return -1;
+    }
+    tcb_t** old = sleepers.heap;
+    lock();
+    spin_lock(&sleep_lock);
+    memcpy(heap, old, sleepers.size * sizeof(tcb_t*));
+    sleepers.heap = heap;
+    sleepers.capacity = capacity;
+    spin_unlock(&sleep_lock);
+    unlock();
+    free(old);
+    return 0;
+}
+
+/** @brief Add a the current thread to the sleeping threads
+ *
+ *  @param tcb The tcb of the current thread
  *  @param ticks The number of ticks to sleep for
+ *  @return Less than zero on failure, zero if the thread did not sleep, and
+ *          greater than zero if it slept
  **/
-int add_sleeper(tcb_t* tcb, uint32_t ticks)
+int add_sleeper(tcb_t* tcb, int ticks)
 {
     if (ticks < 0) {
         return -1;
@@ -41,59 +195,124 @@ int add_sleeper(tcb_t* tcb, uint32_t ticks)
         return 0;
     }
     mutex_lock(&sleep_mutex);
-    tcb_t* iter;
+    if (reserve_sleeper() < 0) {
+        mutex_unlock(&sleep_mutex);
+        return -1;
+    }
     uint32_t until = get_ticks() + ticks;
-    // O(n) time holding the lock
-    Q_FOREACH(iter, &sleep_list, sleeping_threads)
-    {
-        if (iter->wake_tick >= until) {
-            break;
-        }
+    // O(log n) time holding the scheduler lock
+    lock();
+    spin_lock(&sleep_lock);
+    tcb->wake_tick = until;
+    remove_runnable(tcb, T_SLEEPING);
+    heap_push(tcb);
+    spin_unlock(&sleep_lock);
+    set_timer_deadline(until);
+    scheduler_mutex_unlock(&sleep_mutex);
+    deschedule_locked(tcb);
+    return 1;
+}
+
+/** @brief Make room for the current thread to wait with a timeout
+ *
+ *  Must be followed by unlock_sleepers, and add_timeout may only be called
+ *  between the two.
+ *
+ *  @return Zero on success, less than zero on failure
+ **/
+int lock_sleepers()
+{
+    mutex_lock(&sleep_mutex);
+    if (reserve_sleeper() < 0) {
+        mutex_unlock(&sleep_mutex);
+        return -1;
     }
-    // O(1) disable interrupts time
-    disable_interrupts();
-    // if iter is the last element we might want to insert after
+    return 0;
+}
+
+/** @brief Let other threads add themselves to the sleeping threads
+ *
+ *  Must be called with the scheduler lock held, after lock_sleepers
+ *
+ *  @return void
+ **/
+void unlock_sleepers()
+{
+    scheduler_mutex_unlock(&sleep_mutex);
+}
+
+/** @brief Wake a thread waiting for an interrupt once a timeout passes
+ *
+ *  Must be called with the scheduler lock and the thread's interrupt lock
+ *  held, after the thread has set its waiting flag
+ *
+ *  @param tcb The tcb of the current thread
+ *  @param ticks The number of ticks to wait for
+ *  @return void
+ **/
+void add_timeout(tcb_t* tcb, int ticks)
+{
+    uint32_t until = get_ticks() + ticks;
+    spin_lock(&sleep_lock);
     tcb->wake_tick = until;
-    if(until < iter->wake_tick){
-        Q_INSERT_BEFORE(&sleep_list, iter, tcb, sleeping_threads);
-    } else {
-        Q_INSERT_AFTER(&sleep_list, iter, tcb, sleeping_threads);
+    heap_push(tcb);
+    spin_unlock(&sleep_lock);
+    set_timer_deadline(until);
+}
+
+/** @brief Take a thread woken by an interrupt out of the sleeping threads
+ *
+ *  Must be called by the thread which cleared the waiting flag
+ *
+ *  @param tcb The thread which was woken
+ *  @return void
+ **/
+void cancel_timeout(tcb_t* tcb)
+{
+    spin_lock(&sleep_lock);
+    if (tcb->sleep_index >= 0) {
+        heap_remove(tcb->sleep_index);
     }
-    deschedule_and_drop(tcb, &sleep_mutex, T_SLEEPING);
-    return 1;
+    spin_unlock(&sleep_lock);
 }
 
-/** @brief Schedule the sleeping thread at the start of the sleeping list
- *         if it is time for it to wake up
+/** @brief Schedule every sleeping thread which should have woken by now
  *
- *  Note: Should be called from the scheduler with interrupts disabled
+ *  Note: Should be called from the scheduler with the scheduler lock held
  *
  *  @param current The current number of ticks
  *  @return void
  **/
 void schedule_sleepers(uint32_t current)
 {
-    // if we only examine the list, we don't need the lock
-    tcb_t *head = Q_GET_FRONT(&sleep_list);
-    if(head == NULL){
-        return;
-    }
-    if(head->wake_tick <= current && head->state == T_SLEEPING){
-        schedule_interrupts_disabled(head, T_SLEEPING);
+    spin_lock(&sleep_lock);
+    while (sleepers.size > 0 &&
+            (int32_t)(sleepers.heap[0]->wake_tick - current) <= 0) {
+        tcb_t* tcb = heap_remove(0);
+        if (tcb->state == T_SLEEPING) {
+            schedule_locked(tcb, T_SLEEPING);
+        } else if (atomic_xchg(&tcb->waiting, 0)) {
+            // the timeout beat any interrupt to the waiting thread
+            schedule_locked(tcb, T_KERN_SUSPENDED);
+        }
     }
+    spin_unlock(&sleep_lock);
 }
 
-/** @brief After a sleeping thread has awoken it must remove itsself from the
- *         sleeping list with this call
+/** @brief Gets the tick the next sleeper should wake at
  *
- *  @param sleeper The thread which woke up
- *  @return void
+ *  Must be called with interrupts disabled
+ *
+ *  @param tick Where to store the tick
+ *  @return True if there is a sleeper
  **/
-void release_sleeper(tcb_t *sleeper)
+int next_wake_tick(uint32_t* tick)
 {
-    mutex_lock(&sleep_mutex);
-    disable_interrupts();
-    Q_REMOVE(&sleep_list, sleeper, sleeping_threads);
-    enable_interrupts();
-    mutex_unlock(&sleep_mutex);
+    spin_lock(&sleep_lock);
+    int sleeping = sleepers.size > 0;
+    if (sleeping) {
+        *tick = sleepers.heap[0]->wake_tick;
+    }
+    spin_unlock(&sleep_lock);
+    return sleeping;
 }
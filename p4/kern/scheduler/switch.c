@@ -13,6 +13,8 @@
 #include <scheduler.h>
 #include <asm.h>
 #include <stack_info.h>
+#include <cpu.h>
+#include <assert.h>
 #include "scheduler_internal.h"
 #include "interrupt.h"
 
@@ -42,17 +44,90 @@ void store_esp(void* saved_esp, tcb_t* tcb)
     tcb->saved_esp = saved_esp;
 }
 
+/** @brief Complete a context switch on the new thread's stack
+ *
+ *  If the previous thread was woken before it got off of this processor,
+ *  an idle processor may have passed over it, and is told to look again.
+ *
+ *  @return void
+ **/
+static void finish_switch()
+{
+    cpu_t* cpu = get_cpu();
+    tcb_t* prev = cpu->prev;
+    // once it is off of the processor the previous thread may be freed
+    int queued = is_runnable(prev);
+    int last = prev->cpu;
+    prev->on_cpu = 0;
+    if (queued && last != cpu->id) {
+        kick_idle(last);
+    }
+    unlock();
+}
+
 /** @brief Context switch from one thread to another
+ *
+ *  Must be called with the scheduler lock held. The lock is released by the
+ *  thread being switched to. Since the from thread may already be in
+ *  another processor's queue, it stays marked as on a processor until it is
+ *  off of its stack, and the scheduler never picks such a thread to run.
  *
  *  @param from The thread to switch from
- *  @param to The thread to switch to
+ *  @param to The thread to switch to, which must be off of every processor
  *  @return void
  **/
 void context_switch(tcb_t* from, tcb_t* to)
 {
+    cpu_t* cpu = get_cpu();
+    assert(!to->on_cpu);
+    to->on_cpu = 1;
+    cpu->current = to;
+    cpu->prev = from;
     switch_ppd(to->process->directory);
     switch_stack_and_regs(to->saved_esp, from);
-    enable_interrupts();
+    finish_switch();
+}
+
+/** @brief The first function a new thread runs after a context switch
+ *
+ *  @param saved_esp The user state to restore
+ *  @return Does not return
+ **/
+static void first_switch(void* saved_esp)
+{
+    finish_switch();
+    go_to_user_mode(saved_esp);
+}
+
+/** @brief The first function a new kernel thread runs after a context switch
+ *
+ *  @param func The body of the thread
+ *  @return Does not return
+ **/
+static void first_kernel_switch(void (*func)())
+{
+    finish_switch();
+    func();
+    panic("Kernel thread returned");
+}
+
+/** @brief Sets up a given thread stack to run a function in the kernel
+ *         when it is first switched to
+ *
+ *  The thread's stack must be empty, and its function must never return.
+ *
+ *  @param tcb Thread whose stack is to be set up for context switch entry
+ *  @param func The function the thread runs
+ *  @return void
+ **/
+void setup_kernel_thread(tcb_t* tcb, void (*func)())
+{
+    tcb->saved_esp = tcb->kernel_stack;
+    context_stack_t context_stack = {
+        .func_addr = first_kernel_switch,
+        .saved_esp = (void*)func,
+    };
+    PUSH_STACK(tcb->saved_esp, context_stack, context_stack_t);
 }
 
 /** @brief Sets up a given thread stack for entry via context switch
@@ -64,7 +139,7 @@ void setup_for_switch(tcb_t* tcb)
 {
     void* saved_esp = tcb->saved_esp;
     context_stack_t context_stack = {
-        .func_addr = go_to_user_mode,
+        .func_addr = first_switch,
         .saved_esp = saved_esp,
     };
     PUSH_STACK(tcb->saved_esp, context_stack, context_stack_t);
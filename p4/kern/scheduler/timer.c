@@ -2,7 +2,20 @@
  *
  *  @brief Handler for the timer interrupts.
  *
- *  The timer interrupt handler simply increments a count of timer ticks.
+ *  The PIT runs in one shot mode and is only programmed for the next event
+ *  the boot processor cares about: the end of the current quantum if it has
+ *  threads to run, or the next sleeper deadline if it is idle. The time since
+ *  boot is kept by adding up the PIT clocks which have elapsed each time it
+ *  is reprogrammed, and reading the PIT counter in between, so ticks stay
+ *  monotonic no matter how rarely the timer fires. A tick is a millisecond,
+ *  but user programs see ticks of 10 ms, as they always have.
+ *
+ *  The PIT only interrupts the boot processor, so every other processor
+ *  uses its local APIC timer, calibrated against the PIT, for preemption.
+ *  An idle boot processor whose next deadline is further away than the PIT
+ *  can count stops the PIT and sleeps on its own local APIC timer in one
+ *  shot mode instead. The time stamp counter, calibrated at the same time,
+ *  measures the time which passes while the PIT is stopped.
  *
  *  @author Evan Palmer (esp)
  *  @bug No known bugs
@@ -14,30 +27,314 @@
 #include <interrupt_defines.h>
 #include <timer_defines.h>
 #include <simics.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <eflags.h>
+#include <smp/apic.h>
+#include <limits.h>
+#include "scheduler_internal.h"
+
+/** @brief The number of ticks in a second */
+#define TICK_FREQUENCY 1000
+/** @brief The number of ticks user programs see in a second */
+#define USER_TICK_FREQUENCY 100
+/** @brief The number of ticks in a tick seen by user programs */
+#define TICKS_PER_USER_TICK (TICK_FREQUENCY / USER_TICK_FREQUENCY)
+/** @brief The number of PIT clocks in a tick */
+#define CLOCKS_PER_TICK (TIMER_RATE / TICK_FREQUENCY)
+/** @brief The frequency with which running threads are preempted */
+#define QUANTUM_FREQUENCY 100
+/** @brief The number of ticks in a quantum */
+#define QUANTUM_TICKS (TICK_FREQUENCY / QUANTUM_FREQUENCY)
+/** @brief The longest one shot count, short enough that a count which has
+ *         wrapped past zero can be told apart from one which has not
+ **/
+#define MAX_ONE_SHOT 0x8000
+/** @brief The longest an idle boot processor can wait on the PIT */
+#define IDLE_TICKS (MAX_ONE_SHOT / CLOCKS_PER_TICK)
+/** @brief The longest an idle boot processor sleeps on its local APIC timer */
+#define LONGEST_IDLE_TICKS (60 * TICK_FREQUENCY)
+/** @brief Command which latches the PIT channel 0 count */
+#define PIT_LATCH_CHANNEL0 0x00
+
+/** @brief The io port of the PIT channel used for calibration */
+#define PIT_CHANNEL2_PORT 0x42
+/** @brief The io port which gates PIT channel 2 */
+#define PIT_GATE_PORT 0x61
+/** @brief Mode for a one shot count on PIT channel 2 */
+#define PIT_CHANNEL2_ONE_SHOT 0xB0
+/** @brief Bit which enables counting on PIT channel 2 */
+#define PIT_GATE 0x01
+/** @brief Bit which connects PIT channel 2 to the speaker */
+#define PIT_SPEAKER 0x02
+/** @brief Bit which is set when PIT channel 2 has finished counting */
+#define PIT_OUT2 0x20
+
+/** @brief State of the PIT and the time since boot
+ *
+ *  The time since boot when the PIT was last programmed is ticks plus
+ *  clocks PIT clocks, where clocks is less than a tick. While the boot
+ *  processor is sleeping the PIT is stopped, tsc is the time stamp counter
+ *  when it stopped, and deadline is when the local APIC timer fires.
+ **/
+static struct {
+    spinlock_t lock;
+    uint64_t ticks;
+    uint32_t clocks;
+    uint16_t count;
+    int sleeping;
+    uint32_t deadline;
+    uint64_t tsc;
+} timer;
+
+/** @brief The local APIC timer count for one quantum */
+static uint32_t lapic_timer_count;
+/** @brief The number of time stamp counter cycles in one quantum */
+static uint64_t tsc_quantum;
+/** @brief The longest an idle boot processor goes without a timer interrupt */
+static uint32_t idle_ticks = IDLE_TICKS;
+
+/** @brief Read the number of PIT clocks since the PIT was last programmed
+ *
+ *  Must be called with the timer lock held. If the PIT is stopped, this is
+ *  the time since it stopped.
+ *
+ *  @return The number of clocks
+ **/
+static uint32_t elapsed_clocks()
+{
+    if (timer.sleeping) {
+        uint64_t cycles = rdtsc() - timer.tsc;
+        return cycles * (TIMER_RATE / QUANTUM_FREQUENCY) / tsc_quantum;
+    }
+    outb(TIMER_MODE_IO_PORT, PIT_LATCH_CHANNEL0);
+    uint16_t current = inb(TIMER_PERIOD_IO_PORT);
+    current |= inb(TIMER_PERIOD_IO_PORT) << 8;
+    if (current <= timer.count) {
+        return timer.count - current;
+    }
+    // the count has passed zero and wrapped around
+    return timer.count + (0x10000 - current);
+}
+
+/** @brief Add the time which has passed under the old count to the time
+ *         since boot
+ *
+ *  Must be called with the timer lock held
+ *
+ *  @return void
+ **/
+static void account_clocks()
+{
+    timer.clocks += elapsed_clocks();
+    timer.ticks += timer.clocks / CLOCKS_PER_TICK;
+    timer.clocks %= CLOCKS_PER_TICK;
+}
+
+/** @brief Start a one shot count on the PIT
+ *
+ *  Must be called with the timer lock held, and on the boot processor if
+ *  it is sleeping, since only it can stop its local APIC timer.
+ *
+ *  @param count The number of clocks until the PIT should fire
+ *  @return void
+ **/
+static void program_pit(uint16_t count)
+{
+    account_clocks();
+    if (timer.sleeping) {
+        lapic_write(LAPIC_TIMER_INIT, 0);
+        timer.sleeping = 0;
+    }
+    timer.count = count;
+    outb(TIMER_MODE_IO_PORT, TIMER_ONE_SHOT);
+    outb(TIMER_PERIOD_IO_PORT, (uint8_t)count);
+    outb(TIMER_PERIOD_IO_PORT, (uint8_t)(count >> 8));
+}
+
+/** @brief Gets the number of PIT clocks from now until a tick
+ *
+ *  Must be called with the timer lock held
+ *
+ *  @param tick The tick to count to
+ *  @return The number of clocks, between 1 and MAX_ONE_SHOT
+ **/
+static uint16_t clocks_until(uint32_t tick)
+{
+    uint32_t now = timer.clocks + elapsed_clocks();
+    uint32_t now_ticks = timer.ticks + now / CLOCKS_PER_TICK;
+    if ((int32_t)(tick - now_ticks) <= 0) {
+        return 1;
+    }
+    if (tick - now_ticks > MAX_ONE_SHOT / CLOCKS_PER_TICK) {
+        return MAX_ONE_SHOT;
+    }
+    return (tick - now_ticks) * CLOCKS_PER_TICK - now % CLOCKS_PER_TICK;
+}
 
-/** @brief The frequency with which timer interrupts should occur */
-#define TIMER_INTERRUPT_FREQUENCY 100
+/** @brief Stop the PIT and sleep on the local APIC timer until a tick
+ *
+ *  Must be called with the timer lock held, on the boot processor. Writing
+ *  the PIT mode without a count stops channel 0 until it is programmed
+ *  again. If it fires anyway, the boot processor just goes back to sleep.
+ *
+ *  @param deadline The tick to wake at, at most idle_ticks from now
+ *  @return void
+ **/
+static void sleep_timer(uint32_t deadline)
+{
+    account_clocks();
+    outb(TIMER_MODE_IO_PORT, TIMER_ONE_SHOT);
+    timer.tsc = rdtsc();
+    timer.sleeping = 1;
+    timer.deadline = deadline;
+    uint32_t ticks = deadline - (uint32_t)timer.ticks;
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_X16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_IDT_ENTRY);
+    lapic_write(LAPIC_TIMER_INIT, ticks * (lapic_timer_count / QUANTUM_TICKS));
+}
 
-/** @brief The number of ticks which have occured so far */
-static unsigned int ticks_so_far;
+/** @brief Do background work if this processor has nothing else to do
+ *
+ *  Called at the end of a timer interrupt with interrupts enabled. The idle
+ *  thread can still be preempted while it works.
+ *
+ *  @return void
+ **/
+static void idle_work()
+{
+    if (is_idle(get_tcb())) {
+        reap_exited();
+        refill_zero_pool();
+    }
+}
 
 /** @brief Setup the timer interrupt handler
  *
- *  Instruct the timer to fire at TIMER_INTERRUPT_FREQUENCY, and then pack
- *  the timer interrupt idt entry. Note that the offset used is for the
- *  assembly wrapper
+ *  Starts the PIT counting down the first quantum
  *
  *  @return void
  *  */
 void init_timer()
 {
-    uint16_t frequency = 1 + (TIMER_RATE / TIMER_INTERRUPT_FREQUENCY);
-    outb(TIMER_MODE_IO_PORT, TIMER_SQUARE_WAVE);
-    outb(TIMER_PERIOD_IO_PORT, (uint8_t)frequency);
-    outb(TIMER_PERIOD_IO_PORT, (uint8_t)(frequency >> 8));
+    spinlock_init(&timer.lock);
+    timer.ticks = 0;
+    timer.clocks = 0;
+    timer.count = QUANTUM_TICKS * CLOCKS_PER_TICK;
+    outb(TIMER_MODE_IO_PORT, TIMER_ONE_SHOT);
+    outb(TIMER_PERIOD_IO_PORT, (uint8_t)timer.count);
+    outb(TIMER_PERIOD_IO_PORT, (uint8_t)(timer.count >> 8));
+}
+
+/** @brief Gets the number of ticks since system start without wrapping
+ *
+ *  @return The number of ticks
+ **/
+static uint64_t read_ticks()
+{
+    uint32_t eflags = get_eflags();
+    disable_interrupts();
+    spin_lock(&timer.lock);
+    uint64_t ticks = timer.ticks +
+                     (timer.clocks + elapsed_clocks()) / CLOCKS_PER_TICK;
+    spin_unlock(&timer.lock);
+    set_eflags(eflags);
+    return ticks;
+}
+
+/** @brief Gets the number of ticks since system start
+ *
+ *  @return The number of ticks
+ **/
+uint32_t get_ticks()
+{
+    return read_ticks();
 }
 
-/** @brief Handler a timer interrupt, accumulate ticks
+/** @brief Gets the number of ticks user programs have seen since system start
+ *
+ *  @return The number of user ticks
+ **/
+uint32_t get_user_ticks()
+{
+    return read_ticks() / TICKS_PER_USER_TICK;
+}
+
+/** @brief Convert a number of user ticks to ticks
+ *
+ *  @param user_ticks The number of user ticks, which is returned unchanged
+ *         if it is negative
+ *  @return The number of ticks, capped at the longest a thread can wait
+ **/
+int user_ticks_to_ticks(int user_ticks)
+{
+    if (user_ticks > INT_MAX / TICKS_PER_USER_TICK) {
+        return INT_MAX;
+    }
+    if (user_ticks < 0) {
+        return user_ticks;
+    }
+    return user_ticks * TICKS_PER_USER_TICK;
+}
+
+/** @brief Make sure the timer fires no later than a given tick
+ *
+ *  Must be called with interrupts disabled
+ *
+ *  @param tick The tick the timer must fire by
+ *  @return void
+ **/
+void set_timer_deadline(uint32_t tick)
+{
+    spin_lock(&timer.lock);
+    if (timer.sleeping) {
+        // only the boot processor can bring its local APIC timer forward
+        if ((int32_t)(tick - timer.deadline) >= 0) {
+            spin_unlock(&timer.lock);
+            return;
+        }
+        if (get_cpu()->id == TIMER_CPU) {
+            program_pit(clocks_until(tick));
+        } else {
+            apic_ipi_cpu(TIMER_CPU, RESCHEDULE_IDT_ENTRY);
+        }
+        spin_unlock(&timer.lock);
+        return;
+    }
+    uint16_t count = clocks_until(tick);
+    int32_t remaining = timer.count - (int32_t)elapsed_clocks();
+    // if the timer has already fired its interrupt is still pending
+    if (remaining > 0 && count < remaining) {
+        program_pit(count);
+    }
+    spin_unlock(&timer.lock);
+}
+
+/** @brief Program the timer for the next event after a timer interrupt
+ *
+ *  Must be called with interrupts disabled
+ *
+ *  @param ticks The current number of ticks
+ *  @param busy Whether the boot processor has threads to preempt
+ *  @return void
+ **/
+void rearm_timer(uint32_t ticks, int busy)
+{
+    uint32_t wake_tick;
+    uint32_t deadline = ticks + (busy ? QUANTUM_TICKS : idle_ticks);
+    if (next_wake_tick(&wake_tick) && (int32_t)(wake_tick - deadline) < 0) {
+        deadline = wake_tick;
+    }
+    spin_lock(&timer.lock);
+    if (!busy && (int32_t)(deadline - ticks) > IDLE_TICKS) {
+        sleep_timer(deadline);
+    } else {
+        program_pit(clocks_until(deadline));
+    }
+    spin_unlock(&timer.lock);
+}
+
+/** @brief Handler a timer interrupt, wake sleepers and preempt
  *
  *  This is the function which is called by the timer assembly wrapper
  *
@@ -45,8 +342,83 @@ void init_timer()
  *  */
 void timer_interrupt()
 {
-    ticks_so_far++;
-    disable_interrupts();
+    lock();
     outb(INT_CTL_PORT, INT_ACK_CURRENT);
-    run_scheduler(ticks_so_far);
+    run_scheduler(get_ticks());
+    idle_work();
+}
+
+/** @brief Measure how fast the local APIC timer counts
+ *
+ *  Counts down the local APIC timer of the boot processor for one quantum
+ *  as measured by PIT channel 2, and counts the time stamp counter cycles
+ *  in the same quantum.
+ *
+ *  @return void
+ *  */
+void init_lapic_timer()
+{
+    uint16_t period = TIMER_RATE / QUANTUM_FREQUENCY;
+    uint8_t gate = inb(PIT_GATE_PORT) & ~(PIT_GATE | PIT_SPEAKER);
+    outb(PIT_GATE_PORT, gate);
+    outb(TIMER_MODE_IO_PORT, PIT_CHANNEL2_ONE_SHOT);
+    outb(PIT_CHANNEL2_PORT, (uint8_t)period);
+    outb(PIT_CHANNEL2_PORT, (uint8_t)(period >> 8));
+    // start both counters as close together as we can
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_X16);
+    outb(PIT_GATE_PORT, gate | PIT_GATE);
+    lapic_write(LAPIC_TIMER_INIT, ~0);
+    uint64_t tsc = rdtsc();
+    while (!(inb(PIT_GATE_PORT) & PIT_OUT2)) {
+        continue;
+    }
+    lapic_timer_count = ~0 - lapic_read(LAPIC_TIMER_CUR);
+    tsc_quantum = rdtsc() - tsc;
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    outb(PIT_GATE_PORT, gate);
+    // the boot processor can now sleep for as long as its timer can count
+    idle_ticks = ~0 / (lapic_timer_count / QUANTUM_TICKS);
+    if (idle_ticks > LONGEST_IDLE_TICKS) {
+        idle_ticks = LONGEST_IDLE_TICKS;
+    }
+}
+
+/** @brief Start the local APIC timer of this processor
+ *
+ *  @return void
+ *  */
+void start_lapic_timer()
+{
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_X16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_IDT_ENTRY | LAPIC_PERIODIC);
+    lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+}
+
+/** @brief Handle a local APIC timer interrupt, preempt the current thread
+ *
+ *  The boot processor only uses its local APIC timer to wake from sleep, so
+ *  it handles the interrupt as it would the PIT's.
+ *
+ *  @return void
+ *  */
+void lapic_timer_interrupt()
+{
+    lock();
+    apic_eoi();
+    if (get_cpu()->id == TIMER_CPU) {
+        run_scheduler(get_ticks());
+    } else {
+        preempt();
+    }
+    idle_work();
+}
+
+/** @brief Handle a spurious local APIC interrupt
+ *
+ *  Spurious interrupts must not be acknowledged
+ *
+ *  @return void
+ *  */
+void spurious_interrupt()
+{
 }
@@ -0,0 +1,162 @@
+/** @file cpu.c
+ *
+ *  @brief Per processor state and application processor startup
+ *
+ *  The boot processor is always cpu zero. If the machine has more than one
+ *  processor the local APIC is mapped and the application processors are
+ *  started in ap_main, where each one loads its own GDT and TSS and then
+ *  runs its idle thread until the scheduler finds work for it.
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs.
+ **/
+
+#include <cpu.h>
+#include <smp/smp.h>
+#include <smp/mptable.h>
+#include <smp/apic.h>
+#include <string.h>
+#include <assert.h>
+#include <asm.h>
+#include <seg.h>
+#include <vm.h>
+#include <control_block.h>
+#include <interrupt.h>
+#include <syscall_kern.h>
+
+extern uint64_t init_gdt[GDT_SEGS];
+extern char init_tss;
+extern const size_t init_tss_size;
+
+/** @brief State of every processor in the system */
+static struct {
+    int enabled;
+    int num_cpus;
+    cpu_t cpus[MAX_CPUS];
+} smp = { 0 };
+
+/** @brief Find the processors in the system and map the local APIC
+ *
+ *  Must be called after virtual memory has been initialized. Machines
+ *  without an MP table are run on the boot processor alone.
+ *
+ *  @param mbinfo The multiboot information passed to the kernel
+ *  @return void
+ **/
+void init_smp(mbinfo_t* mbinfo)
+{
+    int i;
+    smp.num_cpus = 1;
+    if (smp_init(mbinfo) == 0 && smp_num_cpus() > 1) {
+        smp.enabled = 1;
+        smp.num_cpus = smp_num_cpus();
+        map_lapic(smp_lapic_base());
+        apic_init();
+    }
+    for (i = 0; i < smp.num_cpus; i++) {
+        smp.cpus[i].id = i;
+    }
+}
+
+/** @brief Access byte of an available 32 bit TSS descriptor */
+#define TSS_DESC_ACCESS 0x89
+
+/** @brief Create a GDT descriptor for a task state segment
+ *
+ *  @param tss The task state segment
+ *  @param tss_size The size of the task state segment
+ *  @return The descriptor
+ **/
+uint64_t tss_desc_create(void* tss, size_t tss_size)
+{
+    uint64_t base = (uint32_t)tss;
+    uint64_t limit = tss_size - 1;
+    return (limit & 0xFFFF) | ((base & 0xFFFFFF) << 16) |
+           ((uint64_t)TSS_DESC_ACCESS << 40) | ((limit & 0xF0000) << 32) |
+           ((base & 0xFF000000) << 32);
+}
+
+/** @brief Give this processor its own GDT and TSS
+ *
+ *  The stack squidboy built them on is discarded once the idle thread runs
+ *
+ *  @param cpu The processor to load the segments for
+ *  @return void
+ **/
+static void load_segments(cpu_t* cpu)
+{
+    assert(init_tss_size <= CPU_TSS_SIZE);
+    memcpy(cpu->tss, &init_tss, init_tss_size);
+    memcpy(cpu->gdt, init_gdt, sizeof(cpu->gdt));
+    cpu->gdt[SEGSEL_KERNEL_TSS_IDX] = tss_desc_create(cpu->tss, init_tss_size);
+    lgdt(cpu->gdt, sizeof(cpu->gdt) - 1);
+    ltr(SEGSEL_TSS);
+}
+
+/** @brief Entry point of the application processors
+ *
+ *  @param id The number of this processor
+ *  @return Does not return
+ **/
+static void ap_main(int id)
+{
+    cpu_t* cpu = &smp.cpus[id];
+    enable_paging();
+    load_segments(cpu);
+    tcb_t* idle = cpu->idle;
+    cpu->current = idle;
+    idle->on_cpu = 1;
+    switch_ppd(idle->process->directory);
+    start_lapic_timer();
+    // interrupts are enabled on the way to user mode
+    go_to_user_mode(idle->saved_esp);
+}
+
+/** @brief Start the application processors
+ *
+ *  Every processor must have an idle thread before this is called
+ *
+ *  @return void
+ **/
+void boot_aps()
+{
+    if (smp.enabled) {
+        init_lapic_timer();
+        smp_boot(ap_main);
+    }
+}
+
+/** @brief Gets the number of processors the kernel is using
+ *
+ *  @return The number of processors
+ **/
+int num_cpus()
+{
+    return smp.num_cpus;
+}
+
+/** @brief Gets the state of the processor this code is running on
+ *
+ *  The result is only meaningful while interrupts are disabled
+ *
+ *  @return The current processor
+ **/
+cpu_t* get_cpu()
+{
+    if (!smp.enabled) {
+        return &smp.cpus[0];
+    }
+    return &smp.cpus[smp_get_cpu()];
+}
+
+/** @brief Gets the state of a processor given its number
+ *
+ *  @param id The number of the processor
+ *  @return The processor
+ **/
+cpu_t* get_cpu_by_id(int id)
+{
+    assert(id >= 0 && id < smp.num_cpus);
+    return &smp.cpus[id];
+}
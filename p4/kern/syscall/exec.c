@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <exec2obj.h>
 #include <elf_410.h>
+#include <exec_index.h>
 #include <debug_print.h>
 #include <cr.h>
 #include <switch.h>
@@ -23,6 +24,8 @@
 #include <stdlib.h>
 #include <mutex.h>
 #include <asm.h>
+#include <scheduler.h>
+#include <user_drivers.h>
 
 /** @brief Address of the top of a kernel stack */
 #define STACK_HIGH 0xFFFFFFF0
@@ -37,6 +40,8 @@
 
 static int user_exec(tcb_t* tcb, int flen, char* fname,
                      int argc, char** argv, int arglen);
+static int user_spawn(tcb_t* tcb, int flen, char* fname, int argc,
+                      char** argv, int arglen, int mailbox);
 
 /** @brief Get the length of all strings in the argv array
  *
@@ -62,6 +67,32 @@ int get_argv_length(ppd_t* ppd, int argc, char** argv)
     return total_length;
 }
 
+/** @brief Check the program name and arguments passed to exec or spawn
+ *
+ *  @param dir The page directory of the current process
+ *  @param fname The name of the program
+ *  @param argv The array of arguments
+ *  @param flen Where to store the length of the name including its end
+ *  @param argc Where to store the number of entries in argv
+ *  @param argvlen Where to store the combined length of argv
+ *  @return Zero on success, less than zero if an argument is invalid
+ **/
+static int check_exec_args(ppd_t* dir, char* fname, char** argv,
+                           int* flen, int* argc, int* argvlen)
+{
+    *flen = vm_user_strlen(dir, fname, EXEC_MAX_BYTES) + 1;
+    if (*flen <= 0) {
+        return -1;
+    }
+    if ((*argc = vm_user_arrlen(dir, argv, EXEC_MAX_BYTES)) < 0) {
+        return -1;
+    }
+    if ((*argvlen = get_argv_length(dir, *argc, argv)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
 /** @brief A hander for the exec system call
  *
  *  @param state the state of userspace when exec was called
@@ -84,22 +115,43 @@ void exec_syscall(ureg_t state)
         state.eax = -1;
         return;
     }
-    int argc, argvlen;
-    int flen = vm_user_strlen(dir, packet.fname, EXEC_MAX_BYTES) + 1;
-    if (flen <= 0) {
+    int flen, argc, argvlen;
+    if (check_exec_args(dir, packet.fname, packet.argv,
+                        &flen, &argc, &argvlen) < 0) {
         state.eax = -1;
         return;
     }
-    if ((argc = vm_user_arrlen(dir, packet.argv, EXEC_MAX_BYTES)) < 0) {
+    state.eax = user_exec(tcb, flen, packet.fname, argc, packet.argv, argvlen);
+    return;
+}
+
+/** @brief A hander for the spawn system call
+ *
+ *  @param state the state of userspace when spawn was called
+ *  @return void
+ **/
+void spawn_syscall(ureg_t state)
+{
+    struct {
+        char* fname;
+        char** argv;
+        int mailbox;
+    } packet;
+
+    tcb_t* tcb = get_tcb();
+    ppd_t* dir = tcb->process->directory;
+    if (vm_read(dir, &packet, (void*)state.esi, sizeof(packet)) < 0) {
         state.eax = -1;
         return;
     }
-    if ((argvlen = get_argv_length(dir, argc, packet.argv)) < 0) {
+    int flen, argc, argvlen;
+    if (check_exec_args(dir, packet.fname, packet.argv,
+                        &flen, &argc, &argvlen) < 0) {
         state.eax = -1;
         return;
     }
-    state.eax = user_exec(tcb, flen, packet.fname, argc, packet.argv, argvlen);
-    return;
+    state.eax = user_spawn(tcb, flen, packet.fname, argc, packet.argv,
+                           argvlen, packet.mailbox);
 }
 
 /** @brief Crafts the kernel stack for the initial program
@@ -141,25 +193,20 @@ void* create_context(uint32_t stack, uint32_t user_esp, uint32_t user_eip)
  */
 int getbytes(const char* filename, int offset, int size, char* buf)
 {
-    int i, byte_index;
-    for (i = 0; i < exec2obj_userapp_count; i++) {
-        if (strcmp(filename, exec2obj_userapp_TOC[i].execname) == 0)
-            break;
-    }
+    const exec_entry_t* entry = find_exec(filename);
     // No program matching the given filename found
-    if (i == exec2obj_userapp_count) {
+    if (entry == NULL || offset < 0 || size < 0) {
         return -1;
     }
-    int filelen = exec2obj_userapp_TOC[i].execlen;
     // if not enough bytes, copy over as many as possible
-    if (offset + size > filelen) {
-        size = filelen - offset;
+    if (offset >= entry->len) {
+        return 0;
     }
-    // Copy bytes over to buffer
-    for (byte_index = 0; byte_index < size; byte_index++) {
-        buf[byte_index] = exec2obj_userapp_TOC[i].execbytes[offset + byte_index];
+    if (size > entry->len - offset) {
+        size = entry->len - offset;
     }
-    return byte_index;
+    memcpy(buf, entry->bytes + offset, size);
+    return size;
 }
 
 /** @brief Finds the min of an array of unsigned integers
@@ -200,12 +247,11 @@ uint32_t max(uint32_t array[], int len)
 
 /** @brief load a process image into a page directory
  *
- *  This function does the best it can in a number of situations. Notably
- *  the sections .text and .rodata will be allocated as readonly only if they
- *  are not on the same page as data which needs to be allocated read/write
- *
- *  Similarly, .bss will be allocated as zfod only if it does not share a page
- *  with data which needs to be written
+ *  The sections are not copied. Their pages are mapped from the program
+ *  cache, read only for .text and .rodata and copy on write for .data, and
+ *  the rest of .bss is zfod. Notably the sections .text and .rodata will be
+ *  mapped readonly only if they are not on the same page as data which needs
+ *  to be written
  *
  *  @param elf Struct containing elf file information
  *  @param dir Page directory to fill out
@@ -221,40 +267,12 @@ int create_proc_pagedir(simple_elf_t* elf, ppd_t* dir)
                          elf->e_bssstart + elf->e_bsslen };
     uint32_t min_start = min(starts, 4);
     uint32_t max_end = max(ends, 4);
-    //all pages should be writeable so we can write to them even
+    // the whole program starts out zfod, .bss stays that way
     if (vm_alloc_readwrite(dir, (void*)min_start, max_end - min_start) < 0) {
         return -1;
     }
-    //back the sections we will write to, leave the rest for zfod if possible
-    if (vm_back(dir, elf->e_txtstart, elf->e_txtlen) < 0) {
-        DPRINTF("text backing failed");
-        return -1;
-    }
-    if (vm_back(dir, elf->e_datstart, elf->e_datlen) < 0) {
-        DPRINTF("dat backing failed");
-        return -1;
-    }
-    if (vm_back(dir, elf->e_rodatstart, elf->e_rodatlen) < 0) {
-        DPRINTF("rodat backing failed");
-        return -1;
-    }
-    getbytes(elf->e_fname, elf->e_txtoff,
-             elf->e_txtlen, (char*)elf->e_txtstart);
-    getbytes(elf->e_fname, elf->e_rodatoff,
-             elf->e_rodatlen, (char*)elf->e_rodatstart);
-    getbytes(elf->e_fname, elf->e_datoff,
-             elf->e_datlen, (char*)elf->e_datstart);
-    // set everything to readonly
-    if (vm_set_readonly(dir, (void*)min_start, max_end - min_start) < 0) {
-        return -1;
-    }
-    // set pages which need to be writeable to read/write this means that
-    // if a readonly and write section are on the same page, both will be
-    // writeable, so at least the program still runs
-    if (vm_set_readwrite(dir, (void*)elf->e_datstart, elf->e_datlen) < 0) {
-        return -1;
-    }
-    if (vm_set_readwrite(dir, (void*)elf->e_bssstart, elf->e_bsslen) < 0) {
+    if (vm_map_program(dir, elf, (void*)min_start, max_end - min_start) < 0) {
+        DPRINTF("mapping %s from the program cache failed", elf->e_fname);
         return -1;
     }
     return 0;
@@ -276,44 +294,49 @@ int strcpy_len(char* dest, char* source)
 
 /** @brief Sets up the argv array above the beginning of the user stack space
  *
+ *  The stack is written at top, which is where STACK_HIGH is in the memory
+ *  being written, so it can be built in a kernel buffer. The pointers
+ *  written are user addresses.
+ *
+ *  @param top Where STACK_HIGH is in the memory being written
  *  @param argc The number of strings in argv
  *  @param argv An array of strings passed to main of the new program
  *  @param argvlen The number of characters in argv
- *  @return Pointer to the top of the new stack
+ *  @return The user address of the top of the new stack
  **/
-uint32_t setup_argv(int argc, char** argv, int argvlen)
+uint32_t setup_argv(char* top, int argc, char** argv, int argvlen)
 {
     int i;
-    char* strings_start = (char*)(STACK_HIGH - argvlen);
-    char* current_string = strings_start;
-    char** pointers_start = ((char**)strings_start) - argc;
+    uint32_t current_string = STACK_HIGH - argvlen;
+    char** pointers_start = ((char**)(top - argvlen)) - argc;
     for (i = 0; i < argc; i++) {
-        pointers_start[i] = current_string;
-        int copied = strcpy_len(current_string, argv[i]);
+        pointers_start[i] = (char*)current_string;
+        int copied = strcpy_len(top - (STACK_HIGH - current_string), argv[i]);
         current_string += copied;
     }
-    return (uint32_t)pointers_start;
+    return STACK_HIGH - argvlen - argc * sizeof(char*);
 }
 
 /** @brief Sets up the stack for the new process
  *
+ *  @param top Where STACK_HIGH is in the memory being written
  *  @param argc The number of strings in argv
  *  @param argv An array of strings passed to main of the new program
  *  @param argvlen The number of characters in argv
  *  @param stack_low The lowest address of the user stack
- *  @return Pointer to esp for the new stack
+ *  @return The user address of esp for the new stack
  **/
-uint32_t setup_main_stack(int argc, char** argv,
+uint32_t setup_main_stack(char* top, int argc, char** argv,
                           int argvlen, uint32_t stack_low)
 {
-    uint32_t argv_start = setup_argv(argc, argv, argvlen);
-    uint32_t* stack_current = (uint32_t*)argv_start;
+    uint32_t argv_start = setup_argv(top, argc, argv, argvlen);
+    uint32_t* stack_current = (uint32_t*)(top - (STACK_HIGH - argv_start));
     PUSH_STACK(stack_current, stack_low, uint32_t);
     PUSH_STACK(stack_current, STACK_HIGH, uint32_t);
     PUSH_STACK(stack_current, argv_start, uint32_t);
     PUSH_STACK(stack_current, argc, uint32_t);
     PUSH_STACK(stack_current, MAGIC_NUMBER, uint32_t);
-    return (uint32_t)(stack_current);
+    return argv_start - NUM_PARAMS_TO_MAIN * sizeof(uint32_t);
 }
 
 /** @brief Calculates the required stack space for a given program
@@ -350,6 +373,8 @@ int allocate_stack(ppd_t* ppd, uint32_t stack_low)
 }
 
 /** @brief Popualte an elf structure with a program
+ *
+ *  The header was parsed when the exec index was built, so it is copied
  *
  *  @param elf The elf structure to populate
  *  @param fname The name of the program to populate the elf with
@@ -357,14 +382,17 @@ int allocate_stack(ppd_t* ppd, uint32_t stack_low)
  **/
 int load_elf(simple_elf_t* elf, char* fname)
 {
-    if (elf_check_header(fname) < 0) {
+    const exec_entry_t* entry = find_exec(fname);
+    if (entry == NULL || !entry->is_elf) {
         return -1;
     }
-    elf_load_helper(elf, fname);
+    *elf = entry->elf;
     return 0;
 }
 
 /** @brief Load a program into a process
+ *
+ *  The directory of the process must be the one which is loaded
  *
  *  @param tcb The tcb of the process to load the program into
  *  @param elf An elf file describing the program to load
@@ -385,13 +413,58 @@ int load_process(tcb_t* tcb, simple_elf_t* elf,
     if (allocate_stack(pcb->directory, stack_low) < 0) {
         return -1;
     }
-    uint32_t stack_entry = setup_main_stack(argc, argv, arglen, stack_low);
+    uint32_t stack_entry = setup_main_stack((char*)STACK_HIGH, argc, argv,
+                                            arglen, stack_low);
     // Craft kernel stack contents
     tcb->saved_esp = create_context(
         (uint32_t)tcb->kernel_stack, stack_entry, elf->e_entry);
     return 0;
 }
 
+/** @brief Load a program into a process whose directory is not loaded
+ *
+ *  The stack is built in a kernel buffer and written to the process
+ *  through the identity mapping, so the current thread never enters the
+ *  process's address space.
+ *
+ *  @param tcb The tcb of the process to load the program into
+ *  @param elf An elf file describing the program to load
+ *  @param argc The number of strings in argv
+ *  @param argv An array of strings passed to main of the new program
+ *  @param arglen The number of characters in argv
+ *  @return Zero on success, less than zero on failure
+ **/
+static int load_unloaded_process(tcb_t* tcb, simple_elf_t* elf,
+                                 int argc, char** argv, int arglen)
+{
+    ppd_t* ppd = tcb->process->directory;
+    if (create_proc_pagedir(elf, ppd) < 0) {
+        return -1;
+    }
+    uint32_t stack_low = STACK_HIGH - stack_space(arglen, argc);
+    stack_low = page_align(stack_low);
+    if (vm_alloc_readwrite(ppd, (void*)stack_low,
+                           STACK_HIGH - stack_low + 1) < 0) {
+        return -1;
+    }
+    uint32_t size = arglen + argc * sizeof(char*) +
+                    NUM_PARAMS_TO_MAIN * sizeof(uint32_t);
+    char* image = malloc(size);
+    if (image == NULL) {
+        return -1;
+    }
+    uint32_t stack_entry = setup_main_stack(image + size, argc, argv, arglen,
+                                            stack_low);
+    int status = vm_write_unloaded(ppd, image, stack_entry, size);
+    free(image);
+    if (status < 0) {
+        return -1;
+    }
+    tcb->saved_esp = create_context(
+        (uint32_t)tcb->kernel_stack, stack_entry, elf->e_entry);
+    return 0;
+}
+
 /** @brief Create a process with a program loaded into it
  *
  *  Note: this call will panic on failure, and should only be used for required
@@ -478,6 +551,12 @@ int replace_process(tcb_t* tcb, void* k_space,
         ppd_t *tmp = pcb->directory;
         replace_pcb_dir(pcb, old_dir);
         free_ppd(tmp, pcb->directory);
+    } else if (pcb->lender != NULL) {
+        // the old directory belongs to the parent, so just give it back
+        sim_reg_process(pcb->directory->dir, k_space);
+        free_ppd(pcb->reserved, pcb->directory);
+        pcb->reserved = NULL;
+        end_borrow(pcb);
     } else {
         // De-register the previously running process in simics
         sim_unreg_process(old_dir->dir);
@@ -488,42 +567,143 @@ int replace_process(tcb_t* tcb, void* k_space,
     return status;
 }
 
-/** @brief Exec from userspace, copies arguments to kernel space and replaces
- *         the current process
- *  @param tcb The tcb of the process to exec
- *  @param flen The length of the filename to exec
- *  @param fname The filename of the process to exec
+/** @brief Copy the filename and arguments of exec or spawn to kernel space
+ *
+ *  @param flen The length of the filename
+ *  @param fname The filename of the program
  *  @param argc The number of strings in argv
  *  @param argv An array of strings passed to main of the new program
  *  @param arglen The number of characters in argv
- *  @return Zero on success, less than zero on failure
+ *  @param k_argv Where to store the kernel copy of argv
+ *  @return The kernel copy, starting with the filename, which must be freed,
+ *          or NULL on failure
  **/
-static int user_exec(tcb_t* tcb, int flen, char* fname,
-                     int argc, char** argv, int arglen)
+static char* copy_exec_args(int flen, char* fname, int argc, char** argv,
+                            int arglen, char*** k_argv)
 {
     size_t flen_space = flen * sizeof(char);
     size_t argv_space = argc * sizeof(char*);
     size_t string_space = arglen * sizeof(char);
     size_t total_space = flen_space + argv_space + string_space;
     if (total_space > EXEC_MAX_BYTES) {
-        return -1;
+        return NULL;
     }
     char* k_space = malloc(total_space);
     if (k_space == NULL) {
-        return -1;
+        return NULL;
     }
-    char** k_argv = (char**)(k_space + flen);
-    char* k_str_start = (char*)(k_argv + argc);
+    *k_argv = (char**)(k_space + flen);
+    char* k_str_start = (char*)(*k_argv + argc);
     memcpy(k_space, fname, flen * sizeof(char));
-    memcpy(k_argv, argv, argc * sizeof(char*));
+    memcpy(*k_argv, argv, argc * sizeof(char*));
     int i;
     char* k_str_current = k_str_start;
     for (i = 0; i < argc; i++) {
-        k_argv[i] = k_str_current;
+        (*k_argv)[i] = k_str_current;
         int copied = strcpy_len(k_str_current, argv[i]);
         k_str_current += copied;
     }
+    return k_space;
+}
+
+/** @brief Exec from userspace, copies arguments to kernel space and replaces
+ *         the current process
+ *  @param tcb The tcb of the process to exec
+ *  @param flen The length of the filename to exec
+ *  @param fname The filename of the process to exec
+ *  @param argc The number of strings in argv
+ *  @param argv An array of strings passed to main of the new program
+ *  @param arglen The number of characters in argv
+ *  @return Zero on success, less than zero on failure
+ **/
+static int user_exec(tcb_t* tcb, int flen, char* fname,
+                     int argc, char** argv, int arglen)
+{
+    char** k_argv;
+    char* k_space = copy_exec_args(flen, fname, argc, argv, arglen, &k_argv);
+    if (k_space == NULL) {
+        return -1;
+    }
     int status = replace_process(tcb, k_space, argc, k_argv, arglen);
     free(k_space);
     return status;
 }
+
+/** @brief Create a child process running a program
+ *
+ *  Nothing of the parent is copied. The program is loaded into a fresh
+ *  page directory, and the child is only made a child of the parent and
+ *  scheduled once it has been loaded.
+ *
+ *  @param tcb The tcb of the parent thread
+ *  @param fname The name of the program, in kernel space
+ *  @param argc The number of strings in argv
+ *  @param argv An array of strings passed to main, in kernel space
+ *  @param arglen The number of characters in argv
+ *  @param mailbox A server of the parent to give to the child, or less
+ *         than zero for none
+ *  @return The id of the child on success, less than zero on failure
+ **/
+static int spawn_process(tcb_t* tcb, char* fname, int argc, char** argv,
+                         int arglen, int mailbox)
+{
+    simple_elf_t elf;
+    if (load_elf(&elf, fname) < 0) {
+        return -1;
+    }
+    tcb_t* child = create_pcb_entry();
+    if (child == NULL) {
+        return -1;
+    }
+    pcb_t* pcb = child->process;
+    pcb->directory = init_ppd();
+    if (pcb->directory == NULL) {
+        free_tcb(child);
+        free_pcb(pcb);
+        return -1;
+    }
+    pcb_t* parent = tcb->process;
+    int status = load_unloaded_process(child, &elf, argc, argv, arglen);
+    // the parent leaves its note in the mailbox once the child owns it
+    if (status == 0 && mailbox >= 0) {
+        status = hand_off_server(mailbox, tcb, child);
+    }
+    if (status < 0) {
+        free_ppd(pcb->directory, parent->directory);
+        free_tcb(child);
+        free_pcb(pcb);
+        return -1;
+    }
+    pcb_add_child(parent, pcb);
+    // Register process for simics user space debugging
+    sim_reg_process(pcb->directory->dir, fname);
+    setup_for_switch(child);
+    kernel_add_thread(child);
+    schedule(child, T_NOT_YET);
+    return pcb->id;
+}
+
+/** @brief Spawn from userspace, copies arguments to kernel space and creates
+ *         a child process running the program
+ *  @param tcb The tcb of the parent thread
+ *  @param flen The length of the filename to spawn
+ *  @param fname The filename of the program to spawn
+ *  @param argc The number of strings in argv
+ *  @param argv An array of strings passed to main of the new program
+ *  @param arglen The number of characters in argv
+ *  @param mailbox A server of the parent to give to the child, or less
+ *         than zero for none
+ *  @return The id of the child on success, less than zero on failure
+ **/
+static int user_spawn(tcb_t* tcb, int flen, char* fname, int argc,
+                      char** argv, int arglen, int mailbox)
+{
+    char** k_argv;
+    char* k_space = copy_exec_args(flen, fname, argc, argv, arglen, &k_argv);
+    if (k_space == NULL) {
+        return -1;
+    }
+    int status = spawn_process(tcb, k_space, argc, k_argv, arglen, mailbox);
+    free(k_space);
+    return status;
+}
@@ -0,0 +1,94 @@
+/** @file exec_index.c
+ *  @brief An index of the programs built into the kernel
+ *
+ *  The table of contents of the programs is only searched by name, so at
+ *  boot every program is put into a hash table keyed by its name, and the
+ *  elf header of every program is checked and parsed once. The programs
+ *  never change, so the table is never written after boot and needs no
+ *  lock. It has twice as many slots as there can be programs, so lookups
+ *  probe a slot or two.
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs
+ **/
+
+#include <exec_index.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+/** @brief Structure for the index of programs */
+static struct {
+    exec_entry_t entries[MAX_NUM_APP_ENTRIES];
+    // the index of the program in each slot plus one, or zero if empty
+    int slots[EXEC_INDEX_SLOTS];
+} execs;
+
+/** @brief Hash the name of a program with FNV-1a
+ *
+ *  @param name The name of the program
+ *  @return The hash of the name
+ **/
+static uint32_t hash_name(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name != '\0') {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/** @brief Build the index of programs
+ *
+ *  Must be called before any program is loaded
+ *
+ *  @return void
+ **/
+void init_exec_index()
+{
+    int i;
+    if (exec2obj_userapp_count > MAX_NUM_APP_ENTRIES) {
+        panic("Too many programs for the exec index");
+    }
+    for (i = 0; i < exec2obj_userapp_count; i++) {
+        exec_entry_t* entry = &execs.entries[i];
+        entry->name = exec2obj_userapp_TOC[i].execname;
+        entry->bytes = exec2obj_userapp_TOC[i].execbytes;
+        entry->len = exec2obj_userapp_TOC[i].execlen;
+        entry->index = i;
+        entry->is_elf = 0;
+        uint32_t slot = hash_name(entry->name) % EXEC_INDEX_SLOTS;
+        while (execs.slots[slot] != 0) {
+            slot = (slot + 1) % EXEC_INDEX_SLOTS;
+        }
+        execs.slots[slot] = i + 1;
+    }
+    // the elf loader reads the headers through getbytes, and so the index
+    for (i = 0; i < exec2obj_userapp_count; i++) {
+        exec_entry_t* entry = &execs.entries[i];
+        if (elf_check_header(entry->name) == ELF_SUCCESS &&
+                elf_load_helper(&entry->elf, entry->name) == ELF_SUCCESS) {
+            entry->is_elf = 1;
+        }
+    }
+}
+
+/** @brief Find a program by name
+ *
+ *  @param name The name of the program
+ *  @return The program, or NULL if there is no program with the name
+ **/
+const exec_entry_t* find_exec(const char* name)
+{
+    uint32_t slot = hash_name(name) % EXEC_INDEX_SLOTS;
+    while (execs.slots[slot] != 0) {
+        const exec_entry_t* entry = &execs.entries[execs.slots[slot] - 1];
+        if (strcmp(name, entry->name) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) % EXEC_INDEX_SLOTS;
+    }
+    return NULL;
+}
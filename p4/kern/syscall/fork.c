@@ -19,6 +19,7 @@
 #include <stack_info.h>
 
 static int copy_process(tcb_t* tcb_parent, ureg_t* state);
+static int borrow_process(tcb_t* tcb_parent, ureg_t* state);
 static int copy_thread(tcb_t* child, tcb_t* parent, ureg_t* state, int fork);
 
 /** @brief Handler function for the fork syscall
@@ -37,6 +38,22 @@ void fork_syscall(ureg_t state)
     state.eax = copy_process(tcb_parent, &state);
 }
 
+/** @brief Handler function for the vfork syscall
+ *
+ *  @param state The register state upon the call to vfork
+ *  @return void
+ */
+void vfork_syscall(ureg_t state)
+{
+    tcb_t* tcb_parent = get_tcb();
+    //cant call vfork with more than one thread
+    if (get_thread_count(tcb_parent->process) > 1) {
+        state.eax = -1;
+        return;
+    }
+    state.eax = borrow_process(tcb_parent, &state);
+}
+
 /** @brief Handler function for the thread fork syscall
  *
  *  @param state The register state upon the call to thread fork
@@ -141,3 +158,65 @@ static int copy_process(tcb_t* tcb_parent, ureg_t* state)
     copy_thread(tcb_child, tcb_parent, state, 1);
     return tcb_child->process->id;
 }
+
+/** @brief Creates a child process which borrows the address space of its
+ *         parent
+ *
+ *  Nothing is copied, so this takes the same time however much memory the
+ *  parent has. The parent is suspended until the child gives the directory
+ *  back by calling exec or vanishing, since both would otherwise run on the
+ *  same user stack. The child is given an empty directory up front, which
+ *  it moves into if it vanishes without calling exec, so that it never runs
+ *  on the parent's directory once the parent may have exited.
+ *
+ *  @param tcb_parent The tcb of the parent process
+ *  @param state The state of userspace on the call to vfork
+ *
+ *  @return Id of the created process on success, -1 on failure
+ **/
+static int borrow_process(tcb_t* tcb_parent, ureg_t* state)
+{
+    pcb_t* pcb_parent = tcb_parent->process;
+
+    tcb_t* tcb_child = create_pcb_entry();
+    if (tcb_child == NULL) {
+        return -1;
+    }
+    pcb_t* child = tcb_child->process;
+    child->reserved = init_ppd();
+    if (child->reserved == NULL) {
+        free_tcb(tcb_child);
+        free_pcb(child);
+        return -1;
+    }
+    child->directory = pcb_parent->directory;
+    child->lender = pcb_parent;
+    // the child is not running yet, so it cannot give the directory back
+    pcb_parent->lent = 1;
+    pcb_add_child(pcb_parent, child);
+    int id = copy_thread(tcb_child, tcb_parent, state, 1);
+    mutex_lock(&pcb_parent->borrow_mutex);
+    while (pcb_parent->lent) {
+        cond_wait(&pcb_parent->returned, &pcb_parent->borrow_mutex);
+    }
+    mutex_unlock(&pcb_parent->borrow_mutex);
+    return id;
+}
+
+/** @brief Give a borrowed directory back to the process which lent it
+ *
+ *  Must be called by the last thread of a vfork child once it no longer
+ *  uses the directory, and wakes the parent.
+ *
+ *  @param pcb The vfork child
+ *  @return void
+ **/
+void end_borrow(pcb_t* pcb)
+{
+    pcb_t* lender = pcb->lender;
+    pcb->lender = NULL;
+    mutex_lock(&lender->borrow_mutex);
+    lender->lent = 0;
+    cond_signal(&lender->returned);
+    mutex_unlock(&lender->borrow_mutex);
+}
@@ -98,8 +98,7 @@ void make_runnable_syscall(ureg_t state)
  */
 void get_ticks_syscall(ureg_t state)
 {
-    // don't need locks, just read whatever is there
-    state.eax = get_ticks();
+    state.eax = get_user_ticks();
 }
 
 /** @brief The sleep syscall
@@ -109,14 +108,11 @@ void get_ticks_syscall(ureg_t state)
 void sleep_syscall(ureg_t state)
 {
     tcb_t* tcb = get_tcb();
-    int status = add_sleeper(tcb, state.esi);
+    int status = add_sleeper(tcb, user_ticks_to_ticks((int)state.esi));
     if(status < 0){
         state.eax = status;
         return;
     }
-    if(status > 0){
-        release_sleeper(tcb);
-    }
     state.eax = 0;
 }
 
@@ -171,12 +167,37 @@ void remove_pages_syscall(ureg_t state)
     state.eax = result;
 }
 
+/** @brief The fault_around syscall
+ *  @param state The current state in user mode
+ *  @return void
+ */
+void fault_around_syscall(ureg_t state)
+{
+    tcb_t* tcb = get_tcb();
+    ppd_t *ppd = tcb->process->directory;
+    mutex_lock(&ppd->lock);
+    int result = vm_set_fault_around(ppd, (int)state.esi);
+    mutex_unlock(&ppd->lock);
+    state.eax = result;
+}
+
+/** @brief The page_faults syscall
+ *  @param state The current state in user mode
+ *  @return void
+ */
+void page_faults_syscall(ureg_t state)
+{
+    // don't need locks, just read whatever is there
+    state.eax = get_tcb()->process->directory->faults.count;
+}
+
 /** @brief The halt syscall
  *  @param state The current state in user mode
  *  @return void
  */
 void halt_syscall(ureg_t state)
 {
+    frame_alloc_stats();
     // Halt machines running on simics
     sim_halt();
     // Halt machines running on real hardware
@@ -2,6 +2,19 @@
  *
  *  @brief Functions to handle wait and vanish for processes
  *
+ *  A process keeps its running children and its exited children, which are
+ *  waiting to be collected, on separate lists, so wait takes the first
+ *  exited child in constant time. An exiting process gives both lists to
+ *  init by splicing them onto init's, without touching each child. A child
+ *  finds its parent through the pointer it was given when it was created,
+ *  which is only trusted while the parent still has the child's family.
+ *  Otherwise the child belongs to init.
+ *
+ *  The memory of an exited process is freed by the reaper, a kernel thread
+ *  which is handed the last thread of the process once it is off of its
+ *  stack, so exiting threads and the idle threads which reap them never
+ *  wait on freeing a whole address space.
+ *
  *  @author Jonathan Ong (jonathao)
  *  @author Evan Palmer (esp)
  *  @bug No known bugs.
@@ -14,7 +27,21 @@
 #include <contracts.h>
 #include <simics.h>
 #include <scheduler.h>
-#include <malloc_wrappers.h>
+#include <atomic.h>
+#include <vm.h>
+#include <switch.h>
+#include <asm.h>
+#include <eflags.h>
+
+/** @brief Exited threads waiting to be freed, linked through next_exited */
+static tcb_t* volatile exited_threads = NULL;
+
+/** @brief The thread which frees the memory of exited processes */
+static struct {
+    tcb_t* thread;
+    // last threads of exited processes, linked through next_exited
+    tcb_t* volatile dead;
+} reaper;
 
 /** @brief The vanish syscall
  *  @param state The current state in user mode
@@ -45,18 +72,17 @@ void wait_syscall(ureg_t state)
 int wait(pcb_t* pcb, int *status_ptr)
 {
     mutex_lock(&pcb->children_mutex);
-    // aint never gonna get a kid
-    if(pcb->waiting == pcb->num_children){
-        mutex_unlock(&pcb->children_mutex);
-        return -1;
-    }
-    pcb_t* child = Q_GET_FRONT(&pcb->children);
-    if(child->state != P_EXITED){
+    while (Q_IS_EMPTY(&pcb->zombies)) {
+        // aint never gonna get a kid
+        if (pcb->waiting >= pcb->num_children) {
+            mutex_unlock(&pcb->children_mutex);
+            return -1;
+        }
         pcb->waiting++;
-        assert(child->id > 0);
         cond_wait(&pcb->wait, &pcb->children_mutex);
-        child = Q_GET_FRONT(&pcb->children);
+        pcb->waiting--;
     }
+    pcb_t* child = Q_GET_FRONT(&pcb->zombies);
     assert(child->state == P_EXITED);
     int status = child->exit_status;
     int pid = child->id;
@@ -68,48 +94,80 @@ int wait(pcb_t* pcb, int *status_ptr)
             return -2;
         }
     }
-    Q_REMOVE(&pcb->children, child, siblings);
-    pcb->num_children--;
+    Q_REMOVE(&pcb->zombies, child, siblings);
+    pcb->num_zombies--;
     free_pcb(child);
     mutex_unlock(&pcb->children_mutex);
     return pid;
 }
 
-/** @brief Informs all children of a process that the process is exiting so
- *         that they know to clean themselves up
+/** @brief Gives all children of an exiting process to init
+ *
+ *  Both lists of children are spliced onto init's, so this takes the same
+ *  time however many children there are. Children which are running find
+ *  out when they exit, since the process no longer has their family.
  *
  *  @param pcb The process which is exiting
  *  @return void
  **/
-void pcb_inform_children(pcb_t* pcb)
+static void pcb_give_children(pcb_t* pcb)
+{
+    pcb_t* init = kernel_state.init->process;
+    assert(pcb != init);
+    mutex_lock(&pcb->children_mutex);
+    pcb->family = 0;
+    if (pcb->num_children > 0 || pcb->num_zombies > 0) {
+        mutex_lock(&init->children_mutex);
+        Q_CONCAT(&init->children, &pcb->children, siblings);
+        init->num_children += pcb->num_children;
+        Q_CONCAT(&init->zombies, &pcb->zombies, siblings);
+        init->num_zombies += pcb->num_zombies;
+        int i;
+        for (i = 0; i < pcb->num_zombies && i < init->waiting; i++) {
+            cond_signal(&init->wait);
+        }
+        mutex_unlock(&init->children_mutex);
+        pcb->num_children = 0;
+        pcb->num_zombies = 0;
+    }
+    mutex_unlock(&pcb->children_mutex);
+}
+
+/** @brief Lock the children of the parent of a process
+ *
+ *  The parent may have given its children to init, and even been freed and
+ *  reused, so it is only trusted once its lock is held and it still has
+ *  the process's family. pcbs are never given back to the heap, so the
+ *  lock of a freed parent is still a lock.
+ *
+ *  @param pcb The process
+ *  @return The parent, with its children_mutex held
+ **/
+static pcb_t* lock_parent(pcb_t* pcb)
 {
-    pcb_t* child;
-    pcb_t* tmp;
-    assert(pcb != kernel_state.init->process);
-    // We don't need this pcb's mutex since there are no remaining
-    // processes which can
-    Q_FOREACH_SAFE(child, tmp, &pcb->children, siblings)
-    {
-        assert(child != kernel_state.init->process);
-        mutex_lock(&child->parent_mutex);
-        mutex_lock(&pcb->children_mutex);
-        Q_REMOVE(&pcb->children, child, siblings);
-        pcb->num_children--;
-        pcb_add_child(kernel_state.init->process, child);
-        mutex_unlock(&pcb->children_mutex);
-        mutex_unlock(&child->parent_mutex);
+    pcb_t* parent = pcb->parent;
+    mutex_lock(&parent->children_mutex);
+    if (parent->family == pcb->parent_id) {
+        return parent;
     }
+    mutex_unlock(&parent->children_mutex);
+    // init never exits, so it keeps every child it is given
+    parent = kernel_state.init->process;
+    mutex_lock(&parent->children_mutex);
+    return parent;
 }
 
 /** @brief Cleans up a thread, and it's process if it is the last thread
  *
  *  @param tcb The thread to clean up
  *  @param failed Is this thread being killed because it failed
- *  @return pcb The process pcb if it needs to be freed, NULL otherwise
+ *  @return The directory of the process if it exited, NULL otherwise
  **/
 ppd_t *thread_exit(tcb_t *tcb, thread_exit_state_t failed)
 {
     pcb_t* process = tcb->process;
+    // nobody may queue for the thread once its queue is freed
+    deregister_thread(tcb);
     kernel_remove_thread(tcb);
     int thread_count = pcb_remove_thread(process, tcb);
     // More threads, so we get off easy
@@ -119,46 +177,175 @@ ppd_t *thread_exit(tcb_t *tcb, thread_exit_state_t failed)
     if(failed == THREAD_EXIT_FAILED){
         process->exit_status = -2;
     }
-    //We are cleaning up the last thread
-    //first deallocate the user memory, we don't need it
-    free_ppd_user_mem(process->directory);
-    //now we want to see what our parent has to say
-    mutex_lock(&process->parent_mutex);
-    //notify all children that you are exited
-    pcb_inform_children(process);
+    //A vfork child which never exec'd moves out of its parent's directory
+    if (process->lender != NULL) {
+        replace_pcb_dir(process, process->reserved);
+        process->reserved = NULL;
+        end_borrow(process);
+    }
+    //We are cleaning up the last thread, whose memory the reaper frees
     //neither idle nor init are allowed to exit
     //and everyone else must have a parent
-    pcb_t* parent = process->parent;
-    assert(parent != NULL);
-    mutex_lock(&parent->children_mutex);
+    pcb_give_children(process);
+    pcb_t* parent = lock_parent(process);
     process->state = P_EXITED;
-    // Exited people always at front of list for efficient wait
     Q_REMOVE(&parent->children, process, siblings);
-    Q_INSERT_FRONT(&parent->children, process, siblings);
+    Q_INIT_ELEM(process, siblings);
+    parent->num_children--;
+    Q_INSERT_TAIL(&parent->zombies, process, siblings);
+    parent->num_zombies++;
     if (parent->waiting > 0) {
-        parent->waiting--;
-        mutex_unlock(&process->parent_mutex);
         cond_signal(&parent->wait);
-        mutex_unlock(&parent->children_mutex);
-    } else {
-        mutex_unlock(&parent->children_mutex);
-        mutex_unlock(&process->parent_mutex);
     }
+    mutex_unlock(&parent->children_mutex);
     return process->directory;
 }
 
-/** @brief Frees memory associated with a thread and process which cannot
- *         be freed conveniently by the thread
+/** @brief Add an exited thread to a list linked through next_exited
+ *
+ *  @param list The list
+ *  @param tcb The exited thread
+ *  @return void
+ **/
+static void push_exited(tcb_t* volatile* list, tcb_t* tcb)
+{
+    tcb_t* head;
+    do {
+        head = *list;
+        tcb->next_exited = head;
+    } while (atomic_cmpxchg((volatile int*)list, (int)head,
+                            (int)tcb) != (int)head);
+}
+
+/** @brief Queue an exited thread to be freed once it is off of its stack
+ *
+ *  Must be called with interrupts disabled, so that the thread is not
+ *  switched off of its stack before it is descheduled for good
+ *
+ *  @param tcb The exiting thread
+ *  @return void
+ **/
+void defer_exit(tcb_t* tcb)
+{
+    push_exited(&exited_threads, tcb);
+}
+
+/** @brief Wake the reaper if it is waiting for exited processes
  *
- *  @param tcb The thread to free
+ *  Takes the scheduler lock, so must be called with interrupts enabled
+ *
+ *  @return void
+ **/
+static void wake_reaper()
+{
+    tcb_t* thread = reaper.thread;
+    if (thread->waiting) {
+        lock();
+        if (atomic_xchg(&thread->waiting, 0)) {
+            schedule_locked(thread, T_KERN_SUSPENDED);
+        }
+        unlock();
+    }
+}
+
+/** @brief Free every exited thread which is off of its stack
+ *
+ *  Never blocks, so idle threads reap exited threads while they have
+ *  nothing else to do. Exiting threads and allocations which run out of
+ *  memory also reap, so exited threads are freed on a busy machine too.
+ *  The last thread of a process is handed to the reaper, which is only
+ *  woken if interrupts are enabled. Otherwise the next reap wakes it.
+ *
+ *  @return The number of threads freed
+ **/
+int reap_exited()
+{
+    int reaped = 0;
+    tcb_t* tcb = (tcb_t*)atomic_xchg((volatile int*)&exited_threads, 0);
+    while (tcb != NULL) {
+        tcb_t* next = tcb->next_exited;
+        if (tcb->on_cpu) {
+            // still switching away, so try again later
+            defer_exit(tcb);
+        } else if (tcb->free_pointer != NULL) {
+            push_exited(&reaper.dead, tcb);
+        } else {
+            free_tcb(tcb);
+            reaped++;
+        }
+        tcb = next;
+    }
+    if (reaper.dead != NULL && (get_eflags() & EFL_IF)) {
+        wake_reaper();
+    }
+    return reaped;
+}
+
+/** @brief Wait until an exited process is handed to the reaper
+ *
+ *  @param self The reaper thread
  *  @return void
  **/
-void finalize_exit(tcb_t* tcb)
+static void reaper_wait(tcb_t* self)
 {
-    if(tcb->free_pointer != NULL){
-        _free_ppd_kernel_mem(tcb->free_pointer);
+    lock();
+    remove_runnable(self, T_KERN_SUSPENDED);
+    atomic_xchg(&self->waiting, 1);
+    // a process handed over before the flag was set would not wake us, and
+    // if someone else cleared the flag they will wake us
+    if (reaper.dead != NULL && atomic_xchg(&self->waiting, 0)) {
+        self->state = T_RUNNING;
+        unlock();
+    } else {
+        deschedule_locked(self);
+    }
+}
+
+/** @brief The body of the reaper, which frees the memory of exited
+ *         processes
+ *
+ *  @return Does not return
+ **/
+static void reap_processes()
+{
+    tcb_t* self = reaper.thread;
+    ppd_t* dir = self->process->directory;
+    while (1) {
+        tcb_t* tcb = (tcb_t*)atomic_xchg((volatile int*)&reaper.dead, 0);
+        if (tcb == NULL) {
+            reaper_wait(self);
+            continue;
+        }
+        while (tcb != NULL) {
+            tcb_t* next = tcb->next_exited;
+            free_ppd(tcb->free_pointer, dir);
+            free_tcb(tcb);
+            tcb = next;
+        }
+    }
+}
+
+/** @brief Create the reaper thread
+ *
+ *  It runs in a process of its own with an empty address space, and is
+ *  first scheduled when the first process exits.
+ *
+ *  @return void
+ **/
+void init_reaper()
+{
+    tcb_t* tcb = create_pcb_entry();
+    if (tcb == NULL) {
+        panic("Cannot create the reaper thread");
+    }
+    tcb->process->directory = init_ppd();
+    if (tcb->process->directory == NULL) {
+        panic("Cannot create the reaper's page directory");
     }
-    _free_tcb(tcb);
+    setup_kernel_thread(tcb, reap_processes);
+    tcb->state = T_KERN_SUSPENDED;
+    tcb->waiting = 1;
+    reaper.thread = tcb;
 }
 
 /** @brief Cleans up a deschedules a thread
@@ -169,7 +356,6 @@ void finalize_exit(tcb_t* tcb)
 void vanish_thread(tcb_t *tcb, thread_exit_state_t failed)
 {
     tcb->free_pointer = thread_exit(tcb, failed);
-    acquire_malloc();
-    free_later(tcb);
+    reap_exited();
     kill_thread(tcb);
 }
@@ -1,5 +1,10 @@
 /** @file vhtest.c
- *  @brief Functions to test variable hash tables
+ *  @brief Functions to test and benchmark variable hash tables
+ *
+ *  After the tests, a benchmark inserts and looks up keys in a fresh table
+ *  and prints the average and worst insert times. Since tables are resized
+ *  a few buckets at a time, the worst insert should stay close to the
+ *  average however large the table grows.
  *
  *  @author Jonathan Ong (jonathao) and Evan Palmer (esp)
  *  @bug No known bugs
@@ -8,6 +13,7 @@
 #include "variable_htable.h"
 #include <stdio.h>
 #include <math.h>
+#include <time.h>
 
 /** @brief Structure for a list of items */
 Q_NEW_HEAD(hash_list_t, item);
@@ -35,6 +41,8 @@ static float mean = 0;
 
 /** @brief Number of hash table elements to test */
 #define TEST_SIZE 1000000
+/** @brief Number of hash table elements to benchmark with */
+#define BENCH_SIZE 4000000
 
 /** @brief Calculates the variance
  *
@@ -42,11 +50,61 @@ static float mean = 0;
  *  @param count Number of elements in the bucket
  *  @return Variance of the bucket
  **/
-int calc_var(i, count) {
+int calc_var(int i, int count) {
     variance += (count - mean)*(count - mean);
     return 0;
 }
 
+/** @brief Gets the current time
+ *  @return The time in nanoseconds
+ **/
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** @brief Time inserts and lookups in a fresh table
+ *  @return 0 on success, a negative integer on failure
+ **/
+static int benchmark()
+{
+    hash_table_t table;
+    int i;
+    long long start, elapsed, worst = 0, total = 0;
+    item_t* items = malloc(BENCH_SIZE * sizeof(item_t));
+    if (items == NULL || H_INIT_TABLE(&table) < 0) {
+        ABORT_ERROR("Benchmark failed to allocate");
+    }
+    for (i = 0; i < BENCH_SIZE; i++) {
+        items[i].key = i;
+        items[i].value = i;
+        Q_INIT_ELEM(&items[i], links);
+        start = now_ns();
+        H_INSERT(&table, &items[i], key, links);
+        elapsed = now_ns() - start;
+        total += elapsed;
+        if (elapsed > worst) {
+            worst = elapsed;
+        }
+    }
+    printf("Benchmark: %d inserts, %lld ns average, %lld ns worst\n",
+           BENCH_SIZE, total / BENCH_SIZE, worst);
+    start = now_ns();
+    for (i = 0; i < BENCH_SIZE; i++) {
+        if (H_GET(&table, i, key, links) != &items[i]) {
+            ABORT_ERROR("Benchmark lookup failed");
+        }
+    }
+    elapsed = now_ns() - start;
+    printf("Benchmark: %d lookups, %lld ns average\n", BENCH_SIZE,
+           elapsed / BENCH_SIZE);
+    H_FREE_TABLE(&table);
+    free(items);
+    return 0;
+}
+
 /** @brief Tests the variable hash tables
  *  @return 0 on success, a negative integer on failure
  **/
@@ -130,7 +188,7 @@ int main()
     H_FOREACH_SAFE(i, iter, swap, &table, links){
         count++;
     }
-    if(!count == H_SIZE(&table)){
+    if(count != H_SIZE(&table)){
         ABORT_ERROR("foreach safe reached too few elements");
     } else {
         puts("Foreach safe reached the correct number of elements");
@@ -156,5 +214,5 @@ int main()
     }
     puts("Updated keys removed with no problems");
     printf("Final htable capacity %d\n", H_CAPACITY(&table));
-    return 0;
+    return benchmark();
 }
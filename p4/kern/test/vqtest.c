@@ -329,6 +329,59 @@ void test_iterate_safe()
     }
 }
 
+/** @brief Test the concat functionality of variable queue
+ *  @return void
+ **/
+void test_concat()
+{
+    list_t list, other;
+
+    Q_INIT_HEAD(&list);
+    Q_INIT_HEAD(&other);
+
+    node_t nodes[2 * LIST_LEN];
+
+    // concatenating an empty queue changes nothing
+    Q_CONCAT(&list, &other, link);
+    assert(Q_IS_EMPTY(&list));
+
+    int i;
+    for (i = 0; i < 2 * LIST_LEN; i++) {
+        Q_INIT_ELEM(&nodes[i], link);
+        nodes[i].data = i;
+    }
+    for (i = 0; i < LIST_LEN; i++) {
+        Q_INSERT_TAIL(&other, &nodes[i], link);
+    }
+
+    // onto an empty queue
+    Q_CONCAT(&list, &other, link);
+    assert(Q_IS_EMPTY(&other));
+    assert(Q_GET_FRONT(&list) == &nodes[0]);
+    assert(Q_GET_TAIL(&list) == &nodes[LIST_LEN - 1]);
+
+    for (i = LIST_LEN; i < 2 * LIST_LEN; i++) {
+        Q_INSERT_TAIL(&other, &nodes[i], link);
+    }
+
+    // onto a queue with elements
+    Q_CONCAT(&list, &other, link);
+    assert(Q_IS_EMPTY(&other));
+    assert(Q_GET_TAIL(&list) == &nodes[2 * LIST_LEN - 1]);
+
+    node_t* cur;
+    i = 0;
+    Q_FOREACH(cur, &list, link) {
+        assert(cur->data == i);
+        i++;
+    }
+    assert(i == 2 * LIST_LEN);
+    // the links across the join work both ways
+    assert(Q_GET_PREV(&nodes[LIST_LEN], link) == &nodes[LIST_LEN - 1]);
+    Q_REMOVE(&list, &nodes[LIST_LEN], link);
+    assert(Q_GET_NEXT(&nodes[LIST_LEN - 1], link) == &nodes[LIST_LEN + 1]);
+}
+
 /** @brief Run a test and report its finish */
 #define RUN_TEST(t)                    \
     do {                               \
@@ -350,5 +403,6 @@ int main()
     RUN_TEST(test_removes);
     RUN_TEST(test_iterate);
     RUN_TEST(test_iterate_safe);
+    RUN_TEST(test_concat);
     return 0;
 }
@@ -22,15 +22,25 @@
 #include <asm.h>
 #include <interrupt_defines.h>
 #include <control_block_struct.h>
+#include <control_block.h>
 #include <scheduler.h>
 #include <atomic.h>
+#include <malloc.h>
+#include <vm.h>
+#include <rmlock.h>
+#include <obj_cache.h>
+#include <stddef.h>
 
 /** @brief  table of control entries for IDT entries */
 int_control_t interrupt_table[IDT_ENTS] = { { { 0 } } };
 
-/** @brief Struct for global device/server hashtable and lock */
+/** @brief Struct for global device/server hashtable and lock
+ *
+ *  Every send looks a server up, while servers are rarely added or removed,
+ *  so lookups only take the lock for reading.
+ **/
 typedef struct g_devserv {
-    mutex_t mutex;
+    rmlock_t lock;
     device_hash_t all_devserv;
 } g_devserv_t;
 
@@ -40,6 +50,28 @@ g_devserv_t all_ds;
 /** @brief counter for kernel assigned driver ids */
 int assigned_driver_id;
 
+/** @brief Cache of device/server entries */
+static obj_cache_t devserv_cache;
+
+/** @brief Initialize the mutex of a new device/server entry
+ *  @param object The entry
+ *  @return Zero
+ */
+static int construct_devserv(void* object)
+{
+    mutex_init(&((devserv_t*)object)->mutex);
+    return 0;
+}
+
+/** @brief Destroy the mutex of a device/server entry leaving the cache
+ *  @param object The entry
+ *  @return void
+ */
+static void destroy_devserv(void* object)
+{
+    mutex_destroy(&((devserv_t*)object)->mutex);
+}
+
 /** @brief Assigns a driver id
  *  @return Driver ID
  */
@@ -55,21 +87,46 @@ int assign_driver_id()
  */
 devserv_t* get_devserv(driv_id_t entry)
 {
-    mutex_lock(&all_ds.mutex);
+    rm_read_lock(&all_ds.lock);
     devserv_t* devserv = H_GET(&all_ds.all_devserv, entry, driver_id, global);
-    mutex_unlock(&all_ds.mutex);
+    rm_read_unlock(&all_ds.lock);
     return devserv;
 }
 
+/** @brief Look up a server and lock it if it has an owner
+ *
+ *  The owner gives up its servers under their locks before it exits, so it
+ *  can be used until the server is unlocked. Entries are never given back
+ *  to the heap, but the one found may have been freed and reused since the
+ *  lookup, so it is checked again once locked.
+ *
+ *  @param driver_id The server
+ *  @return The locked server, or NULL if there is no such server with an
+ *          owner
+ */
+devserv_t* lock_server(driv_id_t driver_id)
+{
+    devserv_t* server = get_devserv(driver_id);
+    if ((server == NULL) || (server->driver_id <= UDR_MAX_HW_DEV)) {
+        return NULL;
+    }
+    mutex_lock(&server->mutex);
+    if (server->driver_id != driver_id || server->owner == NULL) {
+        mutex_unlock(&server->mutex);
+        return NULL;
+    }
+    return server;
+}
+
 /** @brief Adds a device/server entry to the global hashtable
  *  @param entry Pointer to device/server entry
  *  @return void
  */
 void add_devserv(devserv_t* entry)
 {
-    mutex_lock(&all_ds.mutex);
+    rm_write_lock(&all_ds.lock);
     assert(H_INSERT(&all_ds.all_devserv, entry, driver_id, global) == NULL);
-    mutex_unlock(&all_ds.mutex);
+    rm_write_unlock(&all_ds.lock);
 }
 
 /** @brief Adds a device/server entry to the global hashtable if currently null
@@ -78,13 +135,13 @@ void add_devserv(devserv_t* entry)
  */
 int check_add_devserv(devserv_t* entry)
 {
-    mutex_lock(&all_ds.mutex);
+    rm_write_lock(&all_ds.lock);
     if (H_GET(&all_ds.all_devserv, entry->driver_id, driver_id, global) == NULL) {
         assert(H_INSERT(&all_ds.all_devserv, entry, driver_id, global) == NULL);
-        mutex_unlock(&all_ds.mutex);
+        rm_write_unlock(&all_ds.lock);
         return 0;
     } else {
-        mutex_unlock(&all_ds.mutex);
+        rm_write_unlock(&all_ds.lock);
         return -1;
     }
 }
@@ -95,10 +152,10 @@ int check_add_devserv(devserv_t* entry)
  */
 void remove_devserv(devserv_t* entry)
 {
-    mutex_lock(&all_ds.mutex);
+    rm_write_lock(&all_ds.lock);
     assert(H_REMOVE(&all_ds.all_devserv, entry->driver_id, driver_id, global)
            != NULL);
-    mutex_unlock(&all_ds.mutex);
+    rm_write_unlock(&all_ds.lock);
 }
 
 /** @brief Creates an entry for a device/server
@@ -108,16 +165,16 @@ void remove_devserv(devserv_t* entry)
 devserv_t* create_devserv_entry(driv_id_t id)
 {
     // create device entry
-    devserv_t* devserv = (devserv_t*)smalloc(sizeof(devserv_t));
+    devserv_t* devserv = (devserv_t*)cache_alloc(&devserv_cache);
     if (devserv == NULL) {
         return NULL;
     }
-    memset(devserv, 0, sizeof(devserv_t));
+    // the mutex is left initialized by the last entry to use the memory
+    memset(devserv, 0, offsetof(devserv_t, mutex));
     devserv->driver_id = id;
     Q_INIT_ELEM(devserv, global);
     Q_INIT_ELEM(devserv, interrupts);
     Q_INIT_ELEM(devserv, tcb_link);
-    mutex_init(&devserv->mutex);
     return devserv;
 }
 
@@ -127,8 +184,10 @@ devserv_t* create_devserv_entry(driv_id_t id)
  */
 void free_devserv_entry(devserv_t* entry)
 {
-    mutex_destroy(&entry->mutex);
-    sfree(entry, sizeof(devserv_t));
+    if (entry->shared != NULL) {
+        vm_free_shared(entry->shared, entry->shared_size);
+    }
+    cache_free(&devserv_cache, entry);
 }
 
 /** @brief Adds an interrupt handler to the specified device. Attaching
@@ -166,8 +225,11 @@ void add_interrupt_handler(devserv_t* device, const dev_spec_t* driv)
  **/
 void init_user_drivers()
 {
+    // senders lock entries they looked up without the registry lock
+    cache_init(&devserv_cache, "devserv", sizeof(devserv_t), sizeof(void*),
+               construct_devserv, destroy_devserv, CACHE_TYPESAFE);
     // init global device/server hashtable
-    mutex_init(&all_ds.mutex);
+    rmlock_init(&all_ds.lock);
     if (H_INIT_TABLE(&all_ds.all_devserv) < 0) {
         panic("Cannot allocate global device hashtable");
     }
@@ -192,40 +254,325 @@ void init_user_drivers()
     }
 }
 
-/** @brief Gets the next index in the circular interrupt buffer
+/** @brief Make sure the current thread can queue at least count interrupts
  *
- *  @param index The current index
- *  @return The next index
+ *  The ring only ever grows, to a power of two. Interrupts already queued
+ *  are kept in order. Producers are held off while the ring is copied, so
+ *  interrupts stay disabled until they can continue.
+ *
+ *  @param tcb The tcb of the current thread
+ *  @param count The number of interrupts to make room for
+ *  @return 0 on success, an integer less than 0 on failure
  **/
-int next_index_int(int index)
+int reserve_interrupts(tcb_t* tcb, int count)
 {
-    return (index + 1) % INTERRUPT_BUFFER_SIZE;
+    int size = 1;
+    while (size < count) {
+        size *= 2;
+    }
+    if (size <= tcb->buffer_size) {
+        return 0;
+    }
+    interrupt_slot_t* buffer = smalloc(size * sizeof(interrupt_slot_t));
+    if (buffer == NULL) {
+        return -1;
+    }
+    interrupt_slot_t* old = tcb->buffer;
+    int old_size = tcb->buffer_size;
+    disable_interrupts();
+    // wait for producers already in the ring to publish their interrupts
+    atomic_xadd(&tcb->pushers, RING_RESIZING);
+    while (tcb->pushers != RING_RESIZING) {
+        continue;
+    }
+    unsigned int queued = tcb->producer - tcb->consumer;
+    unsigned int i;
+    for (i = 0; i < queued; i++) {
+        interrupt_slot_t* slot = &old[(tcb->consumer + i) & (old_size - 1)];
+        buffer[i].interrupt = slot->interrupt;
+        buffer[i].seq = i + 1;
+    }
+    for (; i < (unsigned int)size; i++) {
+        buffer[i].seq = i;
+    }
+    tcb->buffer = buffer;
+    tcb->buffer_size = size;
+    tcb->consumer = 0;
+    tcb->producer = queued;
+    atomic_xadd(&tcb->pushers, -RING_RESIZING);
+    enable_interrupts();
+    if (old != NULL) {
+        sfree(old, old_size * sizeof(interrupt_slot_t));
+    }
+    // the new room may let blocked senders in
+    wake_senders(tcb);
+    return 0;
 }
 
-/** @brief Queue the interrupt for the given device
+/** @brief Add an interrupt to the ring of a thread without taking a lock
+ *
+ *  Any number of producers may push at once. Each claims a position by
+ *  moving the producer index forward, then publishes its slot, so the
+ *  consumer never sees a slot which is still being filled. Must be called
+ *  with interrupts disabled, so that a ring being grown on this processor
+ *  never waits for us.
+ *
  *  @param tcb The thread which will receive the interrupt
  *  @param interrupt The interrupt to be queued
+ *  @return 0 if the interrupt was queued, an integer less than 0 if there
+ *          was no room for it
+ **/
+static int push_interrupt(tcb_t* tcb, interrupt_t* interrupt)
+{
+    while (atomic_xadd(&tcb->pushers, 1) >= RING_RESIZING) {
+        atomic_xadd(&tcb->pushers, -1);
+        while (tcb->pushers >= RING_RESIZING) {
+            continue;
+        }
+    }
+    int status = -1;
+    unsigned int mask = tcb->buffer_size - 1;
+    unsigned int pos = tcb->producer;
+    while (tcb->buffer_size > 0) {
+        interrupt_slot_t* slot = &tcb->buffer[pos & mask];
+        int lag = (int)(slot->seq - pos);
+        if (lag < 0) {
+            // the slot still holds an interrupt from the last lap
+            break;
+        }
+        if (lag == 0 && atomic_cmpxchg((volatile int*)&tcb->producer, pos,
+                                       pos + 1) == (int)pos) {
+            slot->interrupt = *interrupt;
+            // also orders the publish before the read of the waiting flag
+            atomic_xchg((volatile int*)&slot->seq, pos + 1);
+            status = 0;
+            break;
+        }
+        // another producer took the position first
+        pos = tcb->producer;
+    }
+    atomic_xadd(&tcb->pushers, -1);
+    return status;
+}
+
+/** @brief Gets the next interrupt queued for the current thread
+ *
+ *  @param tcb The tcb of the current thread
+ *  @return The interrupt, or NULL if none has been published
+ **/
+interrupt_t* peek_interrupt(tcb_t* tcb)
+{
+    if (tcb->buffer_size == 0) {
+        return NULL;
+    }
+    interrupt_slot_t* slot =
+        &tcb->buffer[tcb->consumer & (tcb->buffer_size - 1)];
+    if (slot->seq != tcb->consumer + 1) {
+        return NULL;
+    }
+    return &slot->interrupt;
+}
+
+/** @brief Take the next interrupt of the current thread off its ring
+ *
+ *  There must be an interrupt returned by peek_interrupt. Its slot is handed
+ *  back to the producers for the next lap.
+ *
+ *  @param tcb The tcb of the current thread
  *  @return void
  **/
-void queue_interrupt(tcb_t* tcb, interrupt_t interrupt)
+void pop_interrupt(tcb_t* tcb)
 {
-    disable_interrupts();
-    // if we aren't about to run into the consumer
-    if (next_index_int(tcb->producer) != tcb->consumer) {
-        // add character to buffer
-        tcb->buffer[tcb->producer] = interrupt;
-        tcb->producer = next_index_int(tcb->producer);
-    } else {
-        // ignore the interrupt, we don't have room
-        // the program is more than INTERRUPT_BUFFER_SIZE interrupts
-        // behind so it's probably okay
+    interrupt_slot_t* slot =
+        &tcb->buffer[tcb->consumer & (tcb->buffer_size - 1)];
+    // also orders the free slot before the read of senders_waiting
+    atomic_xchg((volatile int*)&slot->seq,
+                tcb->consumer + tcb->buffer_size);
+    tcb->consumer++;
+}
+
+/** @brief Claim the wakeup of a thread which may be waiting for an interrupt
+ *
+ *  Must be called with the scheduler lock held, after an interrupt was
+ *  queued. Only a thread which saw the waiting flag set needs to call this.
+ *
+ *  @param tcb The thread which received the interrupt
+ *  @return True if the thread was waiting and must be woken by the caller
+ **/
+static int claim_waiting(tcb_t* tcb)
+{
+    spin_lock(&tcb->interrupt_lock);
+    // the thread may already have been woken by its timeout
+    int waiting = atomic_xchg(&tcb->waiting, 0);
+    if (waiting) {
+        cancel_timeout(tcb);
+    }
+    spin_unlock(&tcb->interrupt_lock);
+    return waiting;
+}
+
+/** @brief Queue the interrupt for the given device without waking the thread
+ *
+ *  Must be called with the scheduler lock held. If the thread was waiting
+ *  for an interrupt it is left in T_KERN_SUSPENDED for the caller to wake,
+ *  either with schedule_locked or by handing off to it.
+ *
+ *  @param tcb The thread which will receive the interrupt
+ *  @param interrupt The interrupt to be queued
+ *  @param waiting Set to true if the thread must be woken by the caller
+ *  @return 0 if the interrupt was queued, an integer less than 0 if there
+ *          was no room for it
+ **/
+int queue_interrupt_locked(tcb_t* tcb, interrupt_t interrupt, int* waiting)
+{
+    *waiting = 0;
+    if (push_interrupt(tcb, &interrupt) < 0) {
+        // counted so the receiver can tell that it fell behind
+        atomic_xadd(&tcb->dropped, 1);
+        return -1;
     }
-    // signal the thread if it was waiting on an interrupt
-    if (tcb->waiting == 1) {
-        tcb->waiting = 0;
-        schedule(tcb, T_KERN_SUSPENDED);
+    if (tcb->waiting) {
+        *waiting = claim_waiting(tcb);
     }
+    return 0;
+}
+
+/** @brief Queue the interrupt for the given device
+ *
+ *  Only takes the scheduler lock if the thread has to be woken.
+ *
+ *  @param tcb The thread which will receive the interrupt
+ *  @param interrupt The interrupt to be queued
+ *  @return 0 if the interrupt was queued, an integer less than 0 if there
+ *          was no room for it
+ **/
+int queue_interrupt(tcb_t* tcb, interrupt_t interrupt)
+{
+    disable_interrupts();
+    int status = push_interrupt(tcb, &interrupt);
     enable_interrupts();
+    if (status < 0) {
+        atomic_xadd(&tcb->dropped, 1);
+        return -1;
+    }
+    if (tcb->waiting) {
+        lock();
+        if (claim_waiting(tcb)) {
+            schedule_locked(tcb, T_KERN_SUSPENDED);
+        }
+        unlock();
+    }
+    return 0;
+}
+
+/** @brief Queue the interrupt for the given thread, or wait for room for it
+ *
+ *  If the queue is full the current thread sleeps until the receiver takes
+ *  an interrupt off it. The receiver may have gone away by then, so the
+ *  caller should look it up again before retrying.
+ *
+ *  @param tcb The thread which will receive the interrupt
+ *  @param interrupt The interrupt to be queued
+ *  @param pin The locked mutex of a server the thread owns, which keeps it
+ *         from exiting. It is unlocked once the thread is no longer used.
+ *  @return 0 if the interrupt was queued, greater than 0 if the current
+ *          thread waited for room, and less than 0 on failure
+ **/
+int queue_interrupt_wait(tcb_t* tcb, interrupt_t interrupt, mutex_t* pin)
+{
+    tcb_t* current = get_tcb();
+    // a thread waiting for room in its own queue would never wake
+    if (tcb == current) {
+        mutex_unlock(pin);
+        return queue_interrupt(tcb, interrupt);
+    }
+    lock();
+    spin_lock(&tcb->interrupt_lock);
+    int status = push_interrupt(tcb, &interrupt);
+    if (status < 0) {
+        // set before looking again, so the receiver either makes room we
+        // see or sees that we are waiting
+        atomic_xchg(&tcb->senders_waiting, 1);
+        status = push_interrupt(tcb, &interrupt);
+    }
+    if (status < 0) {
+        remove_runnable(current, T_KERN_SUSPENDED);
+        Q_INSERT_TAIL(&tcb->senders, current, suspended_threads);
+        spin_unlock(&tcb->interrupt_lock);
+        // the receiver wakes its senders when it gives up the server
+        scheduler_mutex_unlock(pin);
+        deschedule_locked(current);
+        return 1;
+    }
+    spin_unlock(&tcb->interrupt_lock);
+    if (tcb->waiting && claim_waiting(tcb)) {
+        schedule_locked(tcb, T_KERN_SUSPENDED);
+    }
+    scheduler_mutex_unlock(pin);
+    unlock();
+    return 0;
+}
+
+/** @brief Wake the senders waiting for room in the queue of a thread
+ *
+ *  Called by the thread after taking interrupts off its queue
+ *
+ *  @param tcb The tcb of the current thread
+ *  @return void
+ **/
+void wake_senders(tcb_t* tcb)
+{
+    if (!atomic_xchg(&tcb->senders_waiting, 0)) {
+        return;
+    }
+    lock();
+    spin_lock(&tcb->interrupt_lock);
+    while (!Q_IS_EMPTY(&tcb->senders)) {
+        tcb_t* sender = Q_GET_FRONT(&tcb->senders);
+        Q_REMOVE(&tcb->senders, sender, suspended_threads);
+        schedule_locked(sender, T_KERN_SUSPENDED);
+    }
+    spin_unlock(&tcb->interrupt_lock);
+    unlock();
+}
+
+/** @brief Free the kernel copy of a buffer message, if it has one
+ *  @param interrupt The interrupt carrying the message
+ *  @return void
+ **/
+void free_interrupt_buffer(interrupt_t* interrupt)
+{
+    if (interrupt->has_buffer && interrupt->size > 0) {
+        sfree(interrupt->buffer, interrupt->size);
+    }
+    interrupt->has_buffer = 0;
+}
+
+/** @brief Free the interrupt queue of a thread
+ *
+ *  Must be called once nothing can queue interrupts for the thread, and
+ *  every sender waiting for room has been woken
+ *
+ *  @param tcb The thread
+ *  @return void
+ **/
+void free_interrupts(tcb_t* tcb)
+{
+    assert(Q_IS_EMPTY(&tcb->senders));
+    if (tcb->buffer == NULL) {
+        return;
+    }
+    interrupt_t* interrupt;
+    while ((interrupt = peek_interrupt(tcb)) != NULL) {
+        if (interrupt->has_buffer && interrupt->size > 0) {
+            sfree(interrupt->buffer, interrupt->size);
+        }
+        pop_interrupt(tcb);
+    }
+    sfree(tcb->buffer, tcb->buffer_size * sizeof(interrupt_slot_t));
+    tcb->buffer = NULL;
+    tcb->buffer_size = 0;
+    tcb->consumer = tcb->producer = 0;
 }
 
 /** @brief Handle all device interrutps and making them available to the
@@ -251,6 +598,8 @@ void device_handler(ureg_t state)
 
         uint8_t read_byte;
         interrupt_t interrupt;
+        interrupt.has_buffer = 0;
+        interrupt.buffer = NULL;
         interrupt.driver_id = device->driver_id;
         // read from port if device requires it
         if (device->port != 0) {
@@ -0,0 +1,185 @@
+/** @file mmap.c
+ *
+ *  @brief Functions to handle udriv memory mapping syscalls
+ *
+ *  Hardware drivers map the memory regions their device table entry lists
+ *  with udriv_mmap. Servers share memory with their clients with
+ *  udriv_share, so that bulk data can be streamed through a ring buffer
+ *  with only a udriv_send to ring the doorbell.
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs.
+ **/
+
+#include <debug_print.h>
+#include <control_block.h>
+#include <udriv_registry.h>
+#include <udriv_kern.h>
+#include <user_drivers.h>
+#include <vm.h>
+#include <common_kern.h>
+#include <assert.h>
+
+/** @brief Checks if the thread may map a range of physical memory
+ *  @param tcb TCB of the current thread
+ *  @param physical The start of the range
+ *  @param len The length of the range
+ *  @return 0 if the thread has permissions, an integer less than 0 if not
+ */
+int check_mem_permissions(tcb_t* tcb, uint32_t physical, uint32_t len)
+{
+    devserv_t* devserv;
+    Q_FOREACH(devserv, &tcb->devserv, tcb_link)
+    {
+        // only hardware drivers have memory regions
+        if (devserv->driver_id > UDR_MAX_HW_DEV) {
+            continue;
+        }
+        const dev_spec_t* dev = devserv->device_table_entry;
+        assert(dev != NULL); // all device tables entries should have this
+        int i;
+        for (i = 0; i < dev->mem_regions_cnt; i++) {
+            const udrv_region_t* region = &dev->mem_regions[i];
+            // the whole range must lie inside one region, and the start
+            // must be checked first so the remaining length cannot wrap
+            if (region->base <= physical &&
+                    physical - region->base < region->len &&
+                    len <= region->len - (physical - region->base)) {
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+/** @brief Check that a user mapping is page aligned and not empty
+ *  @param virtual The virtual address of the mapping
+ *  @param len The length of the mapping
+ *  @return A boolean integer
+ */
+static int valid_mapping(uint32_t virtual, int len)
+{
+    if (len <= 0 || len % PAGE_SIZE != 0) {
+        return 0;
+    }
+    return page_align(virtual) == virtual;
+}
+
+/** @brief Map physical memory at an address in the current process
+ *  @param ppd The page directory of the current process
+ *  @param virtual The virtual address to map at
+ *  @param physical The physical address to map
+ *  @param len The length of the mapping
+ *  @return 0 on success, an integer less than 0 on failure
+ */
+static int map_physical(ppd_t* ppd, uint32_t virtual, uint32_t physical,
+                        uint32_t len)
+{
+    mutex_lock(&ppd->lock);
+    if (!vm_user_can_alloc(ppd, (void*)virtual, len)) {
+        DPRINTF("Space not allocable");
+        mutex_unlock(&ppd->lock);
+        return -1;
+    }
+    int status = vm_map_physical(ppd, (void*)virtual, physical, len);
+    mutex_unlock(&ppd->lock);
+    return status;
+}
+
+/** @brief The udriv_mmap syscall
+ *  @param state The current state in user mode
+ *  @return void
+ */
+void udriv_mmap_syscall(ureg_t state)
+{
+    struct {
+        uint32_t addr_phys;
+        uint32_t addr_virt;
+        int len;
+    } args;
+
+    tcb_t* tcb = get_tcb();
+    ppd_t* ppd = tcb->process->directory;
+    if (vm_read_locked(ppd, &args, state.esi, sizeof(args)) < 0) {
+        goto return_fail;
+    }
+    if (!valid_mapping(args.addr_virt, args.len) ||
+            page_align(args.addr_phys) != args.addr_phys) {
+        goto return_fail;
+    }
+    // only device memory may be mapped, never frames the allocator owns
+    if (args.addr_phys >= USER_MEM_START ||
+            (uint32_t)args.len > USER_MEM_START - args.addr_phys) {
+        goto return_fail;
+    }
+    if (check_mem_permissions(tcb, args.addr_phys, args.len) < 0) {
+        goto return_fail;
+    }
+    if (map_physical(ppd, args.addr_virt, args.addr_phys, args.len) < 0) {
+        goto return_fail;
+    }
+    state.eax = 0;
+    return;
+
+return_fail:
+    state.eax = -1;
+    return;
+}
+
+/** @brief The udriv_share syscall
+ *
+ *  The owner of a server creates its shared memory with the first call,
+ *  and clients map the same frames with later calls. The memory lasts as
+ *  long as the server entry, and until the last process unmaps it.
+ *
+ *  @param state The current state in user mode
+ *  @return void
+ */
+void udriv_share_syscall(ureg_t state)
+{
+    struct {
+        driv_id_t driv_id;
+        uint32_t addr_virt;
+        int len;
+    } args;
+
+    tcb_t* tcb = get_tcb();
+    ppd_t* ppd = tcb->process->directory;
+    if (vm_read_locked(ppd, &args, state.esi, sizeof(args)) < 0) {
+        goto return_fail;
+    }
+    if (!valid_mapping(args.addr_virt, args.len)) {
+        goto return_fail;
+    }
+    // only servers share memory, and the server keeps its frames alive
+    // until they are mapped
+    devserv_t* server = lock_server(args.driv_id);
+    if (server == NULL) {
+        goto return_fail;
+    }
+    if (server->shared == NULL) {
+        if (server->owner != tcb) {
+            goto return_fail_unlock;
+        }
+        if ((server->shared = vm_alloc_shared(args.len)) == NULL) {
+            goto return_fail_unlock;
+        }
+        server->shared_size = args.len;
+    } else if (args.len > server->shared_size) {
+        goto return_fail_unlock;
+    }
+    if (map_physical(ppd, args.addr_virt, (uint32_t)server->shared,
+                     args.len) < 0) {
+        goto return_fail_unlock;
+    }
+    mutex_unlock(&server->mutex);
+    state.eax = 0;
+    return;
+
+return_fail_unlock:
+    mutex_unlock(&server->mutex);
+return_fail:
+    state.eax = -1;
+    return;
+}
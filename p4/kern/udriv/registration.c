@@ -15,6 +15,8 @@
 #include <asm.h>
 #include <scheduler.h>
 #include <assert.h>
+#include <atomic.h>
+#include <vm.h>
 
 /** @brief Can a device access a give port
  *  @param port_region The permissions of the device
@@ -175,6 +177,44 @@ void register_server(devserv_t* server, tcb_t* tcb, unsigned int in_bytes)
     Q_INSERT_FRONT(&tcb->devserv, server, tcb_link);
 }
 
+/** @brief Give a server owned by one thread to another
+ *
+ *  Spawn gives a new program a mailbox its parent leaves a note in, which
+ *  the program reads when it starts. Messages already queued for the old
+ *  owner are not moved. A thread's list of registrations is only touched by
+ *  the thread itself, so from must be the current thread and to must not
+ *  have run yet.
+ *
+ *  @param driver_id ID of the server
+ *  @param from TCB of the current owner
+ *  @param to TCB of the new owner
+ *  @return 0 on success, an integer less than 0 on failure
+ */
+int hand_off_server(driv_id_t driver_id, tcb_t* from, tcb_t* to)
+{
+    if (driver_id <= UDR_MAX_HW_DEV) {
+        return -1;
+    }
+    devserv_t* server = get_devserv(driver_id);
+    if (server == NULL) {
+        return -1;
+    }
+    // the new owner needs somewhere to queue its messages
+    if (reserve_interrupts(to, INTERRUPT_BUFFER_SIZE) < 0) {
+        return -1;
+    }
+    mutex_lock(&server->mutex);
+    if (server->owner != from) {
+        mutex_unlock(&server->mutex);
+        return -1;
+    }
+    server->owner = to;
+    Q_REMOVE(&from->devserv, server, tcb_link);
+    Q_INSERT_FRONT(&to->devserv, server, tcb_link);
+    mutex_unlock(&server->mutex);
+    return 0;
+}
+
 /** @brief The udriv_register syscall
  *  @param state The current state in user mode
  *  @return void
@@ -193,6 +233,11 @@ void udriv_register_syscall(ureg_t state)
         state.eax = -1;
         return;
     }
+    // registered threads need somewhere to queue their interrupts
+    if (reserve_interrupts(tcb, INTERRUPT_BUFFER_SIZE) < 0) {
+        state.eax = -1;
+        return;
+    }
 
     // driver_id refers to a hardware device
     if (args.driver_id < UDR_MAX_HW_DEV) {
@@ -229,20 +274,28 @@ void udriv_register_syscall(ureg_t state)
     state.eax = server->driver_id;
 }
 
-/** @brief The udriv_deregister syscall
- *  @param state The current state in user mode
+/** @brief Wake every sender waiting for room in a thread's queue
+ *
+ *  Called once the thread has given up a server, so that senders blocked on
+ *  it look the server up again and fail rather than wait forever.
+ *
+ *  @param tcb The thread
  *  @return void
  */
-void udriv_deregister_syscall(ureg_t state)
+static void release_senders(tcb_t* tcb)
 {
-    driv_id_t driver_id = state.esi;
-    tcb_t* tcb = get_tcb();
-    // check if driver_id is valid
-    devserv_t* devserv = get_devserv(driver_id);
-    if (devserv == NULL) {
-        return;
-    }
-    // check if calling thread is registered to driver_id
+    atomic_xchg(&tcb->senders_waiting, 1);
+    wake_senders(tcb);
+}
+
+/** @brief Give up a thread's registration to a device or server
+ *  @param tcb The thread
+ *  @param devserv The device or server
+ *  @return void
+ */
+static void deregister(tcb_t* tcb, devserv_t* devserv)
+{
+    // check if the thread is registered to the device or server
     mutex_lock(&devserv->mutex);
     if (devserv->owner != tcb) {
         mutex_unlock(&devserv->mutex);
@@ -252,6 +305,13 @@ void udriv_deregister_syscall(ureg_t state)
     devserv->owner = NULL;
     devserv->bytes = 0;
     devserv->port = 0;
+    devserv->flags = 0;
+    // the next owner must not see this owner's shared memory
+    if (devserv->shared != NULL) {
+        vm_free_shared(devserv->shared, devserv->shared_size);
+        devserv->shared = NULL;
+        devserv->shared_size = 0;
+    }
     Q_REMOVE(&tcb->devserv, devserv, tcb_link);
     mutex_unlock(&devserv->mutex);
     // if it is a kernel assigned server id, clean up the data structures
@@ -261,6 +321,97 @@ void udriv_deregister_syscall(ureg_t state)
     }
 }
 
+/** @brief The udriv_deregister syscall
+ *  @param state The current state in user mode
+ *  @return void
+ */
+void udriv_deregister_syscall(ureg_t state)
+{
+    driv_id_t driver_id = state.esi;
+    tcb_t* tcb = get_tcb();
+    // check if driver_id is valid
+    devserv_t* devserv = get_devserv(driver_id);
+    if (devserv == NULL) {
+        return;
+    }
+    deregister(tcb, devserv);
+    release_senders(tcb);
+}
+
+/** @brief Give up every registration of an exiting thread
+ *
+ *  Must be called before the thread's interrupt queue is freed, and once
+ *  it will make no more registrations.
+ *
+ *  @param tcb The exiting thread
+ *  @return void
+ */
+void deregister_thread(tcb_t* tcb)
+{
+    devserv_t* devserv;
+    while ((devserv = Q_GET_FRONT(&tcb->devserv)) != NULL) {
+        // only the thread itself changes its list, so it owns every entry
+        assert(devserv->owner == tcb);
+        deregister(tcb, devserv);
+    }
+    release_senders(tcb);
+}
+
+/** @brief The udriv_config syscall
+ *
+ *  Lets the owner of a device or server deepen its interrupt queue, and
+ *  make senders to a server wait for room rather than drop messages. The
+ *  queue belongs to the thread, so it is as deep as the deepest of its
+ *  registrations asked for.
+ *
+ *  @param state The current state in user mode
+ *  @return void
+ */
+void udriv_config_syscall(ureg_t state)
+{
+    struct {
+        driv_id_t driver_id;
+        int queue_size;
+        int flags;
+    } args;
+
+    tcb_t* tcb = get_tcb();
+    ppd_t* ppd = tcb->process->directory;
+    if (vm_read_locked(ppd, &args, state.esi, sizeof(args)) < 0) {
+        goto return_fail;
+    }
+    if (args.queue_size < 0 || args.queue_size > INTERRUPT_BUFFER_MAX) {
+        goto return_fail;
+    }
+    if ((args.flags & ~UDRIV_SEND_BLOCK) != 0) {
+        goto return_fail;
+    }
+    devserv_t* devserv = get_devserv(args.driver_id);
+    if (devserv == NULL) {
+        goto return_fail;
+    }
+    // only software senders can wait, so only servers can block them
+    if (devserv->driver_id < UDR_MAX_HW_DEV && args.flags != 0) {
+        goto return_fail;
+    }
+    mutex_lock(&devserv->mutex);
+    if (devserv->owner != tcb) {
+        mutex_unlock(&devserv->mutex);
+        goto return_fail;
+    }
+    devserv->flags = args.flags;
+    mutex_unlock(&devserv->mutex);
+    if (reserve_interrupts(tcb, args.queue_size) < 0) {
+        goto return_fail;
+    }
+    state.eax = 0;
+    return;
+
+return_fail:
+    state.eax = -1;
+    return;
+}
+
 /** @brief Checks if the thread has permissions to access the port
  *  @param tcb TCB of the current thread
  *  @param port Port that needs to be validated
@@ -15,6 +15,38 @@
 #include <asm.h>
 #include <scheduler.h>
 #include <assert.h>
+#include <malloc.h>
+#include <atomic.h>
+
+/** @brief Queue a message for the owner of a server
+ *
+ *  If the server asked for UDRIV_SEND_BLOCK the current thread waits for
+ *  room in the owner's queue, otherwise a full queue drops the message.
+ *
+ *  @param driv_send The server to send to
+ *  @param interrupt The message to send
+ *  @return 0 on success, an integer less than 0 on failure
+ */
+static int send_to_server(driv_id_t driv_send, interrupt_t* interrupt)
+{
+    while (1) {
+        // the server is looked up again after every wait for room
+        devserv_t* server = lock_server(driv_send);
+        if (server == NULL) {
+            return -1;
+        }
+        tcb_t* owner = server->owner;
+        if (!(server->flags & UDRIV_SEND_BLOCK)) {
+            int status = queue_interrupt(owner, *interrupt);
+            mutex_unlock(&server->mutex);
+            return status;
+        }
+        int status = queue_interrupt_wait(owner, *interrupt, &server->mutex);
+        if (status <= 0) {
+            return status;
+        }
+    }
+}
 
 /** @brief The udriv_send syscall
  *  @param state The current state in user mode
@@ -47,10 +79,90 @@ void udriv_send_syscall(ureg_t state)
     interrupt.driver_id = server->driver_id;
     interrupt.msg = args.msg_send;
     interrupt.size = args.msg_size;
+    interrupt.has_buffer = 0;
+    interrupt.buffer = NULL;
 
     // queue interrupt in the device/server buffer
-    queue_interrupt(server->owner, interrupt);
+    if (send_to_server(server->driver_id, &interrupt) < 0) {
+        goto return_fail;
+    }
+    state.eax = 0;
+    return;
+
+return_fail:
+    state.eax = -1;
+    return;
+}
+
+/** @brief Build a buffer message for a server from a user buffer
+ *
+ *  The server is not looked up, so the caller must lock it before sending.
+ *
+ *  @param ppd The page directory of the sending process
+ *  @param driv_send The server to send to
+ *  @param msg_send The message to send with the buffer
+ *  @param buf The user buffer
+ *  @param len The length of the user buffer
+ *  @param interrupt Where to build the message
+ *  @return 0 on success, an integer less than 0 on failure
+ */
+static int make_buffer_message(ppd_t* ppd, driv_id_t driv_send,
+                               message_t msg_send, void* buf,
+                               unsigned int len, interrupt_t* interrupt)
+{
+    // only servers can be sent buffers
+    if (driv_send <= UDR_MAX_HW_DEV || len > BUF_MESSAGE_MAX) {
+        return -1;
+    }
+    interrupt->driver_id = driv_send;
+    interrupt->msg = msg_send;
+    interrupt->size = len;
+    interrupt->has_buffer = 1;
+    interrupt->buffer = NULL;
+    if (len > 0) {
+        interrupt->buffer = smalloc(len);
+        if (interrupt->buffer == NULL) {
+            return -1;
+        }
+        if (vm_read_locked(ppd, interrupt->buffer, (uint32_t)buf, len) < 0) {
+            free_interrupt_buffer(interrupt);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/** @brief The udriv_send_buf syscall
+ *
+ *  The buffer is copied into the kernel once and queued as a single
+ *  message, so it costs one system call however long it is.
+ *
+ *  @param state The current state in user mode
+ *  @return void
+ */
+void udriv_send_buf_syscall(ureg_t state)
+{
+    struct {
+        driv_id_t driv_send;
+        message_t msg_send;
+        void* buf;
+        unsigned int len;
+    } args;
 
+    tcb_t* tcb = get_tcb();
+    ppd_t* ppd = tcb->process->directory;
+    if (vm_read_locked(ppd, &args, state.esi, sizeof(args)) < 0) {
+        goto return_fail;
+    }
+    interrupt_t interrupt;
+    if (make_buffer_message(ppd, args.driv_send, args.msg_send, args.buf,
+                            args.len, &interrupt) < 0) {
+        goto return_fail;
+    }
+    if (send_to_server(interrupt.driver_id, &interrupt) < 0) {
+        free_interrupt_buffer(&interrupt);
+        goto return_fail;
+    }
     state.eax = 0;
     return;
 
@@ -59,28 +171,40 @@ return_fail:
     return;
 }
 
-/** @brief Wait for an interrupt for the current thread
+/** @brief Take the next interrupt of the current thread off its queue
+ *
+ *  There must be an interrupt queued. The contents of a buffer message are
+ *  copied to buf, up to len bytes, and the rest are dropped. msg_size is
+ *  always set to the full message size.
+ *
  *  @param tcb TCB of the current thread
  *  @param driv_recv Pointer to store driver_id of interrupt
  *  @param msg_recv Pointer to store message received
  *  @param msg_size Pointer to store message size
- *  @return 0 on success, an integer less than 0 on failure
+ *  @param buf Pointer to store the contents of a buffer message, or NULL
+ *  @param len The size of buf
+ *  @return 1 if a buffer message was received, 0 for any other message, and
+ *          an integer less than 0 on failure
  */
-int udriv_wait(tcb_t* tcb, driv_id_t* driv_recv, message_t* msg_recv,
-               unsigned int* msg_size)
+static int take_interrupt(tcb_t* tcb, driv_id_t* driv_recv,
+                          message_t* msg_recv, unsigned int* msg_size,
+                          void* buf, unsigned int len)
 {
-    disable_interrupts();
-    // wait for an interrupt if there are none queued
-    if (tcb->consumer == tcb->producer) {
-        tcb->waiting = 1;
-        deschedule(tcb, T_KERN_SUSPENDED);
-    }
-    enable_interrupts();
-    // process the next interrupt
-    interrupt_t interrupt = tcb->buffer[tcb->consumer];
-    tcb->consumer = next_index_int(tcb->consumer);
+    interrupt_t interrupt = *peek_interrupt(tcb);
+    pop_interrupt(tcb);
+    wake_senders(tcb);
     // copy to user pointers
     ppd_t* ppd = tcb->process->directory;
+    int status = 0;
+    int has_buffer = interrupt.has_buffer;
+    if (has_buffer && buf != NULL && interrupt.size > 0) {
+        unsigned int copy = interrupt.size < len ? interrupt.size : len;
+        status = vm_write_locked(ppd, interrupt.buffer, (uint32_t)buf, copy);
+    }
+    free_interrupt_buffer(&interrupt);
+    if (status < 0) {
+        return -1;
+    }
     if (driv_recv != NULL) {
         if (vm_write_locked(ppd, &interrupt.driver_id, (uint32_t)driv_recv,
                             sizeof(driv_id_t)) < 0) {
@@ -99,7 +223,203 @@ int udriv_wait(tcb_t* tcb, driv_id_t* driv_recv, message_t* msg_recv,
             return -1;
         }
     }
-    return 0;
+    return has_buffer;
+}
+
+/** @brief Queue a message for a thread and wait for an interrupt
+ *
+ *  If the receiver was waiting and the current thread has to wait, the
+ *  processor is handed straight to the receiver, which runs for the rest of
+ *  the current quantum without going through the run queue.
+ *
+ *  @param tcb TCB of the current thread
+ *  @param dest The thread to send to, or NULL to only wait
+ *  @param interrupt The message to send, or NULL to only wait
+ *  @param pin The locked mutex of a server dest owns, which keeps it from
+ *         exiting until the message is queued, or NULL to only wait
+ *  @param timeout The number of ticks to wait for, zero to not wait, or less
+ *         than zero to wait until an interrupt arrives
+ *  @return 1 if an interrupt is queued, 0 if the timeout passed first, and
+ *          an integer less than 0 on failure
+ */
+static int wait_interrupt(tcb_t* tcb, tcb_t* dest, interrupt_t* interrupt,
+                          mutex_t* pin, int timeout)
+{
+    int waiting = 0, blocked = 0;
+    if (timeout > 0 && lock_sleepers() < 0) {
+        if (dest != NULL) {
+            mutex_unlock(pin);
+            free_interrupt_buffer(interrupt);
+        }
+        return -1;
+    }
+    lock();
+    if (dest != NULL) {
+        int status = queue_interrupt_locked(dest, *interrupt, &waiting);
+        // a receiver we claimed cannot exit until we wake it, and otherwise
+        // we are done with it
+        scheduler_mutex_unlock(pin);
+        if (status < 0) {
+            if (timeout > 0) {
+                unlock_sleepers();
+            }
+            unlock();
+            free_interrupt_buffer(interrupt);
+            return -1;
+        }
+    }
+    // wait for an interrupt if there are none queued
+    if (peek_interrupt(tcb) == NULL && timeout != 0) {
+        // producers only take the lock to claim the wakeup
+        spin_lock(&tcb->interrupt_lock);
+        remove_runnable(tcb, T_KERN_SUSPENDED);
+        atomic_xchg(&tcb->waiting, 1);
+        // an interrupt published before the flag was set would not wake us
+        if (peek_interrupt(tcb) != NULL) {
+            tcb->waiting = 0;
+            tcb->state = T_RUNNING;
+        } else {
+            blocked = 1;
+            if (timeout > 0) {
+                add_timeout(tcb, timeout);
+            }
+        }
+        spin_unlock(&tcb->interrupt_lock);
+    }
+    if (timeout > 0) {
+        unlock_sleepers();
+    }
+    if (waiting && blocked) {
+        handoff_locked(tcb, dest, T_KERN_SUSPENDED);
+    } else {
+        if (waiting) {
+            schedule_locked(dest, T_KERN_SUSPENDED);
+        }
+        if (blocked) {
+            deschedule_locked(tcb);
+        } else {
+            unlock();
+        }
+    }
+    return peek_interrupt(tcb) != NULL;
+}
+
+/** @brief Queue a message for a thread and wait for an interrupt
+ *
+ *  @param tcb TCB of the current thread
+ *  @param dest The thread to send to, or NULL to only wait
+ *  @param interrupt The message to send, or NULL to only wait
+ *  @param pin The locked mutex of a server dest owns, or NULL to only wait
+ *  @param driv_recv Pointer to store driver_id of interrupt
+ *  @param msg_recv Pointer to store message received
+ *  @param msg_size Pointer to store message size
+ *  @param buf Pointer to store the contents of a buffer message, or NULL
+ *  @param len The size of buf
+ *  @return 1 if a buffer message was received, 0 for any other message, and
+ *          an integer less than 0 on failure
+ */
+static int send_and_wait(tcb_t* tcb, tcb_t* dest, interrupt_t* interrupt,
+                         mutex_t* pin, driv_id_t* driv_recv,
+                         message_t* msg_recv, unsigned int* msg_size,
+                         void* buf, unsigned int len)
+{
+    if (wait_interrupt(tcb, dest, interrupt, pin, -1) < 0) {
+        return -1;
+    }
+    return take_interrupt(tcb, driv_recv, msg_recv, msg_size, buf, len);
+}
+
+/** @brief Take queued interrupts of the current thread off its queue
+ *
+ *  A buffer message ends the batch. It is described in the last entry but
+ *  left queued, so that its contents can be received with udriv_wait_buf.
+ *
+ *  @param tcb TCB of the current thread
+ *  @param msgs The user array to store the interrupts in
+ *  @param count The number of entries in msgs
+ *  @return The number of entries stored, or less than 0 on failure
+ */
+static int take_interrupts(tcb_t* tcb, udriv_msg_t* msgs, int count)
+{
+    int i;
+    ppd_t* ppd = tcb->process->directory;
+    mutex_lock(&ppd->lock);
+    interrupt_t* interrupt;
+    for (i = 0; i < count && (interrupt = peek_interrupt(tcb)) != NULL; i++) {
+        udriv_msg_t msg;
+        msg.driver_id = interrupt->driver_id;
+        msg.msg = interrupt->msg;
+        msg.size = interrupt->size;
+        msg.has_buffer = interrupt->has_buffer;
+        if (vm_write(ppd, &msg, &msgs[i], sizeof(udriv_msg_t)) < 0) {
+            mutex_unlock(&ppd->lock);
+            return -1;
+        }
+        if (msg.has_buffer) {
+            i++;
+            break;
+        }
+        pop_interrupt(tcb);
+    }
+    mutex_unlock(&ppd->lock);
+    wake_senders(tcb);
+    return i;
+}
+
+/** @brief Wait for an interrupt for the current thread
+ *
+ *  @param tcb TCB of the current thread
+ *  @param driv_recv Pointer to store driver_id of interrupt
+ *  @param msg_recv Pointer to store message received
+ *  @param msg_size Pointer to store message size
+ *  @param buf Pointer to store the contents of a buffer message, or NULL
+ *  @param len The size of buf
+ *  @return 1 if a buffer message was received, 0 for any other message, and
+ *          an integer less than 0 on failure
+ */
+int udriv_wait(tcb_t* tcb, driv_id_t* driv_recv, message_t* msg_recv,
+               unsigned int* msg_size, void* buf, unsigned int len)
+{
+    return send_and_wait(tcb, NULL, NULL, NULL, driv_recv, msg_recv,
+                         msg_size, buf, len);
+}
+
+/** @brief Check that the pointers an interrupt is received into are writable
+ *
+ *  Must be called with the process lock held
+ *
+ *  @param ppd The page directory of the current process
+ *  @param driv_recv Pointer to store driver_id of interrupt, or NULL
+ *  @param msg_recv Pointer to store message received, or NULL
+ *  @param msg_size Pointer to store message size, or NULL
+ *  @param buf Pointer to store the contents of a buffer message, or NULL
+ *  @param len The size of buf
+ *  @return A boolean integer
+ */
+static int can_receive(ppd_t* ppd, driv_id_t* driv_recv, message_t* msg_recv,
+                       unsigned int* msg_size, void* buf, unsigned int len)
+{
+    if (driv_recv != NULL) {
+        if (!vm_user_can_write(ppd, driv_recv, sizeof(driv_id_t))) {
+            return 0;
+        }
+    }
+    if (msg_recv != NULL) {
+        if (!vm_user_can_write(ppd, msg_recv, sizeof(message_t))) {
+            return 0;
+        }
+    }
+    if (msg_size != NULL) {
+        if (!vm_user_can_write(ppd, msg_size, sizeof(unsigned int))) {
+            return 0;
+        }
+    }
+    if (buf != NULL && len > 0) {
+        if (!vm_user_can_write(ppd, buf, len)) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
 /** @brief Check if the thread is registered to devices with interrupts
@@ -148,20 +468,9 @@ void udriv_wait_syscall(ureg_t state)
     }
     // make sure the pointers are writable
     mutex_lock(&ppd->lock);
-    if (args.driv_recv != NULL) {
-        if (!vm_user_can_write(ppd, args.driv_recv, sizeof(driv_id_t))) {
-            goto return_fail_unlock;
-        }
-    }
-    if (args.msg_recv != NULL) {
-        if (!vm_user_can_write(ppd, args.msg_recv, sizeof(message_t))) {
-            goto return_fail_unlock;
-        }
-    }
-    if (args.msg_size != NULL) {
-        if (!vm_user_can_write(ppd, args.msg_size, sizeof(unsigned int))) {
-            goto return_fail_unlock;
-        }
+    if (!can_receive(ppd, args.driv_recv, args.msg_recv, args.msg_size,
+                     NULL, 0)) {
+        goto return_fail_unlock;
     }
     mutex_unlock(&ppd->lock);
     // check if thread is registered to any devices/servers with interrupts
@@ -169,7 +478,8 @@ void udriv_wait_syscall(ureg_t state)
         goto return_fail;
     }
     // get an interrupt for the current thread
-    if (udriv_wait(tcb, args.driv_recv, args.msg_recv, args.msg_size) < 0) {
+    if (udriv_wait(tcb, args.driv_recv, args.msg_recv, args.msg_size,
+                   NULL, 0) < 0) {
         goto return_fail;
     }
     state.eax = 0;
@@ -182,12 +492,199 @@ return_fail:
     return;
 }
 
-/** @brief The udriv_mmap syscall
+/** @brief The udriv_wait_buf syscall
  *  @param state The current state in user mode
  *  @return void
  */
-void udriv_mmap_syscall(ureg_t state)
+void udriv_wait_buf_syscall(ureg_t state)
 {
-    lprintf("Thread %d called udriv_mmap. Not yet implemented.", get_tcb()->id);
+    struct {
+        driv_id_t* driv_recv;
+        message_t* msg_recv;
+        unsigned int* msg_size;
+        void* buf;
+        unsigned int len;
+    } args;
+
+    tcb_t* tcb = get_tcb();
+    ppd_t* ppd = tcb->process->directory;
+    if (vm_read_locked(ppd, &args, state.esi, sizeof(args)) < 0) {
+        goto return_fail;
+    }
+    // make sure the pointers are writable
+    mutex_lock(&ppd->lock);
+    if (!can_receive(ppd, args.driv_recv, args.msg_recv, args.msg_size,
+                     args.buf, args.len)) {
+        goto return_fail_unlock;
+    }
+    mutex_unlock(&ppd->lock);
+    // check if thread is registered to any devices/servers with interrupts
+    if (!has_interrupts(tcb)) {
+        goto return_fail;
+    }
+    state.eax = udriv_wait(tcb, args.driv_recv, args.msg_recv, args.msg_size,
+                           args.buf, args.len);
+    return;
+
+return_fail_unlock:
+    mutex_unlock(&ppd->lock);
+return_fail:
+    state.eax = -1;
+    return;
+}
+
+/** @brief The udriv_wait_many syscall
+ *
+ *  Stores up to count queued interrupts with one system call, waiting at
+ *  most timeout ticks for the first one to arrive.
+ *
+ *  @param state The current state in user mode
+ *  @return void
+ */
+void udriv_wait_many_syscall(ureg_t state)
+{
+    struct {
+        udriv_msg_t* msgs;
+        int count;
+        int timeout;
+    } args;
+
+    tcb_t* tcb = get_tcb();
+    ppd_t* ppd = tcb->process->directory;
+    if (vm_read_locked(ppd, &args, state.esi, sizeof(args)) < 0) {
+        goto return_fail;
+    }
+    if (args.count <= 0) {
+        goto return_fail;
+    }
+    // no more interrupts than the queue holds can be returned
+    if (args.count > tcb->buffer_size) {
+        args.count = tcb->buffer_size;
+    }
+    // the whole array is checked once rather than once per interrupt
+    mutex_lock(&ppd->lock);
+    if (!vm_user_can_write(ppd, args.msgs, args.count * sizeof(udriv_msg_t))) {
+        mutex_unlock(&ppd->lock);
+        goto return_fail;
+    }
+    mutex_unlock(&ppd->lock);
+    // check if thread is registered to any devices/servers with interrupts
+    if (!has_interrupts(tcb)) {
+        goto return_fail;
+    }
+    int timeout = user_ticks_to_ticks(args.timeout);
+    int status = wait_interrupt(tcb, NULL, NULL, NULL, timeout);
+    if (status <= 0) {
+        state.eax = status;
+        return;
+    }
+    state.eax = take_interrupts(tcb, args.msgs, args.count);
+    return;
+
+return_fail:
     state.eax = -1;
+    return;
+}
+
+/** @brief The udriv_dropped syscall
+ *
+ *  Returns the number of interrupts which could not be queued for the
+ *  current thread because its queue was full.
+ *
+ *  @param state The current state in user mode
+ *  @return void
+ */
+void udriv_dropped_syscall(ureg_t state)
+{
+    // don't need locks, just read whatever is there
+    state.eax = get_tcb()->dropped;
+}
+
+/** @brief Arguments of the udriv_call and udriv_reply_wait syscalls */
+typedef struct {
+    driv_id_t driv_send;
+    message_t msg_send;
+    void* buf;
+    unsigned int len;
+    driv_id_t* driv_recv;
+    message_t* msg_recv;
+    unsigned int* msg_size;
+    void* recv_buf;
+    unsigned int recv_len;
+} call_args_t;
+
+/** @brief Send a buffer message and wait for the next interrupt
+ *
+ *  @param state The current state in user mode
+ *  @param may_skip_send True if UDR_NOSERVER means no message is sent
+ *  @return 1 if a buffer message was received, 0 for any other message, and
+ *          an integer less than 0 on failure
+ */
+static int call(ureg_t* state, int may_skip_send)
+{
+    call_args_t args;
+    tcb_t* tcb = get_tcb();
+    ppd_t* ppd = tcb->process->directory;
+    if (vm_read_locked(ppd, &args, state->esi, sizeof(args)) < 0) {
+        return -1;
+    }
+    // make sure the pointers are writable before anything is sent
+    mutex_lock(&ppd->lock);
+    if (!can_receive(ppd, args.driv_recv, args.msg_recv, args.msg_size,
+                     args.recv_buf, args.recv_len)) {
+        mutex_unlock(&ppd->lock);
+        return -1;
+    }
+    mutex_unlock(&ppd->lock);
+    // the reply can only arrive if we can receive interrupts
+    if (!has_interrupts(tcb)) {
+        return -1;
+    }
+    interrupt_t interrupt;
+    tcb_t* dest = NULL;
+    mutex_t* pin = NULL;
+    if (!may_skip_send || args.driv_send != UDR_NOSERVER) {
+        if (make_buffer_message(ppd, args.driv_send, args.msg_send, args.buf,
+                                args.len, &interrupt) < 0) {
+            return -1;
+        }
+        // the server stays locked until the message is queued
+        devserv_t* server = lock_server(args.driv_send);
+        if (server == NULL) {
+            free_interrupt_buffer(&interrupt);
+            return -1;
+        }
+        dest = server->owner;
+        pin = &server->mutex;
+    }
+    return send_and_wait(tcb, dest, &interrupt, pin, args.driv_recv,
+                         args.msg_recv, args.msg_size, args.recv_buf,
+                         args.recv_len);
+}
+
+/** @brief The udriv_call syscall
+ *
+ *  Sends a buffer message to a server and waits for the reply, switching
+ *  straight to the server if it was waiting.
+ *
+ *  @param state The current state in user mode
+ *  @return void
+ */
+void udriv_call_syscall(ureg_t state)
+{
+    state.eax = call(&state, 0);
+}
+
+/** @brief The udriv_reply_wait syscall
+ *
+ *  Replies to a client and waits for the next message, switching straight
+ *  to the client if it was waiting for the reply. A reply to UDR_NOSERVER
+ *  only waits.
+ *
+ *  @param state The current state in user mode
+ *  @return void
+ */
+void udriv_reply_wait_syscall(ureg_t state)
+{
+    state.eax = call(&state, 1);
 }
@@ -2,6 +2,23 @@
  *
  *  @brief Functions to allocate and free frames
  *
+ *  Free frames are managed by a buddy allocator whose metadata lives in an
+ *  array with an entry for every frame, so frames are never touched to
+ *  allocate or free them. Frames are numbered from the start of user memory,
+ *  which is aligned to the largest block size, and frame zero is the zfod
+ *  zero page which is never freed. A free block of 2^order frames is kept on
+ *  the free list for its order, and only its first frame records the order.
+ *
+ *  Single frames are allocated from and freed to a small magazine belonging
+ *  to the current processor, which is refilled from and spilled to the buddy
+ *  allocator in batches, so most page faults never take the global lock.
+ *  Each magazine also keeps a pool of frames which its processor zeroed
+ *  while idle, so most zfod faults only have to map a frame.
+ *
+ *  The allocator is protected by a spinlock held with interrupts disabled,
+ *  since every operation under it is short and idle threads, which can never
+ *  block, need to take it.
+ *
  *  @author Jonathan Ong (jonathao)
  *  @author Evan Palmer (esp)
  *  @bug No known bugs.
@@ -11,20 +28,98 @@
 #include <page.h>
 #include <common_kern.h>
 #include <string.h>
-#include <mutex.h>
+#include <spinlock.h>
+#include <malloc.h>
+#include <atomic.h>
+#include <asm.h>
+#include <eflags.h>
+#include <cr.h>
+#include <assert.h>
 #include "vm_internal.h"
 #include <vm.h>
+#include <variable_queue.h>
+#include <simics.h>
+#include <cpu.h>
+#include <smp/smp.h>
+
+/** @brief Marks a frame which does not start a free block */
+#define NOT_FREE -1
+
+/** @brief Metadata for a single frame */
+typedef struct frame_info {
+    Q_NEW_LINK(frame_info) free_link;
+    int references;
+    int order;
+} frame_info_t;
+
+/** @brief Structure for a list of free blocks */
+Q_NEW_HEAD(free_list_t, frame_info);
+
+/** @brief The number of zeroed frames each processor keeps for zfod faults */
+#define ZERO_POOL_SIZE 32
+/** @brief The most frames an idle processor zeroes before checking for work */
+#define ZERO_POOL_REFILL 8
+
+/** @brief The most frames a processor keeps in its magazine */
+#define MAGAZINE_SIZE 32
+/** @brief The number of frames moved between a magazine and the buddy
+ *         allocator at once
+ **/
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)
+
+/** @brief Structure for the free frames cached by one processor
+ *
+ *  The lock is only contended when memory runs out and every magazine is
+ *  emptied. It is always taken before the frame allocator lock.
+ **/
+typedef struct magazine {
+    spinlock_t lock;
+    void* frames[MAGAZINE_SIZE];
+    int count;
+    void* zeroed[ZERO_POOL_SIZE];
+    int zeroed_count;
+    int refilling;
+    int hits;
+    int misses;
+} magazine_t;
 
 /** @brief Structure for the frame allocator */
 static struct {
     int total_frames;
     int free_frames;
-    int next_physical_frame;
-    uint32_t* next_frame;
     void* zero_page;
-    mutex_t lock;
+    frame_info_t* info;
+    free_list_t free_lists[MAX_FRAME_ORDER + 1];
+    magazine_t magazines[MAX_CPUS];
+    spinlock_t lock;
 } frames;
 
+/** @brief Take the frame allocator lock
+ *
+ *  Frames are allocated during boot before interrupts may be enabled, so
+ *  the interrupt flag is saved rather than assumed to be set.
+ *
+ *  @return The eflags to restore with unlock_frames
+ **/
+static uint32_t lock_frames()
+{
+    uint32_t eflags = get_eflags();
+    disable_interrupts();
+    spin_lock(&frames.lock);
+    return eflags;
+}
+
+/** @brief Release the frame allocator lock
+ *
+ *  @param eflags The eflags returned by lock_frames
+ *  @return void
+ **/
+static void unlock_frames(uint32_t eflags)
+{
+    spin_unlock(&frames.lock);
+    set_eflags(eflags);
+}
+
 /** @brief Zero a frame
  *  @param frame The frame to zero
  *  @return void
@@ -35,19 +130,138 @@ void zero_frame(void* frame)
     memset(frame, 0, PAGE_SIZE);
 }
 
-/** @brief Return the next physical frame not yet touched by the frame allocator
+/** @brief Gets the number of a frame from its physical address
  *
- *  @return a frame or NULL if no more physical frames are available
+ *  @param physical The physical address of the frame
+ *  @return The frame number
  **/
-static void* next_physical_frame()
+static int frame_index(void* physical)
 {
-    if (frames.next_physical_frame >= frames.total_frames) {
-        return NULL;
+    return ((uint32_t)physical - USER_MEM_START) / PAGE_SIZE;
+}
+
+/** @brief Gets the physical address of a frame from its number
+ *
+ *  @param index The frame number
+ *  @return The physical address of the frame
+ **/
+static void* frame_address(int index)
+{
+    return (void*)(USER_MEM_START + PAGE_SIZE * index);
+}
+
+/** @brief Get the reference count of a user frame
+ *
+ *  @param physical The physical address of the frame
+ *  @return A pointer to the reference count of the frame
+ **/
+static int* frame_references(void* physical)
+{
+    return &frames.info[frame_index(physical)].references;
+}
+
+/** @brief Put a block on the free list for its order
+ *
+ *  Must be called with the frame lock held
+ *
+ *  @param index The first frame of the block
+ *  @param order The order of the block
+ *  @return void
+ **/
+static void add_free_block(int index, int order)
+{
+    frame_info_t* info = &frames.info[index];
+    info->order = order;
+    Q_INSERT_FRONT(&frames.free_lists[order], info, free_link);
+}
+
+/** @brief Take a block off of the free list for its order
+ *
+ *  Must be called with the frame lock held
+ *
+ *  @param index The first frame of the block
+ *  @return void
+ **/
+static void remove_free_block(int index)
+{
+    frame_info_t* info = &frames.info[index];
+    Q_REMOVE(&frames.free_lists[info->order], info, free_link);
+    info->order = NOT_FREE;
+}
+
+/** @brief Allocate a block of frames
+ *
+ *  Must be called with the frame lock held. A larger block is split if
+ *  there is no free block of the right order.
+ *
+ *  @param order The order of the block to allocate
+ *  @return The first frame of the block or less than zero if there is none
+ **/
+static int buddy_alloc(int order)
+{
+    int found;
+    for (found = order; found <= MAX_FRAME_ORDER; found++) {
+        if (!Q_IS_EMPTY(&frames.free_lists[found])) {
+            break;
+        }
+    }
+    if (found > MAX_FRAME_ORDER) {
+        return -1;
+    }
+    frame_info_t* info = Q_GET_FRONT(&frames.free_lists[found]);
+    int index = info - frames.info;
+    remove_free_block(index);
+    // give back the upper halves we do not need
+    while (found > order) {
+        found--;
+        add_free_block(index + (1 << found), found);
+    }
+    frames.free_frames -= 1 << order;
+    return index;
+}
+
+/** @brief Free a block of frames, merging it with its free buddies
+ *
+ *  Must be called with the frame lock held
+ *
+ *  @param index The first frame of the block
+ *  @param order The order of the block
+ *  @return void
+ **/
+static void buddy_free(int index, int order)
+{
+    frames.free_frames += 1 << order;
+    while (order < MAX_FRAME_ORDER) {
+        int buddy = index ^ (1 << order);
+        if (buddy > frames.total_frames ||
+                frames.info[buddy].order != order) {
+            break;
+        }
+        remove_free_block(buddy);
+        index &= ~(1 << order);
+        order++;
     }
-    int frame_index = frames.next_physical_frame;
-    frames.next_physical_frame++;
-    uint32_t frame = USER_MEM_START + PAGE_SIZE * frame_index;
-    return (void*)frame;
+    add_free_block(index, order);
+}
+
+/** @brief Add a reference to a frame which is being shared by another mapping
+ *
+ *  @param physical The physical address of the frame
+ *  @return void
+ **/
+void share_frame(void* physical)
+{
+    atomic_xadd(frame_references(physical), 1);
+}
+
+/** @brief Is a frame referenced by more than one mapping
+ *
+ *  @param physical The physical address of the frame
+ *  @return A boolean integer
+ **/
+int is_shared_frame(void* physical)
+{
+    return *frame_references(physical) > 1;
 }
 
 /** @brief Gets the zfod zero page
@@ -71,106 +285,569 @@ int user_frame_total()
  **/
 void init_frame_alloc()
 {
+    int i, order;
     frames.total_frames = machine_phys_frames() - USER_MEM_START / PAGE_SIZE;
     // the zfod frame doesn't count, since it can never be allocated
     frames.total_frames--;
-    frames.free_frames = frames.total_frames;
-    frames.next_physical_frame = 0;
-    frames.next_frame = 0;
-    frames.zero_page = next_physical_frame();
+    frames.free_frames = 0;
+    frames.zero_page = frame_address(0);
     zero_frame(frames.zero_page);
-    mutex_init(&frames.lock);
+    // metadata for every frame including the zero page
+    int info_size = sizeof(frame_info_t) * (frames.total_frames + 1);
+    frames.info = smalloc(info_size);
+    if (frames.info == NULL) {
+        panic("Cannot allocate frame metadata");
+    }
+    memset(frames.info, 0, info_size);
+    memset(frames.magazines, 0, sizeof(frames.magazines));
+    for (i = 0; i < MAX_CPUS; i++) {
+        spinlock_init(&frames.magazines[i].lock);
+    }
+    for (i = 0; i <= frames.total_frames; i++) {
+        Q_INIT_ELEM(&frames.info[i], free_link);
+        frames.info[i].order = NOT_FREE;
+    }
+    for (order = 0; order <= MAX_FRAME_ORDER; order++) {
+        Q_INIT_HEAD(&frames.free_lists[order]);
+    }
+    // carve the frames after the zero page into the largest aligned blocks
+    for (i = 1; i <= frames.total_frames; i += 1 << order) {
+        order = 0;
+        while (order < MAX_FRAME_ORDER && (i & (1 << order)) == 0 &&
+                i + (2 << order) - 1 <= frames.total_frames) {
+            order++;
+        }
+        add_free_block(i, order);
+        frames.free_frames += 1 << order;
+    }
+    spinlock_init(&frames.lock);
+}
+
+/** @brief Give the frames in every magazine back to the buddy allocator
+ *
+ *  Called when memory has run out, so that frames cached by other
+ *  processors, zeroed or not, can be used. Must be called with no magazine
+ *  or frame allocator lock held.
+ *
+ *  @return The number of frames given back
+ **/
+static int drain_magazines()
+{
+    int i, drained = 0;
+    uint32_t eflags = get_eflags();
+    disable_interrupts();
+    for (i = 0; i < num_cpus(); i++) {
+        magazine_t* magazine = &frames.magazines[i];
+        spin_lock(&magazine->lock);
+        spin_lock(&frames.lock);
+        while (magazine->count > 0) {
+            void* frame = magazine->frames[--magazine->count];
+            buddy_free(frame_index(frame), 0);
+            drained++;
+        }
+        while (magazine->zeroed_count > 0) {
+            void* frame = magazine->zeroed[--magazine->zeroed_count];
+            buddy_free(frame_index(frame), 0);
+            drained++;
+        }
+        spin_unlock(&frames.lock);
+        spin_unlock(&magazine->lock);
+    }
+    set_eflags(eflags);
+    return drained;
 }
 
-/** @brief Allocates a frame
+/** @brief Allocate a physically contiguous block of frames
  *
- *  Allocates an unreserved frame
+ *  Every frame in the block starts with one reference. The block is aligned
+ *  to its own size in physical memory.
  *
- *  @return A pointer to the frame or NULL if there are no frames left
+ *  @param order The block has 2^order frames
+ *  @return The physical address of the block or NULL if there is none
  **/
-int alloc_frame(void* virtual, entry_t* table, entry_t model)
+void* alloc_frame_block(int order)
 {
-    mutex_lock(&frames.lock);
+    int i;
+    if (order < 0 || order > MAX_FRAME_ORDER) {
+        return NULL;
+    }
+    uint32_t eflags = lock_frames();
+    int index = buddy_alloc(order);
+    unlock_frames(eflags);
+    if (index < 0) {
+        // frames cached by the processors may complete a block
+        if (drain_magazines() == 0) {
+            return NULL;
+        }
+        return alloc_frame_block(order);
+    }
+    for (i = 0; i < (1 << order); i++) {
+        frames.info[index + i].references = 1;
+    }
+    return frame_address(index);
+}
+
+/** @brief Free a block allocated with alloc_frame_block
+ *
+ *  @param physical The physical address of the block
+ *  @param order The order the block was allocated with
+ *  @return void
+ **/
+void free_frame_block(void* physical, int order)
+{
+    int i, index = frame_index(physical);
+    for (i = 0; i < (1 << order); i++) {
+        frames.info[index + i].references = 0;
+    }
+    uint32_t eflags = lock_frames();
+    buddy_free(index, order);
+    unlock_frames(eflags);
+}
+
+/** @brief Zero every frame of a block through the identity mapping
+ *
+ *  Interrupts are disabled while frames are zeroed, since the current page
+ *  directory is not the one which the thread expects, but are restored after
+ *  every batch of frames so a large block does not hold them off for long.
+ *
+ *  @param physical The physical address of the block
+ *  @param order The block has 2^order frames
+ *  @return void
+ **/
+void zero_frame_block(void* physical, int order)
+{
+    int i, j;
+    uint32_t dir = get_cr3();
+    uint32_t eflags = get_eflags();
+    char* frame = physical;
+    for (i = 0; i < (1 << order); i += FRAME_BATCH_SIZE) {
+        disable_interrupts();
+        set_cr3((uint32_t)virtual_memory.identity);
+        for (j = i; j < i + FRAME_BATCH_SIZE && j < (1 << order); j++) {
+            zero_frame(frame + j * PAGE_SIZE);
+        }
+        set_cr3(dir);
+        set_eflags(eflags);
+    }
+}
+
+/** @brief Allocate frames for a batch, taking the frame lock once
+ *
+ *  Frames are taken from a single block when possible so that a batch is
+ *  physically contiguous. Fewer frames than asked for are allocated if
+ *  memory is low.
+ *
+ *  @param batch The batch to fill
+ *  @param count The number of frames to allocate, at most FRAME_BATCH_SIZE
+ *  @return The number of frames allocated
+ **/
+int alloc_frame_batch(frame_batch_t* batch, int count)
+{
+    int i, order = 0;
+    assert(count <= FRAME_BATCH_SIZE);
+    while ((1 << order) < count) {
+        order++;
+    }
+    batch->count = 0;
+    uint32_t eflags = lock_frames();
+    while (batch->count < count) {
+        // fall back to smaller blocks as memory runs out
+        int index = -1;
+        while (order >= 0 && (index = buddy_alloc(order)) < 0) {
+            order--;
+        }
+        if (index < 0) {
+            break;
+        }
+        for (i = 0; i < (1 << order); i++) {
+            if (batch->count < count) {
+                batch->frames[batch->count++] = frame_address(index + i);
+            } else {
+                buddy_free(index + i, 0);
+            }
+        }
+    }
+    unlock_frames(eflags);
+    for (i = 0; i < batch->count; i++) {
+        *frame_references(batch->frames[i]) = 1;
+    }
+    return batch->count;
+}
+
+/** @brief Free every frame in a batch, taking the frame lock once
+ *
+ *  @param batch The batch to free, which is emptied
+ *  @return void
+ **/
+void free_frame_batch(frame_batch_t* batch)
+{
+    int i;
+    if (batch->count == 0) {
+        return;
+    }
+    uint32_t eflags = lock_frames();
+    for (i = 0; i < batch->count; i++) {
+        *frame_references(batch->frames[i]) = 0;
+        buddy_free(frame_index(batch->frames[i]), 0);
+    }
+    unlock_frames(eflags);
+    batch->count = 0;
+}
+
+/** @brief Take the magazine of the current processor
+ *
+ *  Interrupts are disabled until the magazine is released, so the thread
+ *  cannot move to another processor while it uses the magazine.
+ *
+ *  @param eflags Where to save the interrupt flag
+ *  @return The magazine
+ **/
+static magazine_t* lock_magazine(uint32_t* eflags)
+{
+    *eflags = get_eflags();
+    disable_interrupts();
+    magazine_t* magazine = &frames.magazines[get_cpu()->id];
+    spin_lock(&magazine->lock);
+    return magazine;
+}
+
+/** @brief Release a magazine taken with lock_magazine
+ *
+ *  @param magazine The magazine
+ *  @param eflags The interrupt flag saved by lock_magazine
+ *  @return void
+ **/
+static void unlock_magazine(magazine_t* magazine, uint32_t eflags)
+{
+    spin_unlock(&magazine->lock);
+    set_eflags(eflags);
+}
+
+/** @brief Take a frame from a magazine, refilling it if it is empty
+ *
+ *  Must be called with the magazine locked
+ *
+ *  @param magazine The magazine
+ *  @return The physical address of the frame or NULL if the magazine is
+ *          empty and there are no free frames left
+ **/
+static void* take_cached_frame(magazine_t* magazine)
+{
+    int index;
+    if (magazine->count == 0) {
+        spin_lock(&frames.lock);
+        while (magazine->count < MAGAZINE_BATCH &&
+                (index = buddy_alloc(0)) >= 0) {
+            magazine->frames[magazine->count++] = frame_address(index);
+        }
+        spin_unlock(&frames.lock);
+    }
+    if (magazine->count == 0) {
+        return NULL;
+    }
+    return magazine->frames[--magazine->count];
+}
+
+/** @brief Allocate a single frame using the current processor's magazine
+ *
+ *  @return The physical address of the frame or NULL if there are none left
+ **/
+static void* alloc_single_frame()
+{
+    uint32_t eflags;
+    magazine_t* magazine = lock_magazine(&eflags);
+    void* physical = take_cached_frame(magazine);
+    unlock_magazine(magazine, eflags);
+    if (physical == NULL) {
+        // other processors may still be holding free frames
+        if (drain_magazines() > 0) {
+            return alloc_single_frame();
+        }
+        return NULL;
+    }
+    *frame_references(physical) = 1;
+    return physical;
+}
+
+/** @brief Free a single frame to the current processor's magazine
+ *
+ *  @param physical The physical address of the frame
+ *  @return void
+ **/
+static void free_single_frame(void* physical)
+{
+    uint32_t eflags;
+    magazine_t* magazine = lock_magazine(&eflags);
+    if (magazine->count == MAGAZINE_SIZE) {
+        spin_lock(&frames.lock);
+        while (magazine->count > MAGAZINE_SIZE - MAGAZINE_BATCH) {
+            void* frame = magazine->frames[--magazine->count];
+            buddy_free(frame_index(frame), 0);
+        }
+        spin_unlock(&frames.lock);
+    }
+    magazine->frames[magazine->count++] = physical;
+    unlock_magazine(magazine, eflags);
+}
+
+/** @brief Take a frame for a single page, either from a batch or by itself
+ *
+ *  @param batch The batch to take from, or NULL
+ *  @return The physical address of the frame or NULL if there are none left
+ **/
+static void* take_frame(frame_batch_t* batch)
+{
+    if (batch == NULL) {
+        return alloc_single_frame();
+    }
+    if (batch->count == 0 &&
+            alloc_frame_batch(batch, FRAME_BATCH_SIZE) == 0) {
+        // the magazines may be holding the last free frames
+        return alloc_single_frame();
+    }
+    return batch->frames[--batch->count];
+}
+
+/** @brief Take a frame from the current processor's zero pool
+ *
+ *  @return The physical address of a zeroed frame or NULL if the pool is
+ *          empty
+ **/
+static void* take_zeroed_frame()
+{
+    void* physical = NULL;
+    uint32_t eflags;
+    magazine_t* magazine = lock_magazine(&eflags);
+    if (magazine->zeroed_count > 0) {
+        physical = magazine->zeroed[--magazine->zeroed_count];
+        magazine->hits++;
+    } else {
+        magazine->misses++;
+    }
+    unlock_magazine(magazine, eflags);
+    if (physical != NULL) {
+        *frame_references(physical) = 1;
+    }
+    return physical;
+}
+
+/** @brief Allocates a zeroed frame for a page
+ *
+ *  Frames are taken from the zero pool when possible. Otherwise the frame is
+ *  mapped kernel only while it is being zeroed so that its old contents can
+ *  never be seen by the user.
+ *
+ *  @param virtual The virtual address of the page
+ *  @param table The page table entry for the page
+ *  @param model The entry to use for the page
+ *  @param batch A batch of frames to take the frame from, or NULL
+ *  @return Zero on success, less than zero if there are no frames left
+ **/
+int alloc_frame(void* virtual, entry_t* table, entry_t model,
+                frame_batch_t* batch)
+{
+    void* physical = take_zeroed_frame();
+    if (physical != NULL) {
+        *table = create_entry(physical, model);
+        invalidate_page(virtual);
+        return 0;
+    }
+    physical = take_frame(batch);
+    if (physical == NULL) {
+        return -1;
+    }
     // save the user attribute of the model
     int user_page = model.user;
     int zfod_page = model.zfod;
     // we want kernel mode while we map to prevent info leaks
     model.user = 0;
     model.zfod = 1;
-    if (frames.next_frame != 0) {
-        //allocate from implicit frame list
-        *table = create_entry(frames.next_frame, model);
-        // map it in kernel mode so we can zero it
-        invalidate_page((void*)virtual);
-        //retreive the implicit frame pointer
-        frames.next_frame = *((uint32_t**)virtual);
-    } else {
-        void* physical = next_physical_frame();
-        if (physical == NULL) {
-            mutex_unlock(&frames.lock);
-            return -1;
-        }
-        //allocate from physical frame list
-        *table = create_entry(physical, model);
-        // map it in kernel mode so we can zero it
-        invalidate_page((void*)virtual);
-    }
-    frames.free_frames--;
-    mutex_unlock(&frames.lock);
+    *table = create_entry(physical, model);
+    invalidate_page(virtual);
     zero_frame(virtual);
     // reset the user flag
     table->user = user_page;
     table->zfod = zfod_page;
     // now that the frame is zeroed others can read it
-    invalidate_page((void*)virtual);
+    invalidate_page(virtual);
     return 0;
 }
 
-/** @brief Allocates a frame
+/** @brief Zero a frame which is not mapped through the identity mapping
  *
- *  Allocates an unreserved frame
+ *  Interrupts are disabled while it is zeroed, since the current page
+ *  directory is not the one which the thread expects.
  *
- *  @return A pointer to the frame or NULL if there are no frames left
+ *  @param physical The physical address of the frame
+ *  @return void
  **/
-int kernel_alloc_frame(entry_t* table, entry_t model)
+static void zero_unmapped_frame(void* physical)
 {
-    mutex_lock(&frames.lock);
-    uint32_t* physical;
-    if (frames.next_frame != 0) {
-        //allocate from implicit frame list
-        physical = frames.next_frame;
-        *table = create_entry(physical, model);
-        //retreive the implicit frame pointer
-        frames.next_frame = (uint32_t*)*physical;
-    } else {
-        physical = next_physical_frame();
+    uint32_t dir = get_cr3();
+    uint32_t eflags = get_eflags();
+    disable_interrupts();
+    set_cr3((uint32_t)virtual_memory.identity);
+    zero_frame(physical);
+    set_cr3(dir);
+    set_eflags(eflags);
+}
+
+/** @brief Allocate a zeroed frame for a page directory which is not loaded
+ *
+ *  @param batch A batch of frames to take the frame from, or NULL
+ *  @return The physical address of the frame or NULL if there are none left
+ **/
+void* alloc_unmapped_frame(frame_batch_t* batch)
+{
+    void* physical = take_zeroed_frame();
+    if (physical != NULL) {
+        return physical;
+    }
+    physical = take_frame(batch);
+    if (physical != NULL) {
+        zero_unmapped_frame(physical);
+    }
+    return physical;
+}
+
+/** @brief Copy a kernel buffer into a frame through the identity mapping
+ *
+ *  @param physical The physical address of the frame
+ *  @param offset The offset in the frame to copy to
+ *  @param buffer The buffer to copy from, in kernel memory
+ *  @param len The number of bytes to copy, which must fit in the frame
+ *  @return void
+ **/
+void write_unmapped_frame(void* physical, uint32_t offset, void* buffer,
+                          uint32_t len)
+{
+    assert(offset + len <= PAGE_SIZE);
+    uint32_t dir = get_cr3();
+    uint32_t eflags = get_eflags();
+    disable_interrupts();
+    set_cr3((uint32_t)virtual_memory.identity);
+    memcpy((char*)physical + offset, buffer, len);
+    set_cr3(dir);
+    set_eflags(eflags);
+}
+
+/** @brief Zero some free frames and add them to this processor's zero pool
+ *
+ *  Called by idle threads with interrupts enabled. Frames are zeroed through
+ *  the identity mapping, a few at a time so that an idle processor notices
+ *  new work quickly. A timer interrupt which arrives during the refill does
+ *  not start another one.
+ *
+ *  @return void
+ **/
+void refill_zero_pool()
+{
+    int i;
+    uint32_t eflags;
+    magazine_t* magazine = lock_magazine(&eflags);
+    int refilling = magazine->refilling;
+    magazine->refilling = 1;
+    unlock_magazine(magazine, eflags);
+    if (refilling) {
+        return;
+    }
+    // the idle thread never changes processors, so this stays our magazine
+    for (i = 0; i < ZERO_POOL_REFILL; i++) {
+        void* physical = NULL;
+        magazine = lock_magazine(&eflags);
+        if (magazine->zeroed_count < ZERO_POOL_SIZE) {
+            physical = take_cached_frame(magazine);
+        }
+        unlock_magazine(magazine, eflags);
         if (physical == NULL) {
-            mutex_unlock(&frames.lock);
-            return -1;
+            break;
         }
-        //allocate from physical frame list
-        *table = create_entry(physical, model);
+        zero_unmapped_frame(physical);
+        magazine = lock_magazine(&eflags);
+        magazine->zeroed[magazine->zeroed_count++] = physical;
+        unlock_magazine(magazine, eflags);
     }
-    frames.free_frames--;
-    mutex_unlock(&frames.lock);
-    zero_frame(physical);
+    magazine = lock_magazine(&eflags);
+    magazine->refilling = 0;
+    unlock_magazine(magazine, eflags);
+}
+
+/** @brief Log statistics about the frame allocator
+ *
+ *  @return void
+ **/
+void frame_alloc_stats()
+{
+    int i, cached = 0, zeroed = 0, hits = 0, misses = 0;
+    for (i = 0; i < num_cpus(); i++) {
+        magazine_t* magazine = &frames.magazines[i];
+        cached += magazine->count;
+        zeroed += magazine->zeroed_count;
+        hits += magazine->hits;
+        misses += magazine->misses;
+    }
+    lprintf("frames: %d of %d free, %d in magazines", frames.free_frames,
+            frames.total_frames, cached);
+    lprintf("zero pool: %d frames, %d hits, %d misses", zeroed, hits, misses);
+}
+
+/** @brief Gives a copy on write page its own writeable frame
+ *
+ *  If the frame is no longer shared it is simply made writeable, otherwise
+ *  its contents are copied to a new frame using the identity mapping. The
+ *  copy is done with interrupts disabled since the current page directory
+ *  is not the one which the thread expects.
+ *
+ *  @param virtual The virtual address of the copy on write page
+ *  @param table The page table entry for the page
+ *  @param model The entry to use for the writeable page
+ *  @return Zero on success, less than zero if there are no frames left
+ **/
+int copy_on_write_frame(void* virtual, entry_t* table, entry_t model)
+{
+    void* shared = get_entry_address(*table);
+    // nobody else can gain a reference to the frame, so it is ours
+    if (!is_shared_frame(shared)) {
+        *table = create_entry(shared, model);
+        invalidate_page(virtual);
+        return 0;
+    }
+    void* physical = alloc_single_frame();
+    if (physical == NULL) {
+        return -1;
+    }
+    uint32_t dir = get_cr3();
+    uint32_t eflags = get_eflags();
+    disable_interrupts();
+    set_cr3((uint32_t)virtual_memory.identity);
+    memcpy(physical, shared, PAGE_SIZE);
+    set_cr3(dir);
+    set_eflags(eflags);
+    // if everyone else let go while we were copying we free the frame
+    free_frame(shared, NULL);
+    *table = create_entry(physical, model);
+    invalidate_page(virtual);
     return 0;
 }
 
-/** @brief Frees an allocated frame allowing it to be reused
+/** @brief Drops a reference to a frame, freeing it if it was the last
  *
- *  @param virtual The virtual address of the frame to free
- *  @param physical The physical address of the frame to free
+ *  @param physical The physical address of the frame
+ *  @param batch A batch to collect the frame in if it is freed, or NULL to
+ *         free it right away. A full batch is freed first.
  *  @return void
  **/
-void free_frame(void* virtual, void* physical)
+void free_frame(void* physical, frame_batch_t* batch)
 {
-    mutex_lock(&frames.lock);
-    uint32_t** frame_ptr = virtual;
-    //save the next frame pointer to this page using the current address
-    *frame_ptr = frames.next_frame;
-    //save the physical address to this frame as the next frame pointer
-    frames.next_frame = physical;
-    frames.free_frames++;
-    mutex_unlock(&frames.lock);
+    if (atomic_xadd(frame_references(physical), -1) > 1) {
+        return;
+    }
+    if (batch == NULL) {
+        free_single_frame(physical);
+        return;
+    }
+    if (batch->count == FRAME_BATCH_SIZE) {
+        free_frame_batch(batch);
+    }
+    batch->frames[batch->count++] = physical;
 }
@@ -75,6 +75,68 @@ uint32_t page_align(uint32_t address)
     return address & (~(PAGE_SIZE - 1));
 }
 
+/** @brief Set the largest number of pages populated after a fault
+ *
+ *  Must be called with the ppd lock held
+ *
+ *  @param ppd The page directory of the process
+ *  @param pages The number of pages, zero turns populating pages off
+ *  @return The previous number of pages on success, less than zero if the
+ *          number is out of range
+ **/
+int vm_set_fault_around(ppd_t* ppd, int pages)
+{
+    if (pages < 0 || pages > MAX_FAULT_AROUND) {
+        return -1;
+    }
+    int old = ppd->faults.max_window;
+    ppd->faults.max_window = pages;
+    ppd->faults.window = 0;
+    return old;
+}
+
+/** @brief Populate the pages following a zfod fault if faults are sequential
+ *
+ *  A fault on the page next to the last one populated doubles the number
+ *  of pages populated, up to the limit of the process, and any other fault
+ *  resets it. Pages are populated in the direction of the faults, so stacks
+ *  growing down benefit too, and only up to the first page which is not a
+ *  writeable zfod page, so they stay inside the faulting allocation.
+ *
+ *  @param ppd The page directory of the process with the fault
+ *  @param page The page which was just backed by a frame
+ *  @return void
+ **/
+static void fault_around(ppd_t* ppd, uint32_t page)
+{
+    int i;
+    fault_state_t* faults = &ppd->faults;
+    int32_t stride = page - faults->last_page;
+    faults->last_page = page;
+    if (stride != PAGE_SIZE && stride != -PAGE_SIZE) {
+        faults->window = 0;
+        return;
+    }
+    faults->window = faults->window == 0 ? 1 : 2 * faults->window;
+    if (faults->window > faults->max_window) {
+        faults->window = faults->max_window;
+    }
+    frame_batch_t batch = { .count = 0 };
+    for (i = 0; i < faults->window; i++) {
+        uint32_t next = faults->last_page + stride;
+        entry_t* table, *dir;
+        if (vm_get_address(ppd, (void*)next, &table, &dir) < 0 ||
+                !is_user(table, dir) || !is_zfod(table) || !table->zfod) {
+            break;
+        }
+        if (alloc_frame((void*)next, table, e_write_page, &batch) < 0) {
+            break;
+        }
+        faults->last_page = next;
+    }
+    free_frame_batch(&batch);
+}
+
 /** @brief Resolve a pagefault if possible
  *
  *  @param ppd The page directory of the process with the fault
@@ -85,6 +147,7 @@ uint32_t page_align(uint32_t address)
 int vm_resolve_pagefault(ppd_t* ppd, uint32_t cr2, int error_code)
 {
     page_fault_t error = AS_TYPE(error_code, page_fault_t);
+    ppd->faults.count++;
     // If things we don't deal with
     if (reserved_or_fetch(error, cr2) < 0) {
         return -1;
@@ -106,6 +169,15 @@ int vm_resolve_pagefault(ppd_t* ppd, uint32_t cr2, int error_code)
         // note that the process may well have thought that the page wasnt
         // present, or was kernel only at the time of the fault
         DPRINTF("Access to %lx faulted, but seems to be cool now", cr2);
+        invalidate_page((void *)page_align(cr2));
+        return 0;
+    }
+    if (table->cow) {
+        uint32_t page = page_align(cr2);
+        if (copy_on_write_frame((void *)page, table, e_write_page) < 0) {
+            return -1;
+        }
+        tlb_shootdown(ppd);
         return 0;
     }
     if (!table->zfod) {
@@ -118,7 +190,9 @@ int vm_resolve_pagefault(ppd_t* ppd, uint32_t cr2, int error_code)
     // error.write > table.write
     if (error.write && !table->write) {
         uint32_t page = page_align(cr2);
-        alloc_frame((void *)page, table, e_write_page);
+        alloc_frame((void *)page, table, e_write_page, NULL);
+        fault_around(ppd, page);
+        tlb_shootdown(ppd);
         return 0;
     }
     return -1;
@@ -15,9 +15,22 @@
 #include <malloc.h>
 #include <control_block.h>
 #include <asm.h>
-#include <malloc_internal.h>
 #include <assert.h>
-#include <malloc_wrappers.h>
+#include <cpu.h>
+#include <obj_cache.h>
+
+/** @brief Cache of allocation records */
+static obj_cache_t alloc_cache;
+
+/** @brief Initialize the cache of allocation records
+ *
+ *  @return void
+ **/
+void init_alloc_cache()
+{
+    cache_init(&alloc_cache, "alloc", sizeof(alloc_t), sizeof(void*), NULL,
+               NULL, 0);
+}
 
 /** @brief Initialize a process page directory
  *
@@ -25,7 +38,7 @@
  **/
 ppd_t* init_ppd()
 {
-    ppd_t* ppd = malloc(sizeof(ppd_t));
+    ppd_t* ppd = smalloc(sizeof(ppd_t));
     if (ppd == NULL) {
         return NULL;
     }
@@ -33,6 +46,10 @@ ppd_t* init_ppd()
         sfree(ppd, sizeof(ppd_t));
         return NULL;
     }
+    ppd->faults.last_page = 0;
+    ppd->faults.window = 0;
+    ppd->faults.max_window = DEFAULT_FAULT_AROUND;
+    ppd->faults.count = 0;
     mutex_init(&ppd->lock);
     if ((ppd->dir = alloc_page_directory()) == NULL) {
         mutex_destroy(&ppd->lock);
@@ -61,7 +78,7 @@ void copy_alloc(alloc_t* to, alloc_t* from)
  **/
 void free_alloc(alloc_t* alloc)
 {
-    sfree(alloc, sizeof(alloc_t));
+    cache_free(&alloc_cache, alloc);
 }
 
 /** @brief Record an allocation to this ppd
@@ -73,7 +90,7 @@ void free_alloc(alloc_t* alloc)
  **/
 int add_alloc(ppd_t* ppd, void* start, uint32_t size)
 {
-    alloc_t* new_alloc = (alloc_t*)smalloc(sizeof(alloc_t));
+    alloc_t* new_alloc = (alloc_t*)cache_alloc(&alloc_cache);
     if (new_alloc == NULL) {
         return -1;
     }
@@ -114,22 +131,29 @@ int copy_alloc_list(ppd_t* to, ppd_t* from)
     int success = 1;
     H_FOREACH(i, alloc, &from->alloc_table, list)
     {
-        alloc_t* copy = malloc(sizeof(alloc_t));
-        Q_INIT_ELEM(copy, list);
+        alloc_t* copy = cache_alloc(&alloc_cache);
         if (copy == NULL) {
             success = 0;
             break;
         }
+        // frames are copied on write, so the copy must be able to back them
+        if (reserve_frames((void*)alloc->start, alloc->size) < 0) {
+            free_alloc(copy);
+            success = 0;
+            break;
+        }
+        Q_INIT_ELEM(copy, list);
         copy_alloc(copy, alloc);
         H_INSERT(&to->alloc_table, copy, start, list);
     }
     if (success) {
         return 0;
     }
-    // free the hash table memory
+    // free the hash table memory and the reserved frames
     alloc_t* swap;
     H_FOREACH_SAFE(i, alloc, swap, &to->alloc_table, list)
     {
+        release_frames((void*)alloc->start, alloc->size);
         free_alloc(alloc);
     }
     H_FREE_TABLE(&to->alloc_table);
@@ -156,12 +180,14 @@ void free_ppd_user_mem(ppd_t* to_free)
     H_FREE_TABLE(&to_free->alloc_table);
 }
 
-/** @brief Free all kernel memory associated with this ppd without locks
+/** @brief Free all kernel memory associated with this ppd
+ *
+ *  Never blocks, so that idle threads can reap exited processes
  *
  *  @param to_free The ppd to free
  *  @return void
  **/
-void _free_ppd_kernel_mem(ppd_t* to_free)
+void free_ppd_kernel_mem(ppd_t* to_free)
 {
     int i;
     page_directory_t* dir = to_free->dir;
@@ -173,22 +199,10 @@ void _free_ppd_kernel_mem(ppd_t* to_free)
             continue;
         }
         void* addr = get_entry_address(*dir_entry);
-        _sfree(addr, PAGE_SIZE);
+        sfree(addr, PAGE_SIZE);
     }
-    _sfree(to_free->dir, PAGE_SIZE);
-    _sfree(to_free, sizeof(ppd_t));
-}
-
-/** @brief Free all kernel memory associated with this ppd
- *
- *  @param to_free The ppd to free
- *  @return void
- **/
-void free_ppd_kernel_mem(ppd_t* to_free)
-{
-    acquire_malloc();
-    _free_ppd_kernel_mem(to_free);
-    release_malloc();
+    sfree(to_free->dir, PAGE_SIZE);
+    sfree(to_free, sizeof(ppd_t));
 }
 
 /** @brief Switch dir and ppd
@@ -230,6 +244,8 @@ void free_ppd(ppd_t* to_free, ppd_t* current)
  **/
 void switch_ppd(ppd_t* ppd)
 {
+    // shootdowns read this, so it must be written before cr3 is loaded
+    get_cpu()->dir = ppd->dir;
     set_cr3((uint32_t)ppd->dir);
 }
 
@@ -246,6 +262,7 @@ ppd_t* init_ppd_from(ppd_t* from)
     if (ppd == NULL) {
         return NULL;
     }
+    ppd->faults.max_window = from->faults.max_window;
     //copy over list of allocations
     if (copy_alloc_list(ppd, from) < 0) {
         free_ppd_kernel_mem(ppd);
@@ -258,6 +275,8 @@ ppd_t* init_ppd_from(ppd_t* from)
     switch_dir_ppd(from, virtual_memory.identity);
     int status = copy_page_dir(ppd->dir, from_dir);
     switch_dir_ppd(from, from_dir);
+    // writeable pages of the parent are now copy on write
+    tlb_shootdown(from);
 
     if (status < 0) {
         free_ppd(ppd, from);
@@ -0,0 +1,366 @@
+/** @file program_cache.c
+ *
+ *  @brief A cache of the pages of the programs built into the kernel
+ *
+ *  The first exec of a program copies the pages its .text, .rodata and
+ *  .data sections are loaded into from the embedded image into frames which
+ *  the cache keeps for good. Every exec of the program then maps those
+ *  frames instead of copying the sections again. Pages holding only
+ *  read-only sections are mapped read only and pages holding .data or .bss
+ *  are mapped copy on write, so a process only gets its own copy of the
+ *  pages it writes to. Each mapping adds a reference to the frame, and the
+ *  reference the cache holds keeps frames shared, so they are always copied
+ *  rather than taken over on a write.
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs.
+ **/
+
+#include <vm.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <limits.h>
+#include <asm.h>
+#include <cr.h>
+#include <eflags.h>
+#include <exec_index.h>
+#include "vm_internal.h"
+
+/** @brief The number of sections copied from a program image */
+#define IMAGE_SECTIONS 3
+
+/** @brief A section copied from a program image */
+typedef struct image_section {
+    uint32_t start;
+    uint32_t len;
+    const char* bytes;
+} image_section_t;
+
+/** @brief The pages of a program shared by every process running it
+ *
+ *  Pages which hold none of the copied sections have no frame.
+ **/
+typedef struct program_image {
+    uint32_t start;
+    int pages;
+    void* frames[];
+} program_image_t;
+
+/** @brief The arguments to map_image_h */
+typedef struct image_map {
+    program_image_t* image;
+    simple_elf_t* elf;
+} image_map_t;
+
+/** @brief Structure for the program cache */
+static struct {
+    program_image_t** images;
+    mutex_t lock;
+} programs;
+
+/** @brief Initialize the program cache
+ *
+ *  @return void
+ **/
+void init_program_cache()
+{
+    size_t size = exec2obj_userapp_count * sizeof(program_image_t*);
+    programs.images = smalloc(size);
+    if (programs.images == NULL) {
+        panic("Cannot allocate the program cache");
+    }
+    memset(programs.images, 0, size);
+    mutex_init(&programs.lock);
+}
+
+/** @brief Does a page overlap part of a section
+ *
+ *  @param page The page aligned address of the page
+ *  @param start The start of the section
+ *  @param len The length of the section
+ *  @return A boolean integer
+ **/
+static int overlaps(uint32_t page, uint32_t start, uint32_t len)
+{
+    return len > 0 && start < page + PAGE_SIZE && page < start + len;
+}
+
+/** @brief Does a page hold part of any section copied from a program image
+ *
+ *  @param page The page aligned address of the page
+ *  @param sections The sections copied from the program image
+ *  @return A boolean integer
+ **/
+static int is_loaded(uint32_t page, image_section_t sections[IMAGE_SECTIONS])
+{
+    int i;
+    for (i = 0; i < IMAGE_SECTIONS; i++) {
+        if (overlaps(page, sections[i].start, sections[i].len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** @brief Get the sections of a program which are copied from its image
+ *
+ *  Sections are cut short at the end of the image, like getbytes does.
+ *
+ *  @param entry The program in the exec index
+ *  @param elf The elf information of the program
+ *  @param sections Where to store the sections
+ *  @return void
+ **/
+static void get_sections(const exec_entry_t* entry, simple_elf_t* elf,
+                         image_section_t sections[IMAGE_SECTIONS])
+{
+    int i;
+    uint32_t offsets[IMAGE_SECTIONS] = { elf->e_txtoff, elf->e_rodatoff,
+                                         elf->e_datoff };
+    sections[0].start = elf->e_txtstart;
+    sections[0].len = elf->e_txtlen;
+    sections[1].start = elf->e_rodatstart;
+    sections[1].len = elf->e_rodatlen;
+    sections[2].start = elf->e_datstart;
+    sections[2].len = elf->e_datlen;
+    for (i = 0; i < IMAGE_SECTIONS; i++) {
+        uint32_t left = 0;
+        if (offsets[i] < (uint32_t)entry->len) {
+            left = entry->len - offsets[i];
+        }
+        if (sections[i].len > left) {
+            sections[i].len = left;
+        }
+        sections[i].bytes = entry->bytes + offsets[i];
+    }
+}
+
+/** @brief Fill a frame with the parts of the sections loaded into a page
+ *
+ *  The frame is written through the identity mapping with interrupts
+ *  disabled, since the current page directory is not the one which the
+ *  thread expects. The interrupt flag is restored rather than set, since
+ *  programs are loaded during boot.
+ *
+ *  @param physical The physical address of the frame
+ *  @param page The page aligned address the frame is mapped at
+ *  @param sections The sections copied from the program image
+ *  @return void
+ **/
+static void fill_frame(void* physical, uint32_t page,
+                       image_section_t sections[IMAGE_SECTIONS])
+{
+    int i;
+    uint32_t eflags = get_eflags();
+    uint32_t dir = get_cr3();
+    disable_interrupts();
+    set_cr3((uint32_t)virtual_memory.identity);
+    zero_frame(physical);
+    for (i = 0; i < IMAGE_SECTIONS; i++) {
+        image_section_t* section = &sections[i];
+        if (!overlaps(page, section->start, section->len)) {
+            continue;
+        }
+        uint32_t low = section->start > page ? section->start : page;
+        uint32_t high = section->start + section->len;
+        if (high > page + PAGE_SIZE) {
+            high = page + PAGE_SIZE;
+        }
+        memcpy((char*)physical + (low - page),
+               section->bytes + (low - section->start), high - low);
+    }
+    set_cr3(dir);
+    set_eflags(eflags);
+}
+
+/** @brief Drop the frames of a program image which was not finished
+ *
+ *  @param image The program image
+ *  @param frames The number of frames reserved for the image
+ *  @return void
+ **/
+static void free_image(program_image_t* image, int frames)
+{
+    int i;
+    frame_batch_t batch = { .count = 0 };
+    for (i = 0; i < image->pages; i++) {
+        if (image->frames[i] != NULL) {
+            free_frame(image->frames[i], &batch);
+        }
+    }
+    free_frame_batch(&batch);
+    release_frames(NULL, frames * PAGE_SIZE);
+    free(image);
+}
+
+/** @brief Copy the pages of a program into new frames
+ *
+ *  @param entry The program in the exec index
+ *  @param elf The elf information of the program
+ *  @return The program image, or NULL if there was not enough memory
+ **/
+static program_image_t* build_image(const exec_entry_t* entry,
+                                    simple_elf_t* elf)
+{
+    int i, frames = 0;
+    image_section_t sections[IMAGE_SECTIONS];
+    get_sections(entry, elf, sections);
+    uint32_t start = UINT_MAX, end = 0;
+    for (i = 0; i < IMAGE_SECTIONS; i++) {
+        if (sections[i].len == 0) {
+            continue;
+        }
+        if (sections[i].start < start) {
+            start = sections[i].start;
+        }
+        if (sections[i].start + sections[i].len > end) {
+            end = sections[i].start + sections[i].len;
+        }
+    }
+    int pages = 0;
+    if (end > 0) {
+        start = page_align(start);
+        pages = DIVIDE_ROUND_UP(end - start, PAGE_SIZE);
+    }
+    program_image_t* image = malloc(sizeof(program_image_t) +
+                                    pages * sizeof(void*));
+    if (image == NULL) {
+        return NULL;
+    }
+    image->start = start;
+    image->pages = pages;
+    for (i = 0; i < pages; i++) {
+        uint32_t page = start + i * PAGE_SIZE;
+        image->frames[i] = NULL;
+        if (is_loaded(page, sections)) {
+            frames++;
+        }
+    }
+    // the cache keeps its frames, so no process may count on them
+    if (frames > 0 && reserve_frames(NULL, frames * PAGE_SIZE) < 0) {
+        free(image);
+        return NULL;
+    }
+    frame_batch_t batch = { .count = 0 };
+    for (i = 0; i < pages; i++) {
+        uint32_t page = start + i * PAGE_SIZE;
+        if (!is_loaded(page, sections)) {
+            continue;
+        }
+        if (batch.count == 0 &&
+                alloc_frame_batch(&batch, FRAME_BATCH_SIZE) == 0) {
+            free_image(image, frames);
+            return NULL;
+        }
+        image->frames[i] = batch.frames[--batch.count];
+        fill_frame(image->frames[i], page, sections);
+    }
+    free_frame_batch(&batch);
+    return image;
+}
+
+/** @brief Get the cached pages of a program, building them on first use
+ *
+ *  @param elf The elf information of the program
+ *  @return The program image, or NULL on failure
+ **/
+static program_image_t* get_image(simple_elf_t* elf)
+{
+    const exec_entry_t* entry = find_exec(elf->e_fname);
+    if (entry == NULL) {
+        return NULL;
+    }
+    // images are never freed, so one which has been published can be used
+    program_image_t* image = programs.images[entry->index];
+    if (image != NULL) {
+        return image;
+    }
+    mutex_lock(&programs.lock);
+    if ((image = programs.images[entry->index]) == NULL) {
+        image = build_image(entry, elf);
+        programs.images[entry->index] = image;
+    }
+    mutex_unlock(&programs.lock);
+    return image;
+}
+
+/** @brief Gets the cached frame of a page of a program
+ *
+ *  @param image The program image
+ *  @param page The page aligned address of the page
+ *  @return The physical address of the frame, or NULL if it has none
+ **/
+static void* image_frame(program_image_t* image, uint32_t page)
+{
+    if (page < image->start) {
+        return NULL;
+    }
+    uint32_t i = (page - image->start) / PAGE_SIZE;
+    if (i >= (uint32_t)image->pages) {
+        return NULL;
+    }
+    return image->frames[i];
+}
+
+/** @brief A vm_operator which maps the cached frame of a page of a program
+ *
+ *  Pages without a cached frame stay zfod, and are writeable only if they
+ *  hold part of .bss.
+ *
+ *  @param table The table entry for the current page
+ *  @param dir The directory entry for the current page
+ *  @param addr The virtual address of the current page
+ *  @param arg The image_map_t of the program
+ *  @return Zero to continue
+ **/
+static int map_image_h(entry_t* table, entry_t* dir, address_t addr,
+                       void* arg)
+{
+    image_map_t* map = arg;
+    simple_elf_t* elf = map->elf;
+    uint32_t page = AS_TYPE(addr, uint32_t);
+    int writeable = overlaps(page, elf->e_datstart, elf->e_datlen) ||
+                    overlaps(page, elf->e_bssstart, elf->e_bsslen);
+    void* frame = image_frame(map->image, page);
+    if (frame == NULL) {
+        if (!writeable) {
+            table->zfod = 0;
+            invalidate_page((void*)page);
+        }
+        return 0;
+    }
+    share_frame(frame);
+    *table = create_entry(frame, writeable ? e_cow_page : e_read_page);
+    invalidate_page((void*)page);
+    return 0;
+}
+
+/** @brief Map a program into memory allocated for it from the program cache
+ *
+ *  Pages holding .data or .bss are copy on write and the rest of the
+ *  program is read only. If a read only section shares a page with one
+ *  which is written, the whole page is copy on write, so at least the
+ *  program still runs.
+ *
+ *  @param ppd The user page directory
+ *  @param elf The elf information of the program
+ *  @param start The start of the zfod memory allocated for the program
+ *  @param size The size of the memory allocated for the program
+ *  @return Zero on success, less than zero on failure
+ **/
+int vm_map_program(ppd_t* ppd, struct simple_elf* elf, void* start,
+                   uint32_t size)
+{
+    image_map_t map = { .image = get_image(elf), .elf = elf };
+    if (map.image == NULL) {
+        return -1;
+    }
+    if (split_large_pages(ppd, start, size) < 0) {
+        return -1;
+    }
+    int status = vm_map_pages(ppd, start, size, map_image_h, &map);
+    tlb_shootdown(ppd);
+    return status;
+}
@@ -0,0 +1,76 @@
+/** @file tlb.c
+ *
+ *  @brief Functions to keep the TLBs of all processors consistent
+ *
+ *  When a thread changes page table entries other processors running
+ *  threads of the same process may still have the old entries cached. Those
+ *  processors are sent an interprocessor interrupt which reloads cr3, and
+ *  the sender waits until all of them have done so.
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs.
+ **/
+
+#include <vm.h>
+#include <cpu.h>
+#include <cr.h>
+#include <asm.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <smp/apic.h>
+#include "vm_internal.h"
+
+/** @brief State of the current shootdown */
+static struct {
+    spinlock_t lock;
+    volatile int pending;
+} shootdown = { { 0 }, 0 };
+
+/** @brief Flush the TLB entries for a page directory on all processors
+ *
+ *  Must be called with interrupts enabled, since two processors shooting
+ *  down at once must each be able to service the other's interrupt. The
+ *  processor calling this is expected to have invalidated its own entries.
+ *
+ *  @param ppd The page directory which was modified
+ *  @return void
+ **/
+void tlb_shootdown(ppd_t* ppd)
+{
+    int i;
+    if (num_cpus() == 1) {
+        return;
+    }
+    // taking the lock also orders the page table writes before the reads
+    // of each processor's page directory below
+    while (!spin_trylock(&shootdown.lock)) {
+        continue;
+    }
+    disable_interrupts();
+    int self = get_cpu()->id;
+    for (i = 0; i < num_cpus(); i++) {
+        cpu_t* cpu = get_cpu_by_id(i);
+        if (i == self || cpu->dir != ppd->dir) {
+            continue;
+        }
+        atomic_xadd(&shootdown.pending, 1);
+        apic_ipi_cpu(i, TLB_SHOOTDOWN_IDT_ENTRY);
+    }
+    enable_interrupts();
+    while (shootdown.pending > 0) {
+        continue;
+    }
+    spin_unlock(&shootdown.lock);
+}
+
+/** @brief Handle a shootdown request from another processor
+ *
+ *  @return void
+ **/
+void tlb_shootdown_interrupt()
+{
+    set_cr3(get_cr3());
+    atomic_xadd(&shootdown.pending, -1);
+    apic_eoi();
+}
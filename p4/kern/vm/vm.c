@@ -16,6 +16,7 @@
 #include <vm.h>
 #include <malloc.h>
 #include <cr.h>
+#include <smp/apic.h>
 #include "vm_internal.h"
 
 COMPILE_TIME_ASSERT(sizeof(address_t) == sizeof(uint32_t));
@@ -46,12 +47,43 @@ const entry_t e_kernel_global = {
     .global = 1,
 };
 
+/** @brief A global uncached kernel page table entry for device registers */
+const entry_t e_kernel_device = {
+    .present = 1,
+    .write = 1,
+    .cache_disable = 1,
+    .global = 1,
+};
+
 /** @brief A kernel page table entry */
 const entry_t e_kernel_local = {
     .present = 1,
     .write = 1,
 };
 
+/** @brief A global kernel page directory entry mapping a 4MB page */
+const entry_t e_kernel_large = {
+    .present = 1,
+    .write = 1,
+    .page_size = 1,
+    .global = 1,
+};
+
+/** @brief A kernel page directory entry mapping a 4MB page */
+const entry_t e_kernel_large_local = {
+    .present = 1,
+    .write = 1,
+    .page_size = 1,
+};
+
+/** @brief A read/write user page directory entry mapping a 4MB page */
+const entry_t e_large_page = {
+    .present = 1,
+    .write = 1,
+    .user = 1,
+    .page_size = 1,
+};
+
 /** @brief A read only user page table entry */
 const entry_t e_read_page = {
     .present = 1,
@@ -72,6 +104,31 @@ const entry_t e_zfod_page = {
     .user = 1
 };
 
+/** @brief A write copy on write user page table entry */
+const entry_t e_cow_page = {
+    .present = 1,
+    .cow = 1,
+    .user = 1
+};
+
+/** @brief A read/write user page table entry for a frame shared between
+ *         processes, which is never copied on write */
+const entry_t e_shared_page = {
+    .present = 1,
+    .write = 1,
+    .user = 1,
+    .shared = 1
+};
+
+/** @brief An uncached read/write user page table entry for device memory */
+const entry_t e_device_page = {
+    .present = 1,
+    .write = 1,
+    .user = 1,
+    .cache_disable = 1,
+    .shared = 1
+};
+
 /** @brief An unmapped page directory or table entry */
 const entry_t e_unmapped = { 0 };
 
@@ -176,28 +233,58 @@ physical_table(void* frame, int table_idx, int pages, entry_t init)
 /** @brief Performs initialization that virtual memory functions require
  *
  *  This function sets up the special pages virtual memory reserves like
- *  the zero page and the kernel mapping pages
+ *  the zero page and the kernel mapping pages. Kernel memory is mapped with
+ *  global 4MB pages, except for the first 4MB which keeps a page table so
+ *  that the local APIC can be mapped over one of its pages.
  *
  *  @return void
  **/
 void init_virtual_memory()
 {
     init_frame_alloc();
+    init_alloc_cache();
+    init_program_cache();
     int i;
-    // set up the page tables which define the kernel memory
-    for (i = 0; i < KERNEL_TABLES; i++) {
-        page_table_t* table = (page_table_t*)smemalign(PAGE_SIZE, PAGE_SIZE);
-        table = physical_table(table, i, PAGES_PER_TABLE, e_kernel_global);
-        virtual_memory.kernel_pages[i] = table;
+    page_table_t* table = (page_table_t*)smemalign(PAGE_SIZE, PAGE_SIZE);
+    table = physical_table(table, 0, PAGES_PER_TABLE, e_kernel_global);
+    virtual_memory.low_pages = table;
+    virtual_memory.kernel_tables[0] = create_entry(table, e_kernel_dir);
+    for (i = 1; i < KERNEL_TABLES; i++) {
+        void* page = (void*)(i * LARGE_PAGE_SIZE);
+        virtual_memory.kernel_tables[i] = create_entry(page, e_kernel_large);
     }
     virtual_memory.identity = alloc_kernel_directory();
-    set_cr3((uint32_t)virtual_memory.identity);
-    set_cr4(get_cr4() | CR4_PGE);
-    set_cr0(get_cr0() | CR0_PG | CR0_WP);
+    enable_paging();
     virtual_memory.available_frames = OVERCOMMIT_RATIO * user_frame_total();
     mutex_init(&virtual_memory.lock);
 }
 
+/** @brief Turn on paging for this processor using the identity mapping
+ *
+ *  @return void
+ **/
+void enable_paging()
+{
+    set_cr3((uint32_t)virtual_memory.identity);
+    set_cr4(get_cr4() | CR4_PSE | CR4_PGE);
+    set_cr0(get_cr0() | CR0_PG | CR0_WP);
+}
+
+/** @brief Map the local APIC registers into the kernel address space
+ *
+ *  The registers appear at LAPIC_VIRT_BASE for every processor
+ *
+ *  @param physical The physical address of the local APIC
+ *  @return void
+ **/
+void map_lapic(void* physical)
+{
+    void* virtual = (void*)LAPIC_VIRT_BASE;
+    page_table_t* table = virtual_memory.low_pages;
+    *get_table_entry(virtual, table) = create_entry(physical, e_kernel_device);
+    invalidate_page(virtual);
+}
+
 /** @brief Calculate the number of frames required for an allocation
  *
  *  @param start The starting address of the allocation
@@ -257,8 +344,7 @@ page_directory_t* alloc_page_directory()
     zero_frame(dir);
     //map in the global kernel pages
     for (i = 0; i < KERNEL_TABLES; i++) {
-        void* kernel_page = virtual_memory.kernel_pages[i];
-        dir->tables[i] = create_entry(kernel_page, e_kernel_dir);
+        dir->tables[i] = virtual_memory.kernel_tables[i];
     }
     return dir;
 }
@@ -290,13 +376,10 @@ page_directory_t* alloc_kernel_directory()
     int machine_full_tables = machine_phys_frames() / PAGES_PER_TABLE;
     int machine_extra_pages = machine_phys_frames() % PAGES_PER_TABLE;
 
+    // whole tables of physical memory are mapped with 4MB pages
     for (i = KERNEL_TABLES; i < machine_full_tables; i++) {
-        page_table_t* table = alloc_page_table();
-        if (table == NULL) {
-            panic("Could not allocate frame for kernel page table");
-        }
-        table = physical_table(table, i, PAGES_PER_TABLE, e_kernel_local);
-        dir->tables[i] = create_entry(table, e_kernel_dir);
+        void* page = (void*)(i * LARGE_PAGE_SIZE);
+        dir->tables[i] = create_entry(page, e_kernel_large_local);
     }
     if (machine_extra_pages != 0) {
         page_table_t* table = alloc_page_table();
@@ -310,6 +393,9 @@ page_directory_t* alloc_kernel_directory()
 }
 
 /** @brief Duplicate a frame correctly
+ *
+ *  Frames are shared between the parent and child. Writeable frames become
+ *  copy on write in both processes and are copied on the first write.
  *
  *  @param child_entry The page table entry to clone the frame to
  *  @param parent_entry The page table entry to clone the frame from
@@ -317,18 +403,24 @@ page_directory_t* alloc_kernel_directory()
  **/
 int copy_frame(entry_t* child_entry, entry_t* parent_entry)
 {
+    void* frame = get_entry_address(*parent_entry);
     if (is_zfod(parent_entry)) {
-        *child_entry = create_entry(get_zero_page(), *parent_entry);
+        *child_entry = create_entry(frame, *parent_entry);
         return 0;
     }
-    // Create copy of page
-    if (kernel_alloc_frame(child_entry, *parent_entry) < 0) {
-        DPRINTF("Ran out of frames to allocate");
-        return -1;
+    // shared pages stay writable by both, and device memory has no frame
+    if (parent_entry->shared) {
+        if ((uint32_t)frame >= USER_MEM_START) {
+            share_frame(frame);
+        }
+        *child_entry = create_entry(frame, *parent_entry);
+        return 0;
     }
-    // Copy frame data
-    memcpy(get_entry_address(*child_entry),
-           get_entry_address(*parent_entry), PAGE_SIZE);
+    if (parent_entry->write) {
+        *parent_entry = create_entry(frame, e_cow_page);
+    }
+    share_frame(frame);
+    *child_entry = create_entry(frame, *parent_entry);
     return 0;
 }
 
@@ -356,6 +448,33 @@ int copy_page_table(page_table_t* table_child, page_table_t* table_parent)
     return 0;
 }
 
+/** @brief Replace a 4MB page with a page table mapping the same frames
+ *
+ *  The frames of the large page become ordinary frames which can be shared
+ *  and freed one at a time.
+ *
+ *  @param dir_entry The page directory entry of the large page
+ *  @return Zero on success, less than zero on failure
+ **/
+int split_large_page(entry_t* dir_entry)
+{
+    int i;
+    page_table_t* table = alloc_page_table();
+    if (table == NULL) {
+        DPRINTF("Ran out of kernel memory for page tables");
+        return -1;
+    }
+    char* frame = get_entry_address(*dir_entry);
+    entry_t model = e_write_page;
+    model.write = dir_entry->write;
+    model.user = dir_entry->user;
+    for (i = 0; i < PAGES_PER_TABLE; i++) {
+        table->pages[i] = create_entry(frame + i * PAGE_SIZE, model);
+    }
+    *dir_entry = create_entry(table, e_user_dir);
+    return 0;
+}
+
 /** @brief Copies the page tables into a new process
  *
  *  @param dir_child PCB of child process
@@ -373,6 +492,11 @@ int copy_page_dir(page_directory_t* dir_child, page_directory_t* dir_parent)
             continue;
         }
 
+        // large pages are copied on write a frame at a time
+        if (dir_entry_parent->page_size &&
+                split_large_page(dir_entry_parent) < 0) {
+            return -1;
+        }
         // Create copy of page table
         entry_t* dir_entry_child = &dir_child->tables[i_dir];
         void* table = alloc_page_table();
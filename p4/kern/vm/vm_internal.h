@@ -24,6 +24,13 @@
 /** @brief The ratio to overcommit virtual frames at 1 does not overcommit */
 #define OVERCOMMIT_RATIO 1
 
+/** @brief The largest block of frames is 2^MAX_FRAME_ORDER frames, 4MB */
+#define MAX_FRAME_ORDER 10
+/** @brief The size of a page mapped by a single page directory entry */
+#define LARGE_PAGE_SIZE (PAGE_SIZE * PAGES_PER_TABLE)
+/** @brief The number of frames allocated or freed at once in a batch */
+#define FRAME_BATCH_SIZE 16
+
 /** @brief Divide x and y rounding the result up to the nearest integer */
 #define DIVIDE_ROUND_UP(x, y) (1 + ((x) - 1) / (y))
 
@@ -52,7 +59,8 @@ typedef struct {
     uint32_t page_size : 1;     /* bit 7 */
     uint32_t global : 1;        /* bit 8 */
     uint32_t zfod : 1;          /* bit 9 */
-    uint32_t unused : 2;        /* bit 10  - 11 */
+    uint32_t cow : 1;           /* bit 10 */
+    uint32_t shared : 1;        /* bit 11 */
     uint32_t address : 20;      /* bit 12 - 31 */
 } entry_t;
 
@@ -73,10 +81,20 @@ typedef struct {
     uint32_t page_dir_index : 10;   /* bits 22 - 31 */
 } address_t;
 
+/** @brief mapper for map pages */
+typedef int (*vm_operator)(entry_t*, entry_t*, address_t, void*);
+
+/** @brief A group of frames allocated or freed with one lock acquisition */
+typedef struct frame_batch {
+    void* frames[FRAME_BATCH_SIZE];
+    int count;
+} frame_batch_t;
+
 /** @brief Global struct for virtual memory */
 struct virtual_memory{
     page_directory_t *identity;
-    page_table_t* kernel_pages[KERNEL_TABLES];
+    page_table_t* low_pages;
+    entry_t kernel_tables[KERNEL_TABLES];
     int available_frames;
     mutex_t lock;
 };
@@ -86,10 +104,17 @@ extern struct virtual_memory virtual_memory;
 extern const entry_t e_kernel_dir;
 extern const entry_t e_user_dir;
 extern const entry_t e_kernel_global;
+extern const entry_t e_kernel_device;
 extern const entry_t e_kernel_local;
+extern const entry_t e_kernel_large;
+extern const entry_t e_kernel_large_local;
+extern const entry_t e_large_page;
 extern const entry_t e_read_page;
 extern const entry_t e_write_page;
 extern const entry_t e_zfod_page;
+extern const entry_t e_cow_page;
+extern const entry_t e_shared_page;
+extern const entry_t e_device_page;
 extern const entry_t e_unmapped;
 
 /** @brief Invalidates a page using the invl page instruction
@@ -98,6 +123,8 @@ extern const entry_t e_unmapped;
  **/
 void invalidate_page(void *page);
 
+void init_alloc_cache();
+void init_program_cache();
 int add_alloc(ppd_t* ppd, void* start, uint32_t size);
 
 void release_frames(void* start, uint32_t size);
@@ -114,21 +141,37 @@ page_directory_t* alloc_kernel_directory();
 page_table_t* alloc_page_table();
 int page_bytes_left(void* address);
 int copy_page_dir(page_directory_t* dir_child, page_directory_t* dir_parent);
+int split_large_page(entry_t* dir_entry);
+int split_large_pages(ppd_t* ppd, void* start, uint32_t size);
+int vm_map_pages(ppd_t* ppd, void* start, uint32_t size, vm_operator op,
+                 void* arg);
 
 int vm_free_alloc(ppd_t* ppd, uint32_t start, uint32_t size);
 
 int is_user(entry_t* table, entry_t* dir);
 int is_write(entry_t* table);
 int is_zfod(entry_t* table);
+int is_device(entry_t* table);
 int is_present_user(entry_t* entry);
 int vm_get_address(ppd_t* ppd, void* addr, entry_t** table, entry_t** dir);
 
 void init_frame_alloc();
 void* get_zero_page();
 int user_frame_total();
-int alloc_frame(void* virtual, entry_t* table, entry_t model);
-int kernel_alloc_frame(entry_t* table, entry_t model);
-void free_frame(void* virtual, void *physical);
+int alloc_frame(void* virtual, entry_t* table, entry_t model,
+                frame_batch_t* batch);
+int copy_on_write_frame(void* virtual, entry_t* table, entry_t model);
+void* alloc_unmapped_frame(frame_batch_t* batch);
+void write_unmapped_frame(void* physical, uint32_t offset, void* buffer,
+                          uint32_t len);
+void share_frame(void* physical);
+int is_shared_frame(void* physical);
+void free_frame(void* physical, frame_batch_t* batch);
+void* alloc_frame_block(int order);
+void free_frame_block(void* physical, int order);
+void zero_frame_block(void* physical, int order);
+int alloc_frame_batch(frame_batch_t* batch, int count);
+void free_frame_batch(frame_batch_t* batch);
 
 int allocate_tables(ppd_t* ppd, void* start, uint32_t size);
 
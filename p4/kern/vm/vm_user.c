@@ -10,6 +10,7 @@
 #include <vm.h>
 #include <contracts.h>
 #include <string.h>
+#include <malloc.h>
 #include "vm_internal.h"
 
 /** @brief Is this page present and user accessable
@@ -40,7 +41,7 @@ int is_user(entry_t* table, entry_t* dir)
  **/
 int is_write(entry_t* table)
 {
-    return table->write || (is_zfod(table) && table->zfod);
+    return table->write || table->cow || (is_zfod(table) && table->zfod);
 }
 
 /** @brief Is this page the zfod page
@@ -53,8 +54,16 @@ int is_zfod(entry_t* table)
     return (get_entry_address(*table) == get_zero_page());
 }
 
-/** @brief mapper for map pages */
-typedef int (*vm_operator)(entry_t*, entry_t*, address_t);
+/** @brief Does this page map device memory rather than a user frame
+ *
+ *  @param table The page table entry for this page
+ *  @return a boolean integer
+ **/
+int is_device(entry_t* table)
+{
+    return table->shared &&
+           (uint32_t)get_entry_address(*table) < USER_MEM_START;
+}
 
 /** @brief Map a mapper function across a range of pages
  *
@@ -62,11 +71,14 @@ typedef int (*vm_operator)(entry_t*, entry_t*, address_t);
  *  @param start The starting address to map from
  *  @param size The size to map
  *  @param op The vm mapper to run
- *  @return Zero on success an integer less than zero on failure
+ *  @param arg An argument passed to every call of the mapper
+ *  @return Less than zero on failure, otherwise the bitwise or of the values
+ *          returned by the mapper
  **/
-int vm_map_pages(ppd_t* ppd, void* start, uint32_t size, vm_operator op)
+int vm_map_pages(ppd_t* ppd, void* start, uint32_t size, vm_operator op,
+                 void* arg)
 {
-    int i, j, value = 0;
+    int i, j, status, value = 0;
     page_directory_t* dir = ppd->dir;
     char* end = ((char*)start) + size - 1;
     address_t vm_start = AS_TYPE(start, address_t);
@@ -80,6 +92,15 @@ int vm_map_pages(ppd_t* ppd, void* start, uint32_t size, vm_operator op)
             DPRINTF("Page dir entry not present");
             return -1;
         }
+        address_t location = { .page_dir_index = i };
+        // a large page is its own table entry and is visited once
+        if (dir_entry->page_size) {
+            if ((status = op(dir_entry, dir_entry, location, arg)) < 0) {
+                return status;
+            }
+            value |= status;
+            continue;
+        }
         int start_index = 0;
         int end_index = PAGES_PER_TABLE - 1;
         if (i == vm_start.page_dir_index) {
@@ -89,13 +110,13 @@ int vm_map_pages(ppd_t* ppd, void* start, uint32_t size, vm_operator op)
             end_index = vm_end.page_table_index;
         }
         page_table_t* table = get_entry_address(*dir_entry);
-        address_t location = { .page_dir_index = i };
         for (j = start_index; j <= end_index; j++) {
             location.page_table_index = j;
             entry_t* table_entry = &table->pages[j];
-            if ((value = op(table_entry, dir_entry, location)) < 0) {
-                return value;
+            if ((status = op(table_entry, dir_entry, location, arg)) < 0) {
+                return status;
             }
+            value |= status;
         }
     }
     return value;
@@ -122,8 +143,8 @@ int vm_user_can_alloc(ppd_t* ppd, void* start, uint32_t size)
         if (!dir_entry->present) {
             continue;
         }
-        if (!dir_entry->user) {
-            //kernel only
+        if (!dir_entry->user || dir_entry->page_size) {
+            //kernel only or a large page
             return 0;
         }
         int start_index = 0;
@@ -162,6 +183,11 @@ int vm_get_address(ppd_t* ppd, void* addr, entry_t** table, entry_t** dir)
     if (!dir_entry->present) {
         return -1;
     }
+    if (dir_entry->page_size) {
+        *table = dir_entry;
+        *dir = dir_entry;
+        return LARGE_PAGE_SIZE - ((uint32_t)addr & (LARGE_PAGE_SIZE - 1));
+    }
     page_table_t* page_table = get_entry_address(*dir_entry);
     entry_t* table_entry = get_table_entry(addr, page_table);
     if (!table_entry->present) {
@@ -241,9 +267,11 @@ int vm_user_arrlen(ppd_t* ppd, char** start, int max_len)
  *  @param table The table entry for the current page
  *  @param dir The directory entry for the current page
  *  @param addr The virtual address of the current page
+ *  @param arg The argument passed to vm_map_pages
  *  @return Zero to continue, less than zero to stop iteration and return false
  **/
-int vm_user_write_h(entry_t* table, entry_t* dir, address_t addr)
+int vm_user_write_h(entry_t* table, entry_t* dir, address_t addr,
+                    void* arg)
 {
 
     if (is_user(table, dir) && is_write(table)) {
@@ -257,9 +285,11 @@ int vm_user_write_h(entry_t* table, entry_t* dir, address_t addr)
  *  @param table The table entry for the current page
  *  @param dir The directory entry for the current page
  *  @param addr The virtual address of the current page
+ *  @param arg The argument passed to vm_map_pages
  *  @return Zero to continue, less than zero to stop iteration and return false
  **/
-int vm_user_read_h(entry_t* table, entry_t* dir, address_t addr)
+int vm_user_read_h(entry_t* table, entry_t* dir, address_t addr,
+                   void* arg)
 {
     if (is_user(table, dir)) {
         return 0;
@@ -272,9 +302,11 @@ int vm_user_read_h(entry_t* table, entry_t* dir, address_t addr)
  *  @param table The table entry for the current page
  *  @param dir The directory entry for the current page
  *  @param addr The virtual address of the current page
+ *  @param arg The argument passed to vm_map_pages
  *  @return Zero to continue, less than zero to stop iteration and return false
  **/
-int vm_set_readwrite_h(entry_t* table, entry_t* dir, address_t addr)
+int vm_set_readwrite_h(entry_t* table, entry_t* dir, address_t addr,
+                       void* arg)
 {
     if (!is_user(table, dir)) {
         return -3;
@@ -284,6 +316,10 @@ int vm_set_readwrite_h(entry_t* table, entry_t* dir, address_t addr)
             // set the zfod write bit
             table->zfod = 1;
             assert(table->write == 0);
+        } else if (is_shared_frame(get_entry_address(*table))) {
+            // other processes still see this frame so copy it on write
+            table->cow = 1;
+            assert(table->zfod == 0);
         } else {
             // set the write bit
             table->write = 1;
@@ -299,9 +335,11 @@ int vm_set_readwrite_h(entry_t* table, entry_t* dir, address_t addr)
  *  @param table The table entry for the current page
  *  @param dir The directory entry for the current page
  *  @param addr The virtual address of the current page
+ *  @param arg The argument passed to vm_map_pages
  *  @return Zero to continue, less than zero to stop iteration and return false
  **/
-int vm_set_readonly_h(entry_t* table, entry_t* dir, address_t addr)
+int vm_set_readonly_h(entry_t* table, entry_t* dir, address_t addr,
+                      void* arg)
 {
     if (!is_user(table, dir)) {
         return -3;
@@ -312,6 +350,7 @@ int vm_set_readonly_h(entry_t* table, entry_t* dir, address_t addr)
             assert(table->write == 0);
         } else {
             table->write = 0;
+            table->cow = 0;
             assert(table->zfod == 0);
         }
         invalidate_page(AS_TYPE(addr, void*));
@@ -324,10 +363,16 @@ int vm_set_readonly_h(entry_t* table, entry_t* dir, address_t addr)
  *  @param table The table entry for the current page
  *  @param dir The directory entry for the current page
  *  @param addr The virtual address of the current page
+ *  @param arg The argument passed to vm_map_pages
  *  @return Zero to continue, less than zero to stop iteration and return false
  **/
-int vm_alloc_readwrite_h(entry_t* table, entry_t* dir, address_t addr)
+int vm_alloc_readwrite_h(entry_t* table, entry_t* dir, address_t addr,
+                         void* arg)
 {
+    // large pages were mapped and zeroed by map_large_pages
+    if (dir->page_size) {
+        return 0;
+    }
     if (table->present) {
         DPRINTF("Error already allocated");
         return -1;
@@ -336,50 +381,129 @@ int vm_alloc_readwrite_h(entry_t* table, entry_t* dir, address_t addr)
     return 0;
 }
 
-/** @brief A vm_operator which backs zfod pages with real frames
+/** @brief A vm_operator which backs zfod and copy on write pages with real
+ *         writeable frames
  *
  *  @param table The table entry for the current page
  *  @param dir The directory entry for the current page
  *  @param addr The virtual address of the current page
- *  @return Zero to continue, less than zero to stop iteration and return false
+ *  @param arg The frame batch to take new frames from
+ *  @return Less than zero to stop iteration and return false, otherwise one
+ *          if the page table entry was changed and zero if it was not
  **/
-int vm_back_h(entry_t* table, entry_t* dir, address_t addr)
+int vm_back_h(entry_t* table, entry_t* dir, address_t addr,
+              void* arg)
 {
+    int status = 0;
     if (!is_user(table, dir)) {
         return -3;
     }
     if (is_zfod(table) && is_write(table)) {
-        return alloc_frame(AS_TYPE(addr, void*), table, e_write_page);
+        status = alloc_frame(AS_TYPE(addr, void*), table, e_write_page, arg);
+    } else if (table->cow) {
+        void* virtual = AS_TYPE(addr, void*);
+        status = copy_on_write_frame(virtual, table, e_write_page);
+    } else {
+        return 0;
+    }
+    return status < 0 ? status : 1;
+}
+
+/** @brief Where vm_write_unloaded copies from and the frames it uses */
+typedef struct unloaded_write {
+    char* buffer;
+    uint32_t start;
+    uint32_t size;
+    frame_batch_t batch;
+} unloaded_write_t;
+
+/** @brief A vm_operator which writes part of a buffer to a page of a page
+ *         directory which is not loaded
+ *
+ *  The page is backed with a zeroed frame if it is zfod. Large and copy on
+ *  write pages are not written.
+ *
+ *  @param table The table entry for the current page
+ *  @param dir The directory entry for the current page
+ *  @param addr The virtual address of the current page
+ *  @param arg The unloaded_write_t describing the write
+ *  @return Zero to continue, less than zero to stop iteration and return false
+ **/
+static int vm_write_unloaded_h(entry_t* table, entry_t* dir,
+                               address_t addr, void* arg)
+{
+    unloaded_write_t* write = arg;
+    if (!is_user(table, dir) || dir->page_size || table->cow) {
+        return -1;
+    }
+    if (is_zfod(table)) {
+        void* physical = alloc_unmapped_frame(&write->batch);
+        if (physical == NULL) {
+            return -1;
+        }
+        *table = create_entry(physical, e_write_page);
     }
+    uint32_t page = AS_TYPE(addr, uint32_t);
+    uint32_t low = write->start > page ? write->start : page;
+    uint32_t high = write->start + write->size;
+    if (high > page + PAGE_SIZE) {
+        high = page + PAGE_SIZE;
+    }
+    write_unmapped_frame(get_entry_address(*table), low - page,
+                         write->buffer + (low - write->start), high - low);
     return 0;
 }
 
-/** @brief A vm_operator to free a user page
+/** @brief A vm_operator to revoke user access to a page before it is freed
  *
  *  @param table The table entry for the current page
  *  @param dir The directory entry for the current page
  *  @param addr The virtual address of the current page
+ *  @param arg The argument passed to vm_map_pages
  *  @return Zero to continue, less than zero to stop iteration and return false
  **/
-int vm_free_alloc_h(entry_t* table, entry_t* dir, address_t addr)
+int vm_revoke_h(entry_t* table, entry_t* dir, address_t addr,
+                void* arg)
 {
     // everything we are freeing should be user mapped
     if (!is_user(table, dir)) {
         return -3;
     }
+    table->user = 0;
+    invalidate_page(AS_TYPE(addr, void*));
+    return 0;
+}
+
+/** @brief A vm_operator to free a user page
+ *
+ *  @param table The table entry for the current page
+ *  @param dir The directory entry for the current page
+ *  @param addr The virtual address of the current page
+ *  @param arg The frame batch to collect freed frames in
+ *  @return Zero to continue, less than zero to stop iteration and return false
+ **/
+int vm_free_alloc_h(entry_t* table, entry_t* dir, address_t addr,
+                    void* arg)
+{
     void* virtual = AS_TYPE(addr, void*);
-    // for zfod pages we can just delete the page
-    if (is_zfod(table)) {
+    // large pages are never shared so the whole block is freed
+    if (dir->page_size) {
+        free_frame_block(get_entry_address(*dir), MAX_FRAME_ORDER);
+        *dir = e_unmapped;
+        invalidate_page(virtual);
+        return 0;
+    }
+    // user access was revoked by vm_revoke_h
+    if (!table->present || !dir->user) {
+        return -3;
+    }
+    // for zfod pages and device memory we can just delete the page
+    if (is_zfod(table) || is_device(table)) {
         *table = e_unmapped;
         invalidate_page(virtual);
         return 0;
     }
-    // mark as kernel only to eliminate race conditions
-    table->user = 0;
-    // make sure we can write to the page
-    table->write = 1;
-    invalidate_page(virtual);
-    free_frame(virtual, get_entry_address(*table));
+    free_frame(get_entry_address(*table), arg);
     *table = e_unmapped;
     invalidate_page(virtual);
     return 0;
@@ -394,7 +518,7 @@ int vm_free_alloc_h(entry_t* table, entry_t* dir, address_t addr)
  **/
 int vm_user_can_write(ppd_t* ppd, void* start, uint32_t size)
 {
-    return vm_map_pages(ppd, start, size, vm_user_write_h) == 0;
+    return vm_map_pages(ppd, start, size, vm_user_write_h, NULL) == 0;
 }
 
 /** @brief Can a user read from a given set of addresses
@@ -406,7 +530,64 @@ int vm_user_can_write(ppd_t* ppd, void* start, uint32_t size)
  **/
 int vm_user_can_read(ppd_t* ppd, void* start, uint32_t size)
 {
-    return vm_map_pages(ppd, start, size, vm_user_read_h) == 0;
+    return vm_map_pages(ppd, start, size, vm_user_read_h, NULL) == 0;
+}
+
+/** @brief Split the user large pages which overlap a range of addresses
+ *
+ *  @param ppd The user page directory
+ *  @param start The start address
+ *  @param size The size of the range
+ *  @return Zero on success, less than zero on failure
+ **/
+int split_large_pages(ppd_t* ppd, void* start, uint32_t size)
+{
+    int i;
+    char* end = ((char*)start) + size - 1;
+    address_t vm_start = AS_TYPE(start, address_t);
+    address_t vm_end = AS_TYPE(end, address_t);
+    if (AS_TYPE(vm_start, uint32_t) > AS_TYPE(vm_end, uint32_t)) {
+        return -1;
+    }
+    for (i = vm_start.page_dir_index; i <= vm_end.page_dir_index; i++) {
+        entry_t* dir_entry = &ppd->dir->tables[i];
+        if (!is_present_user(dir_entry) || !dir_entry->page_size) {
+            continue;
+        }
+        if (split_large_page(dir_entry) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/** @brief Map the 4MB aligned parts of an allocation with large pages
+ *
+ *  Each large page is backed by a zeroed block of contiguous frames and
+ *  replaces the page table allocate_tables made for it, which is empty
+ *  since the whole table lies inside the allocation. Parts which are not
+ *  given a large page, because no block was free, keep their tables.
+ *
+ *  @param ppd The user page directory
+ *  @param start The start address of the allocation
+ *  @param size The size of the allocation
+ *  @return void
+ **/
+static void map_large_pages(ppd_t* ppd, uint32_t start, uint32_t size)
+{
+    uint32_t offset = (LARGE_PAGE_SIZE - start % LARGE_PAGE_SIZE) %
+                      LARGE_PAGE_SIZE;
+    for (; size >= LARGE_PAGE_SIZE && offset <= size - LARGE_PAGE_SIZE;
+         offset += LARGE_PAGE_SIZE) {
+        entry_t* dir_entry = get_dir_entry((void*)(start + offset), ppd->dir);
+        void* block = alloc_frame_block(MAX_FRAME_ORDER);
+        if (block == NULL) {
+            return;
+        }
+        zero_frame_block(block, MAX_FRAME_ORDER);
+        sfree(get_entry_address(*dir_entry), PAGE_SIZE);
+        *dir_entry = create_entry(block, e_large_page);
+    }
 }
 
 /** @brief Set a group of user pages to be user readable and writable
@@ -418,7 +599,12 @@ int vm_user_can_read(ppd_t* ppd, void* start, uint32_t size)
  **/
 int vm_set_readwrite(ppd_t* ppd, void* start, uint32_t size)
 {
-    return vm_map_pages(ppd, start, size, vm_set_readwrite_h) == 0;
+    if (split_large_pages(ppd, start, size) < 0) {
+        return 0;
+    }
+    int status = vm_map_pages(ppd, start, size, vm_set_readwrite_h, NULL);
+    tlb_shootdown(ppd);
+    return status == 0;
 }
 
 /** @brief Set a group of user pages to be user read only
@@ -430,7 +616,12 @@ int vm_set_readwrite(ppd_t* ppd, void* start, uint32_t size)
  **/
 int vm_set_readonly(ppd_t* ppd, void* start, uint32_t size)
 {
-    return vm_map_pages(ppd, start, size, vm_set_readonly_h) == 0;
+    if (split_large_pages(ppd, start, size) < 0) {
+        return 0;
+    }
+    int status = vm_map_pages(ppd, start, size, vm_set_readonly_h, NULL);
+    tlb_shootdown(ppd);
+    return status == 0;
 }
 
 /** @brief Safely read from user memory to a kernel buffer using the ppd lock
@@ -503,6 +694,34 @@ int vm_write(ppd_t* ppd, void* buffer, void* start, uint32_t size)
     return -1;
 }
 
+/** @brief Write from a kernel buffer to the memory of a page directory
+ *         which is not loaded on any processor
+ *
+ *  The frames are written through the identity mapping, so the current
+ *  thread can fill in a process it does not belong to. The memory must be
+ *  writable, and not mapped with large or copy on write pages.
+ *
+ *  @param ppd The user page directory
+ *  @param buffer The buffer to write from
+ *  @param start The start address
+ *  @param size The size of the section to write
+ *  @return Zero on success, an integer less than zero on failure
+ **/
+int vm_write_unloaded(ppd_t* ppd, void* buffer, uint32_t start,
+                      uint32_t size)
+{
+    if (!vm_user_can_write(ppd, (void*)start, size)) {
+        return -1;
+    }
+    unloaded_write_t write = {
+        .buffer = buffer, .start = start, .size = size, .batch = { .count = 0 }
+    };
+    int status = vm_map_pages(ppd, (void*)start, size, vm_write_unloaded_h,
+                              &write);
+    free_frame_batch(&write.batch);
+    return status < 0 ? status : 0;
+}
+
 /** @brief Allocate a section of userspace memory using zfod
  *
  *  @param ppd The user page directory
@@ -527,7 +746,8 @@ int vm_alloc_readwrite(ppd_t* ppd, void* start, uint32_t size)
         return -1;
     }
     // at this point all memory is allocated
-    assert(vm_map_pages(ppd, start, size, vm_alloc_readwrite_h) >= 0);
+    map_large_pages(ppd, (uint32_t)start, size);
+    assert(vm_map_pages(ppd, start, size, vm_alloc_readwrite_h, NULL) >= 0);
     return 0;
 }
 
@@ -540,7 +760,18 @@ int vm_alloc_readwrite(ppd_t* ppd, void* start, uint32_t size)
  **/
 int vm_back(ppd_t* ppd, uint32_t start, uint32_t size)
 {
-    return vm_map_pages(ppd, (void*)start, size, vm_back_h);
+    frame_batch_t batch = { .count = 0 };
+    int status = vm_map_pages(ppd, (void*)start, size, vm_back_h, &batch);
+    // give back any frames the batch did not use
+    free_frame_batch(&batch);
+    if (status < 0) {
+        return status;
+    }
+    // other processors may still map the zero page or the shared frame
+    if (status > 0) {
+        tlb_shootdown(ppd);
+    }
+    return 0;
 }
 
 /** @brief Free a previously allocated a section of userspace memory
@@ -553,5 +784,135 @@ int vm_back(ppd_t* ppd, uint32_t start, uint32_t size)
 int vm_free_alloc(ppd_t* ppd, uint32_t start, uint32_t size)
 {
     release_frames((void*)start, size);
-    return vm_map_pages(ppd, (void*)start, size, vm_free_alloc_h);
+    // no processor may use the pages once their frames are freed
+    int status = vm_map_pages(ppd, (void*)start, size, vm_revoke_h, NULL);
+    if (status < 0) {
+        return status;
+    }
+    tlb_shootdown(ppd);
+    frame_batch_t batch = { .count = 0 };
+    status = vm_map_pages(ppd, (void*)start, size, vm_free_alloc_h, &batch);
+    free_frame_batch(&batch);
+    return status;
+}
+
+/** @brief The frames mapped by vm_map_physical_h */
+typedef struct {
+    uint32_t physical;
+    entry_t model;
+} physical_map_t;
+
+/** @brief A vm_operator which maps the next frame of a physical range
+ *
+ *  @param table The table entry for the current page
+ *  @param dir The directory entry for the current page
+ *  @param addr The virtual address of the current page
+ *  @param arg The physical_map_t giving the next frame
+ *  @return Zero to continue
+ **/
+int vm_map_physical_h(entry_t* table, entry_t* dir, address_t addr,
+                      void* arg)
+{
+    physical_map_t* map = arg;
+    void* frame = (void*)map->physical;
+    if (map->physical >= USER_MEM_START) {
+        share_frame(frame);
+    }
+    *table = create_entry(frame, map->model);
+    map->physical += PAGE_SIZE;
+    return 0;
+}
+
+/** @brief Map physical memory the process does not own into user memory
+ *
+ *  Device memory below USER_MEM_START is mapped uncached and is never freed.
+ *  Frames from vm_alloc_shared gain a reference for each mapping, so they
+ *  live until the last mapping is freed. Either way the mapping is an
+ *  allocation, freed by remove_pages or with the rest of the process.
+ *
+ *  Must be called with the process lock held, for space vm_user_can_alloc
+ *  allows.
+ *
+ *  @param ppd The user page directory
+ *  @param start The start address
+ *  @param physical The page aligned physical address to map at start
+ *  @param size The size of the section to map
+ *  @return Zero on success, an integer less than zero on failure
+ **/
+int vm_map_physical(ppd_t* ppd, void* start, uint32_t physical,
+                    uint32_t size)
+{
+    if (size == 0) {
+        return 0;
+    }
+    // freeing an allocation releases frames, so the mapping reserves them
+    if (reserve_frames(start, size) < 0) {
+        return -1;
+    }
+    if (allocate_tables(ppd, start, size) < 0 ||
+            add_alloc(ppd, start, size) < 0) {
+        release_frames(start, size);
+        return -1;
+    }
+    physical_map_t map = { .physical = physical };
+    map.model = physical < USER_MEM_START ? e_device_page : e_shared_page;
+    assert(vm_map_pages(ppd, start, size, vm_map_physical_h, &map) >= 0);
+    return 0;
+}
+
+/** @brief Gets the order of the block vm_alloc_shared uses for a size
+ *
+ *  @param size The size of the shared memory
+ *  @return The order of the block
+ **/
+static int shared_order(uint32_t size)
+{
+    int order = 0;
+    while ((PAGE_SIZE << order) < size) {
+        order++;
+    }
+    return order;
+}
+
+/** @brief Allocate zeroed frames which processes can share with
+ *         vm_map_physical
+ *
+ *  @param size The size of the memory, at most LARGE_PAGE_SIZE
+ *  @return The physical address of the frames, or NULL on failure
+ **/
+void* vm_alloc_shared(uint32_t size)
+{
+    if (size == 0 || size > LARGE_PAGE_SIZE) {
+        return NULL;
+    }
+    int order = shared_order(size);
+    if (reserve_frames(NULL, PAGE_SIZE << order) < 0) {
+        return NULL;
+    }
+    void* block = alloc_frame_block(order);
+    if (block == NULL) {
+        release_frames(NULL, PAGE_SIZE << order);
+        return NULL;
+    }
+    zero_frame_block(block, order);
+    return block;
+}
+
+/** @brief Drop the reference vm_alloc_shared holds to shared frames
+ *
+ *  Frames still mapped by a process are freed when it unmaps them.
+ *
+ *  @param physical The physical address of the frames
+ *  @param size The size passed to vm_alloc_shared
+ *  @return void
+ **/
+void vm_free_shared(void* physical, uint32_t size)
+{
+    int i, order = shared_order(size);
+    frame_batch_t batch = { .count = 0 };
+    for (i = 0; i < (1 << order); i++) {
+        free_frame((char*)physical + i * PAGE_SIZE, &batch);
+    }
+    free_frame_batch(&batch);
+    release_frames(NULL, PAGE_SIZE << order);
 }
@@ -17,7 +17,9 @@
 
 /* Life cycle */
 int fork(void);
+int vfork(void);
 int exec(char *execname, char *argvec[]);
+int spawn(char *execname, char *argvec[]);
 void set_status(int status);
 void vanish(void) NORETURN;
 int wait(int *status_ptr);
@@ -34,6 +36,8 @@ int sleep(int ticks);
 /* Memory management */
 int new_pages(void * addr, int len);
 int remove_pages(void * addr);
+int fault_around(int pages);
+int page_faults(void);
 
 /* Console I/O */
 char getchar(void);
@@ -53,6 +57,29 @@ int udriv_wait(driv_id_t *driv_recv, message_t *msg_recv, unsigned int *msg_size
 int udriv_inb(unsigned int port, unsigned char *message);
 int udriv_outb(unsigned int port, unsigned char message);
 int udriv_mmap(void * addr_phys, void *addr_virt, int len);
+#define UDRIV_BUF_MAX 0xFFFF
+int udriv_send_buf(driv_id_t driv_send, message_t msg_send, void *buf,
+                   unsigned int len);
+int udriv_wait_buf(driv_id_t *driv_recv, message_t *msg_recv,
+                   unsigned int *msg_size, void *buf, unsigned int len);
+int udriv_call(driv_id_t driv_send, message_t msg_send, void *buf,
+               unsigned int len, driv_id_t *driv_recv, message_t *msg_recv,
+               unsigned int *msg_size, void *recv_buf, unsigned int recv_len);
+int udriv_reply_wait(driv_id_t driv_send, message_t msg_send, void *buf,
+                     unsigned int len, driv_id_t *driv_recv,
+                     message_t *msg_recv, unsigned int *msg_size,
+                     void *recv_buf, unsigned int recv_len);
+int udriv_share(driv_id_t driv_id, void *addr_virt, int len);
+typedef struct udriv_msg {
+    driv_id_t driver_id;
+    message_t msg;
+    unsigned int size;
+    int has_buffer;
+} udriv_msg_t;
+int udriv_wait_many(udriv_msg_t *msgs, int count, int timeout);
+#define UDRIV_SEND_BLOCK 0x1
+int udriv_config(driv_id_t driv_id, int queue_size, int flags);
+int udriv_dropped(void);
 
 /* Color values for set_term_color() */
 #define FGND_BLACK 0x0
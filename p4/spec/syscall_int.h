@@ -74,4 +74,18 @@
 #define SYSCALL_RESERVED_15       0x8F
 #define SYSCALL_RESERVED_END      0x8F
 
+/* Extensions to the spec, numbered from the reserved syscalls */
+#define FAULT_AROUND_INT     SYSCALL_RESERVED_0
+#define PAGE_FAULTS_INT      SYSCALL_RESERVED_1
+#define UDRIV_SEND_BUF_INT   SYSCALL_RESERVED_2
+#define UDRIV_WAIT_BUF_INT   SYSCALL_RESERVED_3
+#define UDRIV_CALL_INT       SYSCALL_RESERVED_4
+#define UDRIV_REPLY_WAIT_INT SYSCALL_RESERVED_5
+#define UDRIV_SHARE_INT      SYSCALL_RESERVED_6
+#define UDRIV_WAIT_MANY_INT  SYSCALL_RESERVED_7
+#define UDRIV_CONFIG_INT     SYSCALL_RESERVED_8
+#define UDRIV_DROPPED_INT    SYSCALL_RESERVED_9
+#define SPAWN_INT            SYSCALL_RESERVED_10
+#define VFORK_INT            SYSCALL_RESERVED_11
+
 #endif /* _SYSCALL_INT_H */
@@ -0,0 +1,75 @@
+/** @file fault_around_test.c
+ *
+ *  @brief Measures how many page faults fault around saves
+ *
+ *  A region allocated with new_pages is written one byte per page, first
+ *  with fault around turned off and then with the given window. The number
+ *  of page faults taken by each pass is printed.
+ *
+ *  Usage: fault_around_test [pages] [window]
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+
+/** @brief Where the region is allocated, off a 4MB boundary so that small
+ *         regions are not backed by large pages */
+#define REGION_BASE 0x40001000
+/** @brief The default number of pages in the region */
+#define DEFAULT_PAGES 1024
+/** @brief The default fault around window */
+#define DEFAULT_WINDOW 16
+
+/** @brief Touch every page of a fresh region and count the faults taken
+ *
+ *  @param pages The number of pages in the region
+ *  @param window The fault around window to use
+ *  @return The number of faults taken, or less than zero on failure
+ **/
+static int touch_region(int pages, int window)
+{
+    int i;
+    char* region = (char*)REGION_BASE;
+    if (fault_around(window) < 0) {
+        return -1;
+    }
+    if (new_pages(region, pages * PAGE_SIZE) < 0) {
+        return -1;
+    }
+    int start = page_faults();
+    for (i = 0; i < pages; i++) {
+        region[i * PAGE_SIZE] = 1;
+    }
+    int faults = page_faults() - start;
+    remove_pages(region);
+    return faults;
+}
+
+int main(int argc, char** argv)
+{
+    int pages = DEFAULT_PAGES, window = DEFAULT_WINDOW;
+    if (argc > 1) {
+        pages = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        window = atoi(argv[2]);
+    }
+    if (pages < 1) {
+        printf("usage: fault_around_test [pages] [window]\n");
+        return -1;
+    }
+    int plain = touch_region(pages, 0);
+    int around = touch_region(pages, window);
+    if (plain < 0 || around < 0) {
+        printf("fault_around_test: could not run with window %d\n", window);
+        return -1;
+    }
+    printf("fault_around_test: %d pages, %d faults without fault around, "
+           "%d with a window of %d\n", pages, plain, around, window);
+    return 0;
+}
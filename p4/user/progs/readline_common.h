@@ -16,6 +16,10 @@
 #define KEYBOARD_BUFFER_SIZE (READLINE_MAX_LEN * 2)
 /** @brief The maximum number of characters a call to readline can take */
 #define READLINE_MAX_LEN (80 * (24 - 1))
+/** @brief The most interrupts an interrupt loop takes with one system call */
+#define INTERRUPT_BATCH 32
+/** @brief The number of interrupts an interrupt loop can fall behind by */
+#define INTERRUPT_QUEUE 2048
 
 /** @brief A circlular buffer for storing and reading keystrokes */
 typedef struct keyboard {
@@ -58,9 +58,8 @@ int readchar(uint8_t scancode)
  **/
 void* interrupt_loop(void* arg)
 {
-    driv_id_t driv_recv;
-    message_t scancode;
-    unsigned int size;
+    udriv_msg_t msgs[INTERRUPT_BATCH];
+    int i, count;
 
     // register for keyboard driver
     if (udriv_register(UDR_KEYBOARD, KEYBOARD_PORT, 1) < 0) {
@@ -69,18 +68,20 @@ void* interrupt_loop(void* arg)
     }
 
     while (true) {
-        // get scancode
-        if (udriv_wait(&driv_recv, &scancode, &size) < 0) {
+        // get every scancode which has arrived
+        if ((count = udriv_wait_many(msgs, INTERRUPT_BATCH, -1)) < 0) {
             printf("user keyboard interrupt handler failed to get scancode");
             return (void*)-1;
         }
-        if (driv_recv != UDR_KEYBOARD) {
-            printf("received interrupt from unexpected source");
-            return (void*)-1;
-        }
-        int c = readchar((uint8_t)scancode);
-        if (c != -1) {
-            handle_char(&keyboard, c, print);
+        for (i = 0; i < count; i++) {
+            if (msgs[i].driver_id != UDR_KEYBOARD) {
+                printf("received interrupt from unexpected source");
+                return (void*)-1;
+            }
+            int c = readchar((uint8_t)msgs[i].msg);
+            if (c != -1) {
+                handle_char(&keyboard, c, print);
+            }
         }
     }
     return NULL;
@@ -0,0 +1,147 @@
+/** @file sched_bench.c
+ *
+ *  @brief Stress benchmark for the scheduler
+ *
+ *  Threads are arranged in rings and pass a wakeup token around each ring
+ *  with make_runnable and deschedule, yielding between passes. The number of
+ *  passes per tick is printed, and should stay steady as processors are
+ *  added to the machine.
+ *
+ *  Usage: sched_bench [rings] [ticks]
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include <thread.h>
+#include <atomic.h>
+
+/** @brief The number of threads in each ring */
+#define RING_SIZE 4
+/** @brief The largest number of rings */
+#define MAX_RINGS 8
+/** @brief The default number of ticks to run for */
+#define DEFAULT_TICKS 1000
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+
+/** @brief State of a single benchmark thread */
+typedef struct worker {
+    volatile int tid;
+    volatile int tokens;
+    volatile int passes;
+    struct worker* next;
+} worker_t;
+
+/** @brief State shared by all benchmark threads */
+static struct {
+    volatile int started;
+    volatile int done;
+    worker_t workers[MAX_RINGS * RING_SIZE];
+} bench;
+
+/** @brief Hand a token to the next thread in the ring
+ *
+ *  @param self The current thread
+ *  @return void
+ **/
+static void pass_token(worker_t* self)
+{
+    atomic_inc(&self->next->tokens);
+    make_runnable(self->next->tid);
+}
+
+/** @brief Body of a benchmark thread
+ *
+ *  @param arg The worker state of this thread
+ *  @return NULL
+ **/
+static void* worker(void* arg)
+{
+    worker_t* self = (worker_t*)arg;
+    self->tid = gettid();
+    atomic_inc(&bench.started);
+    while (!bench.done) {
+        // returns at once if a token was passed before we got here
+        deschedule((int*)&self->tokens);
+        if (self->tokens == 0) {
+            continue;
+        }
+        atomic_dec(&self->tokens);
+        self->passes++;
+        yield(-1);
+        pass_token(self);
+    }
+    // wake the next thread so that it sees we are done
+    pass_token(self);
+    return NULL;
+}
+
+/** @brief Total the number of passes made by every thread
+ *
+ *  @param threads The number of threads
+ *  @return The number of passes
+ **/
+static int total_passes(int threads)
+{
+    int i, total = 0;
+    for (i = 0; i < threads; i++) {
+        total += bench.workers[i].passes;
+    }
+    return total;
+}
+
+int main(int argc, char** argv)
+{
+    int i, rings = MAX_RINGS, ticks = DEFAULT_TICKS;
+    int tids[MAX_RINGS * RING_SIZE];
+    if (argc > 1) {
+        rings = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        ticks = atoi(argv[2]);
+    }
+    if (rings < 1 || rings > MAX_RINGS || ticks < 1) {
+        printf("usage: sched_bench [rings (1-%d)] [ticks]\n", MAX_RINGS);
+        return -1;
+    }
+    int threads = rings * RING_SIZE;
+    for (i = 0; i < threads; i++) {
+        int ring_start = i - i % RING_SIZE;
+        int next = ring_start + (i + 1) % RING_SIZE;
+        bench.workers[i].next = &bench.workers[next];
+    }
+    thr_init(STACK_SIZE);
+    for (i = 0; i < threads; i++) {
+        tids[i] = thr_create(worker, &bench.workers[i]);
+        if (tids[i] < 0) {
+            printf("sched_bench: could not create thread %d\n", i);
+            return -1;
+        }
+    }
+    while (bench.started < threads) {
+        yield(-1);
+    }
+    // start one token around each ring
+    for (i = 0; i < threads; i += RING_SIZE) {
+        atomic_inc(&bench.workers[i].tokens);
+        make_runnable(bench.workers[i].tid);
+    }
+    int start_passes = total_passes(threads);
+    unsigned int start_ticks = get_ticks();
+    sleep(ticks);
+    int passes = total_passes(threads) - start_passes;
+    unsigned int elapsed = get_ticks() - start_ticks;
+    bench.done = 1;
+    for (i = 0; i < threads; i++) {
+        thr_join(tids[i], NULL);
+    }
+    printf("sched_bench: %d threads, %d passes in %u ticks, %u per tick\n",
+           threads, passes, elapsed, passes / elapsed);
+    thr_exit(NULL);
+    return 0;
+}
@@ -39,9 +39,14 @@ void print_message(int len, int suggest_id)
     mutex_lock(&printer.mutex);
     printer.len = len;
     printer.index = 0;
-    // we should suggest that the print driver prints
+    mutex_unlock(&printer.mutex);
+    // we should suggest that the print driver prints, without the lock since
+    // the suggestion may wait for room in the driver's queue
     udriv_send(suggest_id, 0, 0);
-    cond_wait(&printer.cvar, &printer.mutex);
+    mutex_lock(&printer.mutex);
+    while (printer.index < printer.len) {
+        cond_wait(&printer.cvar, &printer.mutex);
+    }
     mutex_unlock(&printer.mutex);
 }
 
@@ -117,9 +117,8 @@ void print_chars()
  **/
 void* interrupt_loop(void* arg)
 {
-    driv_id_t driv_recv;
-    message_t scancode;
-    unsigned int size;
+    udriv_msg_t msgs[INTERRUPT_BATCH];
+    int i, count;
 
     // register for keyboard driver
     if (udriv_register(serial_driver.keyboard_id,
@@ -132,6 +131,13 @@ void* interrupt_loop(void* arg)
         printf("cannot register for print suggestion server");
         return (void*)-1;
     }
+    // a lost suggestion would leave the printer waiting forever, so make it
+    // wait for room, and leave room for a burst of input
+    if (udriv_config(serial_driver.suggest_id, INTERRUPT_QUEUE,
+                     UDRIV_SEND_BLOCK) < 0) {
+        printf("cannot configure print suggestion server");
+        return (void*)-1;
+    }
 
     int rate = UART_CLOCK / BAUD_RATE;
     write_port(serial_driver.com_port, REG_LINE_CNTL, LCR_DLAB);
@@ -144,21 +150,25 @@ void* interrupt_loop(void* arg)
     write_port(serial_driver.com_port, REG_MOD_CNTL, MOD_CNTL_MASTER_INT);
 
     while (1) {
-        // get scancode
-        if (udriv_wait(&driv_recv, &scancode, &size) < 0) {
+        // get every scancode and print suggestion which has arrived
+        if ((count = udriv_wait_many(msgs, INTERRUPT_BATCH, -1)) < 0) {
             printf("user keyboard interrupt handler failed to get scancode");
             return (void*)-1;
         }
-        if (driv_recv == serial_driver.keyboard_id) {
-            char c = readchar(scancode);
-            handle_char(&serial_driver.keyboard, c, send_to_print);
-            print_chars();
-        } else if (driv_recv == serial_driver.suggest_id) {
-            print_chars();
-        } else {
-            printf("received interrupt from unexpected source");
-            return (void*)-1;
+        for (i = 0; i < count; i++) {
+            if (msgs[i].driver_id == serial_driver.keyboard_id) {
+                char c = readchar(msgs[i].msg);
+                handle_char(&serial_driver.keyboard, c, send_to_print);
+            } else if (msgs[i].driver_id != serial_driver.suggest_id) {
+                printf("received interrupt from unexpected source");
+                return (void*)-1;
+            } else if (msgs[i].has_buffer) {
+                // buffer messages are left queued, so drop it
+                udriv_wait_buf(NULL, NULL, NULL, NULL, 0);
+            }
         }
+        // the characters of the whole batch are printed at once
+        print_chars();
     }
     return NULL;
 }
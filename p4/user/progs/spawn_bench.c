@@ -0,0 +1,100 @@
+/** @file spawn_bench.c
+ *
+ *  @brief Benchmark comparing spawn with fork and exec
+ *
+ *  Starts a child which exits at once a number of times, first with fork
+ *  followed by exec and then with spawn, waiting for each child before
+ *  starting the next. The number of ticks taken by each way is printed.
+ *  spawn never copies the address space of the parent, so it should be
+ *  faster, and more so the larger the parent is.
+ *
+ *  Usage: spawn_bench [rounds]
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+
+/** @brief The default number of children started each way */
+#define DEFAULT_ROUNDS 200
+/** @brief The argument which makes a child exit at once */
+#define CHILD_ARG "-c"
+
+/** @brief The name of this program */
+static char program[] = "spawn_bench";
+/** @brief The arguments of a child */
+static char* child_argv[] = { program, CHILD_ARG, NULL };
+
+/** @brief Start a child with fork and exec
+ *
+ *  @return The tid of the child, or less than zero on failure
+ **/
+static int fork_exec()
+{
+    int tid = fork();
+    if (tid == 0) {
+        exec(program, child_argv);
+        exit(-1);
+    }
+    return tid;
+}
+
+/** @brief Time starting children and waiting for them to exit
+ *
+ *  @param start The way to start a child
+ *  @param rounds The number of children to start
+ *  @return The number of ticks taken, or less than zero on failure
+ **/
+static int time_rounds(int (*start)(), int rounds)
+{
+    int i, status;
+    unsigned int start_ticks = get_ticks();
+    for (i = 0; i < rounds; i++) {
+        if (start() < 0 || wait(&status) < 0 || status != 0) {
+            return -1;
+        }
+    }
+    return get_ticks() - start_ticks;
+}
+
+/** @brief Start a child with spawn
+ *
+ *  @return The tid of the child, or less than zero on failure
+ **/
+static int do_spawn()
+{
+    return spawn(program, child_argv);
+}
+
+int main(int argc, char** argv)
+{
+    int rounds = DEFAULT_ROUNDS;
+    if (argc > 1 && strcmp(argv[1], CHILD_ARG) == 0) {
+        return 0;
+    }
+    if (argc > 1) {
+        rounds = atoi(argv[1]);
+    }
+    if (rounds < 1) {
+        printf("usage: spawn_bench [rounds]\n");
+        return -1;
+    }
+    int forked = time_rounds(fork_exec, rounds);
+    if (forked < 0) {
+        printf("spawn_bench: fork and exec failed\n");
+        return -1;
+    }
+    int spawned = time_rounds(do_spawn, rounds);
+    if (spawned < 0) {
+        printf("spawn_bench: spawn failed\n");
+        return -1;
+    }
+    printf("spawn_bench: %d rounds, fork and exec took %d ticks, "
+           "spawn took %d ticks\n", rounds, forked, spawned);
+    return 0;
+}
@@ -0,0 +1,186 @@
+/** @file udriv_bench.c
+ *
+ *  @brief Benchmark for many clients sending to many servers
+ *
+ *  Each server thread registers a server of its own and drains it with
+ *  udriv_wait_many, while client threads send to the servers in turn with
+ *  udriv_send. Every send looks its server up in the kernel's registry of
+ *  devices and servers, so the number of sends per tick should keep growing
+ *  as clients are added on a machine with more processors.
+ *
+ *  Usage: udriv_bench [servers] [clients] [ticks]
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include <thread.h>
+#include <atomic.h>
+
+/** @brief The largest number of servers */
+#define MAX_SERVERS 8
+/** @brief The largest number of clients */
+#define MAX_CLIENTS 16
+/** @brief The default number of ticks to run for */
+#define DEFAULT_TICKS 500
+/** @brief Stack size of each thread */
+#define STACK_SIZE 4096
+/** @brief The most messages a server takes with one system call */
+#define BATCH 32
+/** @brief The message which tells a server to stop */
+#define MSG_STOP 1
+
+/** @brief State shared by all benchmark threads */
+static struct {
+    int num_servers;
+    volatile int ready;
+    volatile int done;
+    volatile driv_id_t servers[MAX_SERVERS];
+    volatile int received[MAX_SERVERS];
+    volatile int sent[MAX_CLIENTS];
+} bench;
+
+/** @brief Body of a server thread
+ *
+ *  @param arg The index of the server
+ *  @return NULL, or -1 on failure
+ **/
+static void* server(void* arg)
+{
+    int index = (int)arg, i, count;
+    udriv_msg_t msgs[BATCH];
+    driv_id_t id = udriv_register(UDR_ASSIGN_REQUEST, 0, sizeof(message_t));
+    // clients wait for room rather than having their messages dropped
+    if (id >= 0 && udriv_config(id, 0, UDRIV_SEND_BLOCK) < 0) {
+        udriv_deregister(id);
+        id = -1;
+    }
+    bench.servers[index] = id;
+    atomic_inc(&bench.ready);
+    if (id < 0) {
+        return (void*)-1;
+    }
+    while ((count = udriv_wait_many(msgs, BATCH, -1)) >= 0) {
+        for (i = 0; i < count; i++) {
+            if (msgs[i].msg == MSG_STOP) {
+                udriv_deregister(id);
+                return NULL;
+            }
+            bench.received[index]++;
+        }
+    }
+    udriv_deregister(id);
+    return (void*)-1;
+}
+
+/** @brief Body of a client thread
+ *
+ *  @param arg The index of the client
+ *  @return NULL, or -1 on failure
+ **/
+static void* client(void* arg)
+{
+    int index = (int)arg;
+    // clients start on different servers
+    int next = index % bench.num_servers;
+    while (!bench.done) {
+        if (udriv_send(bench.servers[next], 0, sizeof(message_t)) < 0) {
+            return (void*)-1;
+        }
+        bench.sent[index]++;
+        next = (next + 1) % bench.num_servers;
+    }
+    return NULL;
+}
+
+/** @brief Total the number of messages sent by every client
+ *
+ *  @param clients The number of clients
+ *  @return The number of messages
+ **/
+static int total_sent(int clients)
+{
+    int i, total = 0;
+    for (i = 0; i < clients; i++) {
+        total += bench.sent[i];
+    }
+    return total;
+}
+
+int main(int argc, char** argv)
+{
+    int i, servers = 4, clients = 8, ticks = DEFAULT_TICKS;
+    int server_tids[MAX_SERVERS], client_tids[MAX_CLIENTS];
+    void* status;
+    if (argc > 1) {
+        servers = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        clients = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        ticks = atoi(argv[3]);
+    }
+    if (servers < 1 || servers > MAX_SERVERS || clients < 1 ||
+            clients > MAX_CLIENTS || ticks < 1) {
+        printf("usage: udriv_bench [servers (1-%d)] [clients (1-%d)] "
+               "[ticks]\n", MAX_SERVERS, MAX_CLIENTS);
+        return -1;
+    }
+    bench.num_servers = servers;
+    thr_init(STACK_SIZE);
+    for (i = 0; i < servers; i++) {
+        server_tids[i] = thr_create(server, (void*)i);
+        if (server_tids[i] < 0) {
+            printf("udriv_bench: could not create server %d\n", i);
+            return -1;
+        }
+    }
+    while (bench.ready < servers) {
+        yield(-1);
+    }
+    for (i = 0; i < servers; i++) {
+        if (bench.servers[i] < 0) {
+            printf("udriv_bench: could not register server %d\n", i);
+            return -1;
+        }
+    }
+    for (i = 0; i < clients; i++) {
+        client_tids[i] = thr_create(client, (void*)i);
+        if (client_tids[i] < 0) {
+            printf("udriv_bench: could not create client %d\n", i);
+            return -1;
+        }
+    }
+    int start_sent = total_sent(clients);
+    unsigned int start_ticks = get_ticks();
+    sleep(ticks);
+    int sent = total_sent(clients) - start_sent;
+    unsigned int elapsed = get_ticks() - start_ticks;
+    bench.done = 1;
+    int failed = 0;
+    for (i = 0; i < clients; i++) {
+        thr_join(client_tids[i], &status);
+        failed |= (status != NULL);
+    }
+    // the stop message queues behind everything the clients sent
+    for (i = 0; i < servers; i++) {
+        udriv_send(bench.servers[i], MSG_STOP, sizeof(message_t));
+    }
+    for (i = 0; i < servers; i++) {
+        thr_join(server_tids[i], &status);
+        failed |= (status != NULL);
+    }
+    if (failed) {
+        printf("udriv_bench: a client or server failed\n");
+        thr_exit((void*)-1);
+    }
+    printf("udriv_bench: %d servers, %d clients, %d sends in %u ticks, "
+           "%u per tick\n", servers, clients, sent, elapsed, sent / elapsed);
+    thr_exit(NULL);
+    return 0;
+}
@@ -0,0 +1,172 @@
+/** @file udriv_share_test.c
+ *
+ *  @brief Streams bytes through memory shared with udriv_share
+ *
+ *  The parent registers a server and shares a ring buffer through it. A
+ *  forked child maps the ring a second time and fills it, ringing the
+ *  doorbell with udriv_send only when the parent went to sleep waiting for
+ *  data. The number of doorbells needed for the whole stream is printed.
+ *  The console memory is also mapped with udriv_mmap and read back.
+ *
+ *  Usage: udriv_share_test [bytes]
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include <atomic.h>
+#include <udriv_registry.h>
+
+/** @brief Where the server maps the ring */
+#define RING_BASE 0x40000000
+/** @brief Where the client maps the ring */
+#define CLIENT_BASE 0x40400000
+/** @brief Where the console memory is mapped */
+#define CONSOLE_BASE 0x40800000
+/** @brief The physical address of the console memory */
+#define CONSOLE_PHYS 0xB8000
+/** @brief The number of pages in the ring */
+#define RING_PAGES 4
+/** @brief The number of data bytes in the ring */
+#define RING_DATA (RING_PAGES * PAGE_SIZE - 3 * sizeof(int))
+/** @brief The default number of bytes to stream */
+#define DEFAULT_BYTES (1024 * 1024)
+
+/** @brief A single producer single consumer ring in shared memory */
+typedef struct ring {
+    volatile int head;
+    volatile int tail;
+    volatile int sleeping;
+    volatile char data[RING_DATA];
+} ring_t;
+
+/** @brief Fill the ring with a stream of bytes
+ *
+ *  @param ring The client mapping of the ring
+ *  @param server The server to ring the doorbell of
+ *  @param bytes The number of bytes to stream
+ *  @return void
+ **/
+static void produce(ring_t* ring, driv_id_t server, int bytes)
+{
+    int sent;
+    for (sent = 0; sent < bytes; sent++) {
+        while (ring->head - ring->tail == RING_DATA) {
+            yield(-1);
+        }
+        ring->data[ring->head % RING_DATA] = (char)sent;
+        ring->head++;
+        // only wake the server if it is waiting for data
+        if (atomic_xchg(&ring->sleeping, 0)) {
+            udriv_send(server, 0, 0);
+        }
+    }
+}
+
+/** @brief Drain a stream of bytes from the ring
+ *
+ *  @param ring The server mapping of the ring
+ *  @param bytes The number of bytes to expect
+ *  @param doorbells Where to count the doorbells received
+ *  @return Zero on success, less than zero if the stream was corrupted
+ **/
+static int consume(ring_t* ring, int bytes, int* doorbells)
+{
+    int received = 0;
+    while (received < bytes) {
+        if (ring->tail == ring->head) {
+            // a plain store could pass the load of head below, so the
+            // exchange is needed as a full barrier
+            atomic_xchg(&ring->sleeping, 1);
+            // the producer may have filled the ring before seeing us sleep
+            if (ring->tail == ring->head) {
+                if (udriv_wait(NULL, NULL, NULL) < 0) {
+                    return -1;
+                }
+                (*doorbells)++;
+            }
+            continue;
+        }
+        if (ring->data[ring->tail % RING_DATA] != (char)received) {
+            return -1;
+        }
+        ring->tail++;
+        received++;
+    }
+    return 0;
+}
+
+/** @brief Map the console memory and check that it can be read back
+ *
+ *  @return Zero on success, less than zero on failure
+ **/
+static int map_console()
+{
+    volatile char* console = (volatile char*)CONSOLE_BASE;
+    if (udriv_register(UDR_CONSOLE, 0, 0) < 0) {
+        return -1;
+    }
+    if (udriv_mmap((void*)CONSOLE_PHYS, (void*)console, PAGE_SIZE) < 0) {
+        udriv_deregister(UDR_CONSOLE);
+        return -1;
+    }
+    // write back the character already on the screen
+    console[0] = console[0];
+    remove_pages((void*)console);
+    udriv_deregister(UDR_CONSOLE);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    int bytes = DEFAULT_BYTES, doorbells = 0, status;
+    if (argc > 1) {
+        bytes = atoi(argv[1]);
+    }
+    if (bytes < 1) {
+        printf("usage: udriv_share_test [bytes]\n");
+        return -1;
+    }
+    if (map_console() < 0) {
+        printf("udriv_share_test: could not map the console\n");
+        return -1;
+    }
+    driv_id_t server = udriv_register(UDR_ASSIGN_REQUEST, 0, 0);
+    if (server < 0) {
+        printf("udriv_share_test: could not register a server\n");
+        return -1;
+    }
+    ring_t* ring = (ring_t*)RING_BASE;
+    if (udriv_share(server, ring, RING_PAGES * PAGE_SIZE) < 0) {
+        printf("udriv_share_test: could not share the ring\n");
+        return -1;
+    }
+    int tid = fork();
+    if (tid < 0) {
+        printf("udriv_share_test: could not fork\n");
+        return -1;
+    }
+    if (tid == 0) {
+        ring_t* client = (ring_t*)CLIENT_BASE;
+        if (udriv_share(server, client, RING_PAGES * PAGE_SIZE) < 0) {
+            printf("udriv_share_test: client could not map the ring\n");
+            return -1;
+        }
+        produce(client, server, bytes);
+        return 0;
+    }
+    int result = consume(ring, bytes, &doorbells);
+    wait(&status);
+    udriv_deregister(server);
+    if (result < 0 || status != 0) {
+        printf("udriv_share_test: the stream was corrupted\n");
+        return -1;
+    }
+    printf("udriv_share_test: %d bytes through the ring with %d doorbells\n",
+           bytes, doorbells);
+    return 0;
+}
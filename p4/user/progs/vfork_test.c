@@ -0,0 +1,129 @@
+/** @file vfork_test.c
+ *
+ *  @brief Tests vfork and compares it with fork for a large parent
+ *
+ *  First checks that a vfork child runs in its parent's memory before the
+ *  parent resumes, and that its exit status reaches wait. Then a region of
+ *  the given size is allocated and written, and children which exit at
+ *  once are started with fork and exec and then with vfork and exec. The
+ *  number of ticks taken by each way is printed. fork takes longer the
+ *  larger the parent is, while vfork should not.
+ *
+ *  Usage: vfork_test [pages] [rounds]
+ *
+ *  @author Jonathan Ong (jonathao)
+ *  @author Evan Palmer (esp)
+ *  @bug No known bugs.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+
+/** @brief Where the region is allocated */
+#define REGION_BASE 0x40000000
+/** @brief The default number of pages in the region */
+#define DEFAULT_PAGES 4096
+/** @brief The default number of children started each way */
+#define DEFAULT_ROUNDS 100
+/** @brief The argument which makes a child exit at once */
+#define CHILD_ARG "-c"
+/** @brief The status the child of the shared memory check exits with */
+#define CHILD_STATUS 7
+
+/** @brief The name of this program */
+static char program[] = "vfork_test";
+/** @brief The arguments of a child */
+static char* child_argv[] = { program, CHILD_ARG, NULL };
+/** @brief Written by the vfork child of the shared memory check */
+static volatile int child_ran;
+
+/** @brief Check that a vfork child shares memory with its parent
+ *
+ *  @return Zero on success, less than zero on failure
+ **/
+static int check_shared()
+{
+    int status;
+    child_ran = 0;
+    int tid = vfork();
+    if (tid == 0) {
+        child_ran = 1;
+        set_status(CHILD_STATUS);
+        vanish();
+    }
+    if (tid < 0 || !child_ran) {
+        return -1;
+    }
+    if (wait(&status) != tid || status != CHILD_STATUS) {
+        return -1;
+    }
+    return 0;
+}
+
+/** @brief Time starting children with exec and waiting for them to exit
+ *
+ *  @param start fork or vfork
+ *  @param rounds The number of children to start
+ *  @return The number of ticks taken, or less than zero on failure
+ **/
+static int time_rounds(int (*start)(), int rounds)
+{
+    int i, status;
+    unsigned int start_ticks = get_ticks();
+    for (i = 0; i < rounds; i++) {
+        int tid = start();
+        if (tid == 0) {
+            exec(program, child_argv);
+            vanish();
+        }
+        if (tid < 0 || wait(&status) != tid || status != 0) {
+            return -1;
+        }
+    }
+    return get_ticks() - start_ticks;
+}
+
+int main(int argc, char** argv)
+{
+    int i, pages = DEFAULT_PAGES, rounds = DEFAULT_ROUNDS;
+    if (argc > 1 && strcmp(argv[1], CHILD_ARG) == 0) {
+        return 0;
+    }
+    if (argc > 1) {
+        pages = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        rounds = atoi(argv[2]);
+    }
+    if (pages < 0 || rounds < 1) {
+        printf("usage: vfork_test [pages] [rounds]\n");
+        return -1;
+    }
+    if (check_shared() < 0) {
+        printf("vfork_test: vfork child did not share memory\n");
+        return -1;
+    }
+    char* region = (char*)REGION_BASE;
+    if (pages > 0 && new_pages(region, pages * PAGE_SIZE) < 0) {
+        printf("vfork_test: could not allocate %d pages\n", pages);
+        return -1;
+    }
+    for (i = 0; i < pages; i++) {
+        region[i * PAGE_SIZE] = 1;
+    }
+    int forked = time_rounds(fork, rounds);
+    if (forked < 0) {
+        printf("vfork_test: fork and exec failed\n");
+        return -1;
+    }
+    int vforked = time_rounds(vfork, rounds);
+    if (vforked < 0) {
+        printf("vfork_test: vfork and exec failed\n");
+        return -1;
+    }
+    printf("vfork_test: %d pages, %d rounds, fork took %d ticks, "
+           "vfork took %d ticks\n", pages, rounds, forked, vforked);
+    return 0;
+}